@@ -0,0 +1,163 @@
+// crc32c_bench.cpp
+//
+//  Microbenchmark for the packet checksum, reporting GB/s for every CRC32C implementation
+//  and the old additive checksum across the segment sizes a transfer can use
+//
+// Build from the repository root with:
+//  g++ -O2 bench/crc32c_bench.cpp -o crc32c_bench
+
+#include "../crc32c.h"
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+
+// Bytes checksummed per measurement, split into segments of the size being measured
+size_t BYTES_PER_RUN = 256 * 1024 * 1024;
+
+// Segment sizes worth looking at: a small packet, the default and smallest segment, a full
+// 1500 byte MTU, a jumbo frame, and a large buffer
+int BENCH_SEGMENT_SIZES[] = { 64, 512, 1472, 8972, 65536 };
+
+
+// checksum_function
+//
+//  Every implementation continues a checksum over a buffer
+//
+typedef uint32_t (*checksum_function)(uint32_t crc, const char *data, size_t length);
+
+
+// additive_checksum
+//
+//  The byte-at-a-time sum the protocol used before CRC32C, kept for comparison
+//
+uint32_t additive_checksum(uint32_t sum, const char *data, size_t length);
+
+
+// verify_implementation
+//
+//  Check an implementation against the CRC32C check value and the table implementation
+//
+bool verify_implementation(const std::string &name, checksum_function function, const std::vector<char> &data);
+
+
+// measure_throughput
+//
+//  Checksum BYTES_PER_RUN bytes in segments of the given size, returning GB/s
+//
+double measure_throughput(checksum_function function, const std::vector<char> &data, int segment_size);
+
+
+int main() {
+
+    // Random data so no implementation gets lucky with the input, without NUL bytes since the
+    // additive checksum would stop at the first one
+    std::vector<char> data(BENCH_SEGMENT_SIZES[sizeof(BENCH_SEGMENT_SIZES) / sizeof(int) - 1]);
+    srand(4320);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = rand() % 255 + 1;
+    }
+
+    std::vector<std::string> names;
+    std::vector<checksum_function> functions;
+
+    names.push_back("additive");
+    functions.push_back(additive_checksum);
+    names.push_back("slicing-by-8");
+    functions.push_back(crc32c_slicing_by_8);
+
+#if defined(__x86_64__)
+    if (crc32c_hardware_available()) {
+        names.push_back("sse4.2");
+        functions.push_back(crc32c_sse42);
+    }
+#endif
+
+    if (!crc32c_hardware_available()) {
+        std::cout << "[Info] CPU has no SSE4.2, the hardware CRC32C is skipped" << std::endl;
+    }
+
+    for (size_t i = 1; i < functions.size(); i++) {
+        if (!verify_implementation(names[i], functions[i], data)) {
+            return 1;
+        }
+    }
+
+    // One row per segment size, one column of GB/s per implementation
+    std::cout << std::setw(12) << "segment";
+    for (const std::string &name : names) {
+        std::cout << std::setw(16) << name;
+    }
+    std::cout << std::endl;
+
+    for (int segment_size : BENCH_SEGMENT_SIZES) {
+        std::cout << std::setw(12) << segment_size;
+        for (checksum_function function : functions) {
+            std::cout << std::setw(16) << std::fixed << std::setprecision(2) << measure_throughput(function, data, segment_size);
+        }
+        std::cout << std::endl;
+    }
+
+    return 0;
+}
+
+
+// additive_checksum
+//
+//  The byte-at-a-time sum the protocol used before CRC32C, kept for comparison
+//
+uint32_t additive_checksum(uint32_t sum, const char *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] == '\0') break;
+        sum += data[i];
+    }
+    return sum;
+}
+
+
+// verify_implementation
+//
+//  Check an implementation against the CRC32C check value and the table implementation
+//
+bool verify_implementation(const std::string &name, checksum_function function, const std::vector<char> &data) {
+    if (function(0, "123456789", 9) != 0xE3069283) {
+        std::cout << "[Error] " << name << " does not match the CRC32C check value" << std::endl;
+        return false;
+    }
+
+    // Odd lengths and offsets exercise the unaligned head and tail of each implementation
+    for (size_t length = 0; length < 100; length++) {
+        if (function(0, &data[length], length * 7) != crc32c_slicing_by_8(0, &data[length], length * 7)) {
+            std::cout << "[Error] " << name << " disagrees with slicing-by-8 over " << length * 7 << " bytes" << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+// measure_throughput
+//
+//  Checksum BYTES_PER_RUN bytes in segments of the given size, returning GB/s
+//
+double measure_throughput(checksum_function function, const std::vector<char> &data, int segment_size) {
+    size_t segments = BYTES_PER_RUN / segment_size;
+
+    // Every segment's checksum feeds the next so the compiler cannot drop any of the work
+    volatile uint32_t sink = 0;
+    uint32_t checksum = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < segments; i++) {
+        checksum = function(checksum, &data[0], segment_size);
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    sink = checksum;
+    (void)sink;
+
+    return segments * (double)segment_size / elapsed / 1e9;
+}
@@ -0,0 +1,126 @@
+#!/bin/bash
+#
+# loopback_bench.sh
+#
+#  Benchmark driver running the server and client over loopback. Sweeps every file in
+#  test_files/ across a matrix of gremlin loss, damage and delay chances in both transfer
+#  modes, and writes one JSON line per transfer holding the settings, whether the download
+#  matched the original, and the [Metrics] summaries both sides logged.
+#
+# Run from the repository root after building the server and client:
+#  bench/loopback_bench.sh [results.jsonl]
+#
+# The matrix and binaries can be changed through the environment, for example:
+#  LOSS_RATES="0 0.1" MODES=sr REPEAT=3 bench/loopback_bench.sh results.jsonl
+
+SERVER=${SERVER:-./server}
+CLIENT=${CLIENT:-./client}
+FILES=${FILES:-$(ls test_files/*)}
+LOSS_RATES=${LOSS_RATES:-"0 0.01 0.05"}
+DAMAGE_RATES=${DAMAGE_RATES:-"0 0.01 0.05"}
+DELAY_RATES=${DELAY_RATES:-"0 0.01"}
+DELAY_TIME_US=${DELAY_TIME_US:-1000}
+MODES=${MODES:-"gbn sr"}
+REPEAT=${REPEAT:-1}
+
+# Impairment seed, so reruns make the same decisions, and any other server flags such as
+# --reorder or --burst-enter
+SEED=${SEED:-1}
+SERVER_FLAGS=${SERVER_FLAGS:-}
+
+# Client flags used for every transfer, such as --fec rs
+CLIENT_FLAGS=${CLIENT_FLAGS:-}
+
+# Seconds before a transfer that stopped making progress is given up on
+TRANSFER_TIMEOUT_SEC=${TRANSFER_TIMEOUT_SEC:-60}
+
+OUTPUT=${1:-/dev/stdout}
+BUILD=$(git describe --always --dirty 2>/dev/null || echo unknown)
+WORK_DIR=$(mktemp -d)
+SERVER_PID=
+
+# stop_server
+#
+#  Shut the running server down and wait for it to exit
+#
+stop_server() {
+    if [ -n "$SERVER_PID" ]; then
+        kill -TERM "$SERVER_PID" 2>/dev/null
+        wait "$SERVER_PID" 2>/dev/null
+        SERVER_PID=
+    fi
+}
+
+# start_server
+#
+#  Start a server with the given loss, damage and delay chances and wait until it is ready
+#
+start_server() {
+    # Appending lets the log be emptied between transfers while the server keeps writing
+    : > "$WORK_DIR/server.log"
+    "$SERVER" --loss "$1" --damage "$2" --delay "$3" --delay-time "$DELAY_TIME_US" --seed "$SEED" $SERVER_FLAGS --stats-socket "" >> "$WORK_DIR/server.log" 2>&1 &
+    SERVER_PID=$!
+
+    for attempt in $(seq 500); do
+        grep -q "Ready with" "$WORK_DIR/server.log" && return 0
+        kill -0 "$SERVER_PID" 2>/dev/null || break
+        sleep 0.01
+    done
+
+    echo "Server did not start, see its log:" >&2
+    cat "$WORK_DIR/server.log" >&2
+    return 1
+}
+
+# last_metrics
+#
+#  Print the newest JSON summary in a log, or null if there is none
+#
+last_metrics() {
+    local metrics
+    metrics=$(sed -n 's/^\[Metrics\] //p' "$1" | tail -n 1)
+    echo "${metrics:-null}"
+}
+
+trap 'stop_server; rm -rf "$WORK_DIR"' EXIT
+
+for loss in $LOSS_RATES; do
+for damage in $DAMAGE_RATES; do
+for delay in $DELAY_RATES; do
+    start_server "$loss" "$damage" "$delay" || exit 1
+
+    for file in $FILES; do
+    for mode in $MODES; do
+    for run in $(seq "$REPEAT"); do
+        echo "loss $loss damage $damage delay $delay: $mode $file run $run" >&2
+
+        # Every transfer starts from an empty download directory and a fresh server log
+        rm -rf "$WORK_DIR/out"
+        mkdir "$WORK_DIR/out"
+        : > "$WORK_DIR/server.log"
+
+        start_ns=$(date +%s%N)
+        timeout "$TRANSFER_TIMEOUT_SEC" "$CLIENT" --mode "$mode" $CLIENT_FLAGS --output-dir "$WORK_DIR/out" --stats-socket "" 127.0.0.1 "$file" > "$WORK_DIR/client.log" 2>&1
+        client_status=$?
+        wall_time_us=$(( ($(date +%s%N) - start_ns) / 1000 ))
+
+        verified=false
+        if [ $client_status -eq 0 ] && cmp -s "$file" "$WORK_DIR/out/$(basename "$file")"; then
+            verified=true
+        fi
+
+        # The server logs its summary just after the client sees the terminator
+        for attempt in $(seq 100); do
+            grep -q '^\[Metrics\]' "$WORK_DIR/server.log" && break
+            sleep 0.01
+        done
+
+        echo "{\"build\":\"$BUILD\",\"file\":\"$file\",\"mode\":\"$mode\",\"loss\":$loss,\"damage\":$damage,\"delay\":$delay,\"delay_time_us\":$DELAY_TIME_US,\"seed\":$SEED,\"server_flags\":\"$SERVER_FLAGS\",\"client_flags\":\"$CLIENT_FLAGS\",\"run\":$run,\"verified\":$verified,\"wall_time_us\":$wall_time_us,\"server\":$(last_metrics "$WORK_DIR/server.log"),\"client\":$(last_metrics "$WORK_DIR/client.log")}" >> "$OUTPUT"
+    done
+    done
+    done
+
+    stop_server
+done
+done
+done
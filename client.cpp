@@ -8,25 +8,304 @@
 //  Easton Rayner
 
 #include "unp.h"
+#include "crc32c.h"
+#include "logger.h"
+#include "metrics.h"
+#include "fec.h"
+#include "lz.h"
+#include "delta.h"
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <string>
 #include <cstring>
-#include <tuple>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <poll.h>
 #include <bits/stdc++.h>
 
+// Requests and their replies always use SEGMENT_SIZE. For the transfer itself we propose the
+// biggest segment up to segment_size, at most MAX_SEGMENT_SIZE, the largest UDP payload of a
+// 9000 byte jumbo frame, that fits the path MTU, and the server tells us the size it settled on.
 int SEGMENT_SIZE = 512;
+int MAX_SEGMENT_SIZE = 8972;
 int TERMINATOR_BYTE = 1;
 int CHECKSUM_SIZE = 4;
 int PACKET_COUNT_SIZE = 4;
+int PAYLOAD_LENGTH_SIZE = 2;
 int INSTRUCTION_SIZE = 3;
-int HEADER_SIZE = TERMINATOR_BYTE + CHECKSUM_SIZE + PACKET_COUNT_SIZE;
-int DATA_SIZE = SEGMENT_SIZE - HEADER_SIZE;
+int HEADER_SIZE = TERMINATOR_BYTE + CHECKSUM_SIZE + PACKET_COUNT_SIZE + PAYLOAD_LENGTH_SIZE;
+
+// Bytes of IPv4 and UDP header around every segment
+int IP_UDP_HEADER_SIZE = 28;
+
+// Look up the path MTU to the server before proposing a segment size, unless --no-pmtu
+bool PMTU_DISCOVERY = true;
+
+// Lowest level of log line written out. Per-packet lines are LOG_LEVEL_TRACE and
+// LOG_LEVEL_DEBUG, and are compiled out entirely in builds with -DNDEBUG.
+int LOG_LEVEL = LOG_LEVEL_INFO;
+
+// Protocol revision we speak, packet numbers and responses carry full 32-bit numbers since 2
+// and packet headers carry the payload length since 3
+int PROTOCOL_VERSION = 3;
+
+// Largest number of packets we will buffer ahead of the window base, advertised to the server
+int MAX_WINDOW_SIZE = 4096;
+
+int RESPONSE_SIZE = PACKET_COUNT_SIZE + 4;
+
+// In transfers with compression every payload starts with one of these, saying whether the
+// rest of it is the file block as is or LZ compressed. Batch transfers always start payloads
+// with one, and announce each file with a frame. The packets left of a batch file the server
+// could no longer read in full carry nothing but BLOCK_ABORTED.
+int BLOCK_METHOD_SIZE = 1;
+char BLOCK_STORED = 0;
+char BLOCK_COMPRESSED = 1;
+char BLOCK_FRAME = 2;
+char BLOCK_ABORTED = 3;
+
+// Most parts an upload ahead of a request, a batch manifest or the block signatures of a
+// delta, may be sent in, each one request sized datagram
+int MAX_UPLOAD_PARTS = 4096;
+
+// Delta downloads sign the local copy in blocks of DELTA_BLOCK_SIZE bytes, or bigger ones
+// for files that would need more than MAX_DELTA_BLOCKS, so the signatures stay an upload
+// small enough for the server's socket to take in at once. The delta is received next to
+// the file with DELTA_SUFFIX, and the file rebuilt next to it with REBUILD_SUFFIX before it
+// replaces the local copy. Files are read and written DELTA_BUFFER_SIZE bytes at a time
+// while rebuilding.
+int DELTA_BLOCK_SIZE = 2048;
+int MAX_DELTA_BLOCKS = 4096;
+std::string DELTA_SUFFIX = ".delta";
+std::string REBUILD_SUFFIX = ".rebuild";
+int DELTA_BUFFER_SIZE = 1 << 18;
+
+// Number of datagrams moved by a single sendmmsg or recvmmsg call, which the kernel caps at
+// MAX_BATCH_SIZE (UIO_MAXIOV)
+int BATCH_SIZE = 32;
+int MAX_BATCH_SIZE = 1024;
+
+// Downloads keep a sidecar named after the file with this suffix, recording what they have
+// written so an interrupted download resumes where it stopped. It is rewritten at most every
+// PROGRESS_SAVE_INTERVAL_MS and removed once the download is complete.
+std::string PROGRESS_SUFFIX = ".progress";
+int PROGRESS_SAVE_INTERVAL_MS = 500;
+
+// A transfer that goes this long without a packet has stalled, and is asked for again from
+// where it stopped up to RESUME_ATTEMPTS times
+int STALL_TIMEOUT_MS = 10000;
+int RESUME_ATTEMPTS = 5;
+
+// What became of a transfer: the file is written, the server does not have it, nothing
+// arrived for STALL_TIMEOUT_MS, the server sent a newer version than the one we asked for, or
+// the file could not be asked for or written
+int DOWNLOAD_FINISHED = 0;
+int DOWNLOAD_MISSING = 1;
+int DOWNLOAD_STALLED = 2;
+int DOWNLOAD_CHANGED = 3;
+int DOWNLOAD_FAILED = 4;
+
+// send_request result for a request whose file name leaves no room for all of its options
+int REQUEST_TOO_LONG = -2;
+
+// Most streams a parallel download may be split into
+int MAX_STREAMS = 64;
+
+// Most packets one coalesced ACK may answer, and longest it may be held back waiting for them
+int MAX_ACK_EVERY = 64;
+int MAX_ACK_DELAY_US = 100000;
+
+// Unix socket answering with live JSON stats for the transfer in progress is this prefix
+// followed by our process id and ".stats", empty disables it
+std::string STATS_SOCKET_PREFIX = "/tmp/udp_ftp_client.";
 
 char GET_INSTR[4] = "GET";
+char BAT_INSTR[4] = "BAT";
+char SIG_INSTR[4] = "SIG";
 char ACK_INSTR[4] = "ACK";
 char NAK_INSTR[4] = "NAK";
+char CAK_INSTR[4] = "CAK";
+
+// Settings from the command line. Without any files to download we ask for them one by one.
+std::string server_address;
+std::string transfer_mode = "gbn";
+std::string fec_scheme;
+int fec_block = 16;
+int fec_parity = 2;
+bool compress_transfers = false;
+int ack_every = 1;
+int ack_delay_us = 1000;
+int segment_size = MAX_SEGMENT_SIZE;
+bool restart_downloads = false;
+int stream_count = 1;
+bool batch_transfers = false;
+bool delta_transfers = false;
+std::string output_directory;
+std::string stats_socket_path;
+std::vector<std::string> requested_files;
+
+// Metrics of the transfers in progress, one per stream of a parallel download, for the
+// stats socket
+std::mutex current_transfers_mutex;
+std::set<std::shared_ptr<transfer_metrics>> current_transfers;
+
+
+// datagram_batch
+//
+//  Buffers and message headers for moving a batch of datagrams with a single sendmmsg or
+//  recvmmsg call
+//
+struct datagram_batch {
+    std::vector<std::vector<char>> buffers;
+    std::vector<struct iovec> iovecs;
+    std::vector<struct mmsghdr> messages;
+    int buffer_size;
+    int count;
+    int position;
+};
+
+
+// fec_block_state
+//
+//  What has arrived of one block of a transfer with forward error correction: the symbols of
+//  its packets, empty for missing ones, and its parity. count is the number of packets in the
+//  block once a parity packet has told us, or -1. A block we gave up on waits for resends.
+//
+struct fec_block_state {
+    std::vector<std::vector<char>> symbols;
+    int present;
+    int count;
+    std::vector<std::pair<int, std::vector<char>>> parity;
+    bool given_up;
+};
+
+
+// fec_receiver
+//
+//  Forward error correction the server agreed to for a transfer, and the blocks still missing
+//  packets keyed by block number. Symbols code whole payloads of up to payload_size bytes.
+//
+struct fec_receiver {
+    int scheme;
+    int block;
+    int parity;
+    int payload_size;
+    std::map<uint32_t, fec_block_state> blocks;
+};
+
+
+// batch_entry
+//
+//  A file of a batch download whose frame arrived, written to fd. Its packet_count packets
+//  follow the frame, and packets_written of them are in the file so far.
+//
+struct batch_entry {
+    size_t index;
+    std::string filename;
+    int fd;
+    uint32_t frame_packet;
+    uint32_t packet_count;
+    uint32_t packets_written;
+};
+
+
+// batch_download
+//
+//  Files a batch download asked for, in manifest order, with what became of each as one of
+//  the DOWNLOAD_ results. Files whose frame arrived and that are still being written are
+//  kept by frame packet.
+//
+struct batch_download {
+    std::vector<std::string> names;
+    std::vector<int> results;
+    std::map<uint32_t, batch_entry> files;
+};
+
+
+// download_file
+//
+//  File a transfer is written to. Packet N's data goes at N * data_size, decompressed first
+//  into buffer when payloads carry a block method. Batch transfers write each file after its
+//  frame instead.
+//
+struct download_file {
+    int fd;
+    int data_size;
+    bool block_methods;
+    std::vector<char> buffer;
+    batch_download *batch;
+};
+
+
+// download_progress
+//
+//  What a download of one version of a file, named by its etag, has written so far: every
+//  packet of data_size bytes before contiguous, and the ones after it that received marks
+//
+struct download_progress {
+    std::string etag;
+    uint64_t size;
+    int data_size;
+    uint32_t contiguous;
+    std::vector<bool> received;
+};
+
+
+// transfer_stream
+//
+//  A socket to the server and the batches moving datagrams through it. Every stream of a
+//  parallel download has its own, so the server sees each one as a client of its own.
+//
+struct transfer_stream {
+    int sd;
+    struct sockaddr_in server;
+    int proposed_segment_size;
+    datagram_batch receive_batch;
+    datagram_batch response_batch;
+};
+
+
+// transfer_settings
+//
+//  What the server agreed to for a transfer. Every packet but the last carries data_size
+//  bytes of the file in a payload of up to payload_size bytes.
+//
+struct transfer_settings {
+    bool selective_repeat;
+    int segment_size;
+    int fec_scheme;
+    int fec_block;
+    int fec_parity;
+    bool compressed;
+    bool batch;
+    int payload_size;
+    int data_size;
+
+    // Packets received in order are answered ack_every at a time with one cumulative ACK, or
+    // ack_delay_us after the first of them if the rest do not come
+    int ack_every;
+    int ack_delay_us;
+};
+
+
+// download_target
+//
+//  Where a transfer writes: the file, its progress sidecar or empty for none, and the byte
+//  past the last one wanted, UINT64_MAX for the rest of the file. fd is -1 for a transfer
+//  that opens the file itself, or the file the streams of a parallel download share.
+//
+struct download_target {
+    std::string filename;
+    std::string progress_filename;
+    int fd;
+    uint64_t end_byte;
+};
 
 
 // buffToUint32
@@ -45,251 +324,2612 @@ void empty_buffer(char buffer[], int size);
 
 // generate_checksum
 // 
-//  Given a char buffer, generate a checksum and return the value in a provided char[4] buffer
+//  Given a packet number and its payload, generate a CRC32C covering the number, the payload
+//  length and the payload, and return the value in a provided char[4] buffer
 //
-void generate_checksum(char input_buffer[], char output_buffer[]);
+void generate_checksum(uint32_t packet_num, const char data_buffer[], int length, char checksum_buffer[]);
 
-int main(int argc, char **argv) {
 
-    // Poll for target IP address
-    std::string server_address;
-    std::cout << "Server IP Address: " << std::flush;
-    std::getline(std::cin, server_address);
+// parse_response_options
+//
+//  Parse the NUL separated key=value options the server echoed back after its ACK
+//
+std::map<std::string, std::string> parse_response_options(char buffer[], int size);
 
-    // Create our network connection
-    int sd;
-    struct sockaddr_in server;
-    socklen_t serAddrLen;
-    serAddrLen = sizeof(server);
 
-    sd = socket(AF_INET,SOCK_DGRAM,0);
+// append_option
+//
+//  Write a NUL terminated key=value option into a request at the given position, returning
+//  the position just past it, or -1 once the request is full
+//
+int append_option(char packet[], int position, const std::string &option);
 
-    server.sin_family = AF_INET;
-    server.sin_port = htons(SERV_PORT);
-    server.sin_addr.s_addr = inet_addr(server_address.c_str());
 
-    // Create working buffers and file data buffers
-    int n;
-    char message_buffer[SEGMENT_SIZE];
-    std::string input_filename;
-    std::ofstream downloaded_file;
+// sequence_before
+//
+//  Compare two 32-bit packet numbers, staying correct when the numbers wrap around
+//
+bool sequence_before(uint32_t a, uint32_t b);
 
-    char file_data_buffer[DATA_SIZE];
-    char packet_instruction[INSTRUCTION_SIZE];
 
-    char packet_calculated_checksum_buff[CHECKSUM_SIZE];
-    char packet_checksum_buff[CHECKSUM_SIZE];
-    char packet_number_buff[PACKET_COUNT_SIZE];
+// window_ring_size
+//
+//  Round a window size up to a power of two so packet_number % size stays continuous when
+//  packet numbers wrap around
+//
+int window_ring_size(int window_size);
 
-    // Poll infinitely for the file we want to receive,
-    // Construct it if it exists
-    // Retry if the file does not exist on the server
-    while(true) {
-        std::cout << "File name to download: " << std::flush;
-        std::getline(std::cin, input_filename);
 
-        char packet[SEGMENT_SIZE];
-        int expected_sequence_number = 0;
-        
-        //populate "packet" with GET and the file name
-        strcpy(packet, GET_INSTR);
-        memcpy(packet+4, input_filename.c_str(), input_filename.length());
-        
-        sendto(sd, packet, SEGMENT_SIZE, 0, (struct sockaddr*)&server, sizeof(server));
-
-        // Receive a response from the server
-        n = recvfrom(sd, message_buffer, SEGMENT_SIZE, 0, (struct sockaddr*)&server, &serAddrLen);
-        memcpy(packet_instruction, &message_buffer, 4);
-        
-        // Print the response instruction, either ACK or ERR
-        std::cout << "[Info] Server Response: " << packet_instruction << std::endl;
-
-        // Declare a vector to hold all of our file data for sorting packets
-        std::vector<std::tuple<int, std::vector<char>>> file_data_vector;
-
-        // Check if we received an ACK instruction
-        if (strcmp(packet_instruction, ACK_INSTR) == 0) {
-            
-            // File exists
-            std::string downloaded_filename = input_filename.substr(input_filename.find_last_of("/\\") + 1);
-            downloaded_file.open(downloaded_filename);
-
-            // Clear our message buffer
-            empty_buffer(message_buffer, SEGMENT_SIZE);
-
-            for (;;) {
-                // Get packet data
-                n = recvfrom(sd, message_buffer, SEGMENT_SIZE, 0, (struct sockaddr*)&server, &serAddrLen);
-                std::cout << "[Info] Got " << n << " bytes in Response..." << std::endl;
-
-
-                // If the first byte of our buffer is \0, break out of our loop for receiving packets
-                if (message_buffer[0] == '\0') {
-                    break;
-                }
+// init_datagram_batch
+//
+//  Allocate buffers of buffer_size bytes and message headers for a batch of up to BATCH_SIZE
+//  datagrams
+//
+void init_datagram_batch(datagram_batch &batch, int buffer_size);
 
 
-                // Determine the checksum and packet number values
-                std::memcpy(packet_checksum_buff, &message_buffer[1], 4);
-                std::memcpy(packet_number_buff, &message_buffer[5], 4);
+// flush_datagram_batch
+//
+//  Send every datagram queued in the batch with as few sendmmsg calls as possible
+//
+void flush_datagram_batch(int sd, datagram_batch &batch);
+
+
+// next_datagram
+//
+//  Hand out the next received packet from the batch, blocking in a single recvmmsg for as
+//  many packets as are ready whenever it runs dry. Returns NULL if nothing arrives before the
+//  socket's receive timeout.
+//
+char *next_datagram(int sd, datagram_batch &batch, int &length);
 
-                uint32_t packet_number = buffToUint32(packet_number_buff);
-                int packet_sequence_number = packet_number % 64;
 
-                uint32_t packet_checksum = buffToUint32(packet_checksum_buff); 
+// queue_response
+//
+//  Queue an ACK or NAK response carrying the given 32-bit packet number for the server,
+//  counting it in the transfer's metrics
+//
+void queue_response(int sd, datagram_batch &batch, char instruction[], uint32_t packet_number, struct sockaddr_in &server, transfer_metrics &metrics);
 
-                std::cout << "[Info] Got packet sequence number: " << packet_sequence_number << std::endl;
-                std::cout << "[Info] Got packet checksum: " << packet_checksum << std::endl;
 
+// queue_cumulative_ack
+//
+//  Answer every packet received before the window base with one ACK, Go-Back-N's usual one
+//  or a CAK in Selective Repeat, clearing the count of packets waiting for it
+//
+void queue_cumulative_ack(transfer_stream &stream, const transfer_settings &settings, uint32_t expected_sequence_number,
+                          int &coalesced_count, transfer_metrics &metrics);
 
-                // Determine if the incoming packet number is in the correct packet sequence
-                if (packet_sequence_number == expected_sequence_number) {
-                    std::cout << "[Info] Packet was in sequence!"<< std::endl;
-                } else {
-                    std::cout << "[Error] Packet was not in sequence!" << std::endl;
-                    std::cout << "\tGot sequence number " << packet_sequence_number << std::endl;
-                    std::cout << "\tExpected " << expected_sequence_number << std::endl;
 
-                    // Send ACK
-                    std::cout << "\tSending NAK Response..." << std::endl;
-                    std::cout << "\tRequesting Packet #: " << expected_sequence_number << std::endl;
-                    char nack_packet[5];
-                    nack_packet[0] = (uint8_t)(expected_sequence_number);
-                    std::memcpy(nack_packet + 1, NAK_INSTR, 4);
-                    sendto(sd, nack_packet, 5, 0, (struct sockaddr*)&server, sizeof(server));
+// wait_for_datagram
+//
+//  Wait for a datagram to arrive until the deadline, returning false if none did by then
+//
+bool wait_for_datagram(int sd, std::chrono::steady_clock::time_point deadline);
 
-                    // Drop the Packet
-                    continue;
-                }
 
+// probe_path_mtu
+//
+//  Ask the kernel for the path MTU towards an address, returning 0 if it does not know
+//
+int probe_path_mtu(const struct sockaddr_in &peer);
 
-                // Get the raw file data from the message buffer
-                std::memcpy(file_data_buffer, &message_buffer[9], 503);
-                file_data_buffer[DATA_SIZE] = '\0';
-
-                size_t len = strlen(file_data_buffer);
-                char * newBuf = (char *)malloc(len);
-                std::memcpy(newBuf, &file_data_buffer, len);
-
-
-                // Generate the checksum from the packet and make sure it is
-                // correct to the one included in the header
-                generate_checksum(newBuf, packet_calculated_checksum_buff);
-                uint32_t actual_checksum = buffToUint32(packet_calculated_checksum_buff);
-                if(actual_checksum != packet_checksum) {
-                    std::cout << "[Error] Packet Damaged" << std::endl;
-                    std::cout << "\tRecieved: " << actual_checksum << std::endl;
-                    std::cout << "\tExpected: " << packet_checksum << std::endl;
-
-                    // Send NACK
-                    std::cout << "\tSending NAK Response..." << std::endl;
-                    std::cout << "\tRequesting Packet #: " << expected_sequence_number << std::endl;
-                    char nack_packet[5];
-                    nack_packet[0] = (uint8_t)expected_sequence_number;
-                    std::memcpy(nack_packet + 1, NAK_INSTR, 4);
-                    sendto(sd, nack_packet, 5, 0, (struct sockaddr*)&server, sizeof(server));
-
-                    // Drop the packet
-                    continue;
-                } else {
-                    std::cout << "[Info] Packet contents OK" << std::endl;
-                }
 
+// fec_block_for
+//
+//  Get the state of a block, creating it if nothing arrived for it yet
+//
+fec_block_state &fec_block_for(fec_receiver &fec, uint32_t block_number);
+
+
+// store_fec_packet
+//
+//  Keep a received packet's symbol for rebuilding the rest of its block, returning the block
+//  number
+//
+uint32_t store_fec_packet(fec_receiver &fec, uint32_t packet_number, const char payload[], int payload_length);
 
-                // Generate our packet tuple from the incoming packet
-                std::vector<char> file_buffer_vector(newBuf, newBuf + len);
-                std::tuple<uint32_t, std::vector<char>> packet_tuple (packet_number, file_buffer_vector);
+
+// store_fec_parity
+//
+//  Keep a received parity packet for rebuilding the rest of its block
+//
+void store_fec_parity(fec_receiver &fec, uint32_t block_number, const char payload[], int payload_length);
 
 
-                // Append the packet tuple to our vector of file data
-                file_data_vector.push_back(packet_tuple);
+// recover_fec_block
+//
+//  Rebuild a block's missing packets once enough parity is in, adding each packet number and
+//  symbol to recovered. Blocks that are complete afterwards are forgotten.
+//
+void recover_fec_block(fec_receiver &fec, uint32_t block_number, std::vector<std::pair<uint32_t, std::vector<char>>> &recovered);
 
 
-                // Clear all our buffers
-                empty_buffer(message_buffer, 4);
-                empty_buffer(packet_calculated_checksum_buff, 4);
-                empty_buffer(packet_checksum_buff, 4);
-                empty_buffer(packet_number_buff, 4);
+// abandon_fec_blocks
+//
+//  Give up on rebuilding every block before the given one, since all of their parity has
+//  been sent, adding the packets they are missing to missing
+//
+void abandon_fec_blocks(fec_receiver &fec, uint32_t block_number, std::vector<uint32_t> &missing);
 
-                expected_sequence_number = ((expected_sequence_number + 1) % 64);
 
-                // Send ACK Response
-                std::cout << "\tSending ACK Response..." << std::endl;
-                std::cout << "\tRequesting Packet #: " << expected_sequence_number << std::endl;
-                char ack_packet[5];
-                ack_packet[0] = (uint8_t)(expected_sequence_number);
-                std::memcpy(ack_packet + 1, ACK_INSTR, 4);
-                sendto(sd, ack_packet, 5, 0, (struct sockaddr*)&server, sizeof(server));
+// release_fec_blocks
+//
+//  Forget every block whose packets are all before the window base
+//
+void release_fec_blocks(fec_receiver &fec, uint32_t window_base);
+
+
+// write_rebuilt_packets
+//
+//  Write out every packet parity rebuilt as if it had just arrived, ACKing each one in
+//  Selective Repeat, and empty the list
+//
+void write_rebuilt_packets(int sd, datagram_batch &batch, download_file &download, fec_receiver &fec, std::vector<std::pair<uint32_t, std::vector<char>>> &recovered,
+                           std::vector<bool> &packet_received, bool selective_repeat, struct sockaddr_in &server, transfer_metrics &metrics);
+
+
+// write_payload
+//
+//  Write a packet's payload to its place in the file, decompressing it first in compressed
+//  transfers. Returns the file bytes written, -1 if the payload does not decompress, or -2
+//  if it belongs to a file of a batch whose frame has not arrived yet.
+//
+int write_payload(download_file &download, uint32_t packet_number, const char payload[], int payload_length, transfer_metrics &metrics);
+
+
+// open_batch_entry
+//
+//  Start writing the file of a batch that a frame packet announces, or record that the
+//  server does not have it. Returns false if the frame makes no sense.
+//
+bool open_batch_entry(batch_download &batch, uint32_t frame_packet, const char frame[], int frame_length, int data_size);
+
+
+// abort_batch_entry
+//
+//  Throw away what was written of a file of a batch the server could not send in full
+//
+void abort_batch_entry(batch_download &batch, batch_entry &entry);
+
+
+// finish_batch_entry
+//
+//  Close a file of a batch once every one of its packets is written
+//
+void finish_batch_entry(batch_download &batch, std::map<uint32_t, batch_entry>::iterator entry);
+
+
+// read_transfer_settings
+//
+//  Find what the server agreed to for a transfer from the options it echoed in its reply
+//
+void read_transfer_settings(std::map<std::string, std::string> &response_options, int proposed_segment_size, transfer_settings &settings);
+
+
+// log_transfer_settings
+//
+//  Record what the server agreed to in a transfer's metrics and tell the user about it
+//
+void log_transfer_settings(const transfer_settings &settings, transfer_metrics &metrics);
+
+
+// open_transfer_stream
+//
+//  Open a socket to the server for one stream, proposing segments of up to
+//  proposed_segment_size bytes
+//
+void open_transfer_stream(transfer_stream &stream, const struct sockaddr_in &server, int proposed_segment_size);
 
-            }
-            
-            std::cout << "[Info] Terminator packet received, end of transmission" << std::endl;
 
-            std::cout << "[Info] Sorting recieved packet data..." << std::endl;
+// send_request
+//
+//  Ask the server for a file with the transfer options from the command line followed by
+//  extra_options, and wait for its reply. Returns the reply's length, -1 if none came, or
+//  REQUEST_TOO_LONG if the file name leaves no room for every option.
+//
+int send_request(transfer_stream &stream, const std::string &input_filename, const std::vector<std::string> &extra_options,
+                 char reply[], transfer_metrics &metrics);
+
+
+// receive_packets
+//
+//  Receive the packets of a transfer the server agreed to until its terminator arrives,
+//  writing each through download. expected_sequence_number is the window base, and
+//  packet_received marks the packets received ahead of it. Progress is saved to
+//  progress_filename along the way unless it is empty. Returns false if the transfer stalled.
+//
+bool receive_packets(transfer_stream &stream, const transfer_settings &settings, download_file &download,
+                     uint32_t &expected_sequence_number, std::vector<bool> &packet_received, transfer_metrics &metrics,
+                     download_progress &progress, const std::string &progress_filename);
+
+
+// download_range
+//
+//  Download a file, or the part of it up to the target's end_byte, into the target. When
+//  resuming, the server is asked for what progress says is still missing of the version it
+//  names. Returns one of the DOWNLOAD_ results.
+//
+int download_range(transfer_stream &stream, const std::string &input_filename, download_target &target,
+                   download_progress &progress, bool resuming);
+
+
+// send_upload
+//
+//  Send the server what it needs ahead of a request in as few request sized parts as the
+//  items fit in, never splitting an item between parts, counting them in the transfer's
+//  metrics. Returns false if there is too much of it.
+//
+bool send_upload(transfer_stream &stream, const char instruction[], const std::vector<std::string> &items, transfer_metrics &metrics);
+
+
+// send_manifest
+//
+//  Send the server the paths of a batch, returning false if a path cannot be sent
+//
+bool send_manifest(transfer_stream &stream, const std::vector<std::string> &paths, transfer_metrics &metrics);
+
+
+// download_batch
+//
+//  Download every file in files in one transfer, the server sending them back to back.
+//  Files that were written or that the server does not have are taken off the list, so a
+//  stalled batch can be asked for again with what is left. Returns one of the DOWNLOAD_
+//  results.
+//
+int download_batch(transfer_stream &stream, std::vector<std::string> &files);
+
+
+// download_delta
+//
+//  Download only what changed in a file since the complete copy we have of it, rebuilding
+//  the file from our copy and the delta the server sends. Falls back to downloading all of
+//  the file when our copy is too small to sign or cannot be rebuilt. Returns one of the
+//  DOWNLOAD_ results.
+//
+int download_delta(transfer_stream &stream, const std::string &input_filename, const std::string &downloaded_filename);
+
+
+// apply_delta
+//
+//  Write the file a delta describes to output_fd, copying blocks from our copy in local_fd.
+//  Returns false if the delta is malformed, names blocks we do not have or the result does
+//  not match the server's checksum.
+//
+bool apply_delta(int delta_fd, int local_fd, int block_size, int output_fd, uint64_t &copied_bytes);
+
+
+// append_file_bytes
+//
+//  Copy length bytes at offset from one file to the end of what has been written to
+//  output_fd, adding them to the running checksum. Returns false if either file falls short.
+//
+bool append_file_bytes(int from_fd, uint64_t offset, uint64_t length, int output_fd, uint64_t &output_position,
+                       uint32_t &checksum, std::vector<char> &buffer);
+
+
+// download_parallel
+//
+//  Split a file into stream_count ranges and download them at the same time, each over a
+//  stream of its own writing straight to its place in the file. Returns one of the
+//  DOWNLOAD_ results.
+//
+int download_parallel(const struct sockaddr_in &server, int proposed_segment_size, const std::string &input_filename,
+                      const std::string &downloaded_filename);
+
+
+// download_stream
+//
+//  Download one range of a parallel download over a stream of its own, asking for what is
+//  still missing of it again whenever it stalls
+//
+void download_stream(const struct sockaddr_in &server, int proposed_segment_size, const std::string &input_filename,
+                     download_target target, download_progress progress, int &result);
+
+
+// downloaded_path
+//
+//  Where a file downloaded from the server is written: its base name, in the output
+//  directory if there is one
+//
+std::string downloaded_path(const std::string &input_filename);
+
+
+// load_progress
+//
+//  Read the progress sidecar of an earlier download, returning false if there is none or it
+//  makes no sense
+//
+bool load_progress(const std::string &path, download_progress &progress);
+
+
+// note_progress
+//
+//  Record the packets written so far, with the window base at window_base
+//
+void note_progress(download_progress &progress, uint32_t window_base, const std::vector<bool> &packet_received);
+
+
+// save_progress
+//
+//  Write what progress records to the progress sidecar, replacing it in one step so an
+//  interrupted save leaves the previous one in place
+//
+void save_progress(const std::string &path, const download_progress &progress);
+
+
+// restore_progress
+//
+//  Mark the packets an earlier download already wrote as received, for a transfer starting at
+//  start_packet, and return the window base past them
+//
+uint32_t restore_progress(const download_progress &progress, uint32_t start_packet, std::vector<bool> &packet_received);
+
+
+// client_stats_json
+//
+//  Metrics of the transfers in progress as one JSON object, with no transfers between files
+//
+std::string client_stats_json();
+
+
+// parse_arguments
+//
+//  Read the server address, files to download and tunables from the command line, returning
+//  false after printing the usage if they do not make sense
+//
+bool parse_arguments(int argc, char **argv);
+
+
+// print_usage
+//
+//  Describe the command line options
+//
+void print_usage(const char *program);
+
+int main(int argc, char **argv) {
+
+    if (!parse_arguments(argc, argv)) {
+        return 1;
+    }
+
+    // Log lines are written out by a background thread from here on
+    log_start(LOG_LEVEL);
+
+    // Serve live stats to anything that connects to the stats socket
+    stats_socket stats_listener;
+    if (!stats_socket_path.empty()) {
+        if (stats_socket_start(stats_listener, stats_socket_path, client_stats_json)) {
+            LOG_INFO("[Info] Serving live stats on " << stats_socket_path);
+        } else {
+            LOG_ERROR("[Error] Could not open stats socket " << stats_socket_path);
+        }
+    }
+
+    // Propose the biggest segment the path to the server can carry without fragmenting
+    struct sockaddr_in server;
+    server.sin_family = AF_INET;
+    server.sin_port = htons(SERV_PORT);
+    server.sin_addr.s_addr = inet_addr(server_address.c_str());
 
-            // Sort the collected packets based on file packet numbers
-            std::sort(file_data_vector.begin(), file_data_vector.end());
+    int proposed_segment_size = segment_size;
+    int path_mtu = PMTU_DISCOVERY ? probe_path_mtu(server) : 0;
+    if (path_mtu > 0) {
+        proposed_segment_size = std::max(SEGMENT_SIZE, std::min(proposed_segment_size, path_mtu - IP_UDP_HEADER_SIZE));
+        LOG_INFO("[Info] Path MTU to server is " << path_mtu << " bytes");
+    }
+
+    // Create our network connection, parallel downloads open one per stream of their own
+    transfer_stream stream;
+    open_transfer_stream(stream, server, proposed_segment_size);
 
-            std::cout << "[Info] Writing file data..." << std::endl;
+    // Download every file named on the command line, or poll for file names until there are
+    // no more to read, retrying if a file does not exist on the server. A download that
+    // stalled is asked for again before moving on.
+    std::string input_filename;
+    size_t next_file = 0;
+    bool all_downloaded = true;
+    std::string retry_filename;
+    int stalls = 0;
+
+    // A batch asks for every file in one transfer instead, and asks a stalled batch again
+    // for the files it did not get to, leaving nothing for the loop below
+    if (batch_transfers) {
+        std::vector<std::string> remaining_files = requested_files;
+        int result;
+        while ((result = download_batch(stream, remaining_files)) == DOWNLOAD_STALLED && ++stalls < RESUME_ATTEMPTS) {
+            LOG_INFO("[Info] Asking for the " << remaining_files.size() << " files left of the batch again");
+        }
+        if (result == DOWNLOAD_STALLED) {
+            LOG_ERROR("[Error] Giving up on the batch after " << stalls << " stalled attempts");
+        }
+        all_downloaded = result == DOWNLOAD_FINISHED;
+        next_file = requested_files.size();
+    }
 
-            // Write the sorted file packets to the output file
-            for (int i = 0; i< file_data_vector.size(); i++) {
-                std::vector<char> data = std::get<1>(file_data_vector[i]);
-                downloaded_file.write(&data[0], data.size());
+    while(true) {
+        if (!retry_filename.empty()) {
+            input_filename = retry_filename;
+            retry_filename.clear();
+        } else if (!requested_files.empty()) {
+            if (next_file == requested_files.size()) {
+                break;
+            }
+            input_filename = requested_files[next_file++];
+        } else {
+            std::cout << "File name to download: " << std::flush;
+            if (!std::getline(std::cin, input_filename)) {
+                break;
             }
-            
-            // Close the file buffer
-            downloaded_file.close();
+        }
 
-            std::cout << "[Info] Downloaded file written to: " << downloaded_filename << std::endl;
-            
+        std::string downloaded_filename = downloaded_path(input_filename);
+
+        // Pick up where an earlier download of the file stopped, if one left its progress
+        int result;
+        if (stream_count > 1) {
+            result = download_parallel(server, proposed_segment_size, input_filename, downloaded_filename);
+        } else if (delta_transfers && access(downloaded_filename.c_str(), F_OK) == 0 &&
+                   access((downloaded_filename + PROGRESS_SUFFIX).c_str(), F_OK) != 0) {
+            // A complete copy from an earlier download only needs what changed since
+            result = download_delta(stream, input_filename, downloaded_filename);
         } else {
-            std::cout << "[Error] File name does not exist on server, please try again" << std::endl;
+            download_target target = { downloaded_filename, downloaded_filename + PROGRESS_SUFFIX, -1, UINT64_MAX };
+            download_progress progress;
+            bool resuming = (!restart_downloads || stalls > 0) && access(downloaded_filename.c_str(), F_OK) == 0 &&
+                            load_progress(target.progress_filename, progress);
+            result = download_range(stream, input_filename, target, progress, resuming);
         }
 
-        // Clear our file and packet buffers
-        empty_buffer(file_data_buffer, 504);
-        empty_buffer(packet, SEGMENT_SIZE);
+        // Ask for a stalled download again, resuming where it stopped. A parallel download of
+        // a file that changed under it starts over with the new version.
+        if (result != DOWNLOAD_STALLED && result != DOWNLOAD_CHANGED) {
+            all_downloaded &= result == DOWNLOAD_FINISHED;
+            stalls = 0;
+        } else if (++stalls < RESUME_ATTEMPTS) {
+            retry_filename = input_filename;
+        } else {
+            LOG_ERROR("[Error] Giving up on " << input_filename << " after " << stalls << " stalled attempts");
+            all_downloaded = false;
+            stalls = 0;
+        }
     }
 
-    return 0;
+    stats_socket_stop(stats_listener);
+    log_stop();
+    return all_downloaded ? 0 : 1;
 }
 
 
-// buffToUint32
+// client_stats_json
 //
-//  Convert a char[4] buffer to an uint32_t
+//  Metrics of the transfers in progress as one JSON object, with no transfers between files
 //
-uint32_t buffToUint32(char* buffer)
-{
-    int a;
-    memcpy(&a, buffer, sizeof( int ) );
-    return a;
+std::string client_stats_json() {
+    std::lock_guard<std::mutex> lock(current_transfers_mutex);
+    std::string json = "{\"transfers\":[";
+    for (const std::shared_ptr<transfer_metrics> &metrics : current_transfers) {
+        if (json.back() != '[') {
+            json += ",";
+        }
+        json += transfer_metrics_json(*metrics, "active");
+    }
+    return json + "]}";
 }
 
 
-// empty_buffer
+// parse_arguments
 //
-//  Set all cells of a char buffer to NUL character
+//  Read the server address, files to download and tunables from the command line, returning
+//  false after printing the usage if they do not make sense
 //
-void empty_buffer(char buffer[], int size) {
-    for (int i = 0; i < size; i++) {
-        buffer[i] = '\0';
+bool parse_arguments(int argc, char **argv) {
+    struct option options[] = {
+        { "mode", required_argument, NULL, 'm' },
+        { "output-dir", required_argument, NULL, 'o' },
+        { "fec", required_argument, NULL, 'f' },
+        { "fec-block", required_argument, NULL, 'k' },
+        { "fec-parity", required_argument, NULL, 'p' },
+        { "compress", no_argument, NULL, 'z' },
+        { "restart", no_argument, NULL, 'r' },
+        { "streams", required_argument, NULL, 'n' },
+        { "batch", no_argument, NULL, 'b' },
+        { "delta", no_argument, NULL, 'D' },
+        { "ack-every", required_argument, NULL, 'a' },
+        { "ack-delay", required_argument, NULL, 'A' },
+        { "batch-size", required_argument, NULL, 'i' },
+        { "segment-size", required_argument, NULL, 'S' },
+        { "no-pmtu", no_argument, NULL, 'P' },
+        { "log-level", required_argument, NULL, 'v' },
+        { "stats-socket", required_argument, NULL, 's' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    if (!STATS_SOCKET_PREFIX.empty()) {
+        stats_socket_path = STATS_SOCKET_PREFIX + std::to_string(getpid()) + ".stats";
     }
-}
 
+    int option;
+    while ((option = getopt_long(argc, argv, "m:o:f:k:p:zrn:bDa:A:i:S:Pv:s:h", options, NULL)) != -1) {
+        char *end = NULL;
 
-// generate_checksum
-// 
-//  Given a char buffer, generate a checksum and return the value in a provided char[4] buffer
-//
-void generate_checksum(char data_buffer[], char checksum_buffer[]) {
-    uint32_t sum = 0;
-    for(int i = 0; i < DATA_SIZE; i++) {
-        if (data_buffer[i] == '\0') break;
-        sum += data_buffer[i];
+        switch (option) {
+            case 'm':
+                transfer_mode = optarg;
+                if (transfer_mode != "gbn" && transfer_mode != "sr") {
+                    std::cerr << "Transfer mode must be gbn or sr" << std::endl;
+                    return false;
+                }
+                break;
+            case 'o':
+                output_directory = optarg;
+                break;
+            case 'f':
+                fec_scheme = optarg;
+                if (fec_scheme_from_name(fec_scheme) == FEC_NONE) {
+                    std::cerr << "Forward error correction must be xor or rs" << std::endl;
+                    return false;
+                }
+                break;
+            case 'k':
+                fec_block = strtol(optarg, &end, 10);
+                break;
+            case 'p':
+                fec_parity = strtol(optarg, &end, 10);
+                break;
+            case 'z':
+                compress_transfers = true;
+                break;
+            case 'r':
+                restart_downloads = true;
+                break;
+            case 'n':
+                stream_count = strtol(optarg, &end, 10);
+                break;
+            case 'b':
+                batch_transfers = true;
+                break;
+            case 'D':
+                delta_transfers = true;
+                break;
+            case 'a':
+                ack_every = strtol(optarg, &end, 10);
+                break;
+            case 'A':
+                ack_delay_us = strtol(optarg, &end, 10);
+                break;
+            case 'i':
+                BATCH_SIZE = strtol(optarg, &end, 10);
+                break;
+            case 'S':
+                segment_size = strtol(optarg, &end, 10);
+                break;
+            case 'P':
+                PMTU_DISCOVERY = false;
+                break;
+            case 'v':
+                LOG_LEVEL = log_level_from_name(optarg);
+                if (LOG_LEVEL < 0) {
+                    std::cerr << "Unknown log level '" << optarg << "'" << std::endl;
+                    print_usage(argv[0]);
+                    return false;
+                }
+                break;
+            case 's':
+                stats_socket_path = optarg;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+            default:
+                print_usage(argv[0]);
+                return false;
+        }
+
+        if (end != NULL && (end == optarg || *end != '\0')) {
+            std::cerr << "Expected a number for -" << (char)option << ", got '" << optarg << "'" << std::endl;
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+
+    if (fec_block < 1 || fec_block > FEC_MAX_BLOCK) {
+        std::cerr << "Forward error correction blocks must be 1 to " << FEC_MAX_BLOCK << " packets" << std::endl;
+        return false;
     }
-    //std::cout << "Checksum: " << sum << std::endl;
-    memcpy(checksum_buffer, &sum, sizeof(sum));
-}
 
+    if (fec_parity < 1 || fec_parity > FEC_MAX_PARITY) {
+        std::cerr << "Forward error correction parity must be 1 to " << FEC_MAX_PARITY << " packets" << std::endl;
+        return false;
+    }
+
+    if (stream_count < 1 || stream_count > MAX_STREAMS) {
+        std::cerr << "Streams must be 1 to " << MAX_STREAMS << std::endl;
+        return false;
+    }
+
+    if (ack_every < 1 || ack_every > MAX_ACK_EVERY) {
+        std::cerr << "ACKs must answer 1 to " << MAX_ACK_EVERY << " packets" << std::endl;
+        return false;
+    }
+
+    if (ack_delay_us < 0 || ack_delay_us > MAX_ACK_DELAY_US) {
+        std::cerr << "ACK delay must be 0 to " << MAX_ACK_DELAY_US << " us" << std::endl;
+        return false;
+    }
+
+    if (BATCH_SIZE < 1 || BATCH_SIZE > MAX_BATCH_SIZE) {
+        std::cerr << "Batch size must be 1 to " << MAX_BATCH_SIZE << " datagrams" << std::endl;
+        return false;
+    }
+
+    if (segment_size < SEGMENT_SIZE || segment_size > MAX_SEGMENT_SIZE) {
+        std::cerr << "Segment size must be " << SEGMENT_SIZE << " to " << MAX_SEGMENT_SIZE << " bytes" << std::endl;
+        return false;
+    }
+
+    if (optind == argc) {
+        std::cerr << "Missing the server address" << std::endl;
+        print_usage(argv[0]);
+        return false;
+    }
+
+    server_address = argv[optind++];
+    if (inet_addr(server_address.c_str()) == INADDR_NONE) {
+        std::cerr << "Server address must be an IPv4 address, got '" << server_address << "'" << std::endl;
+        return false;
+    }
+
+    requested_files.assign(argv + optind, argv + argc);
+
+    // A batch is the files on the command line, sent back to back over a single stream
+    if (batch_transfers && requested_files.empty()) {
+        std::cerr << "Batch downloads need the files to download on the command line" << std::endl;
+        return false;
+    }
+    if (batch_transfers && stream_count > 1) {
+        std::cerr << "Batch downloads use a single stream" << std::endl;
+        return false;
+    }
+
+    // Deltas are rebuilt from one transfer of a single file
+    if (delta_transfers && (batch_transfers || stream_count > 1)) {
+        std::cerr << "Delta downloads cannot be combined with --batch or --streams" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+
+// print_usage
+//
+//  Describe the command line options
+//
+void print_usage(const char *program) {
+    std::cerr << "Usage: " << program << " [options] SERVER [FILE...]\n"
+              << "Downloads each FILE from SERVER, or asks for file names when none are given\n"
+              << "  -m, --mode MODE            gbn for Go-Back-N or sr for Selective Repeat (default gbn)\n"
+              << "  -o, --output-dir DIR       directory downloads are written to (default .)\n"
+              << "  -f, --fec SCHEME           ask for xor or rs (Reed-Solomon) parity packets\n"
+              << "  -k, --fec-block N          packets per parity block (default 16)\n"
+              << "  -p, --fec-parity N         Reed-Solomon parity packets per block (default 2)\n"
+              << "  -z, --compress             ask the server to compress packets that get smaller for it\n"
+              << "  -r, --restart              start over instead of resuming interrupted downloads\n"
+              << "  -n, --streams N            download each file as N ranges at once over N sockets (default 1)\n"
+              << "  -b, --batch                download every FILE in one transfer, back to back\n"
+              << "  -D, --delta                download only what changed in files we already have\n"
+              << "  -a, --ack-every N          answer N packets received in order with one ACK (default 1)\n"
+              << "  -A, --ack-delay US         longest an ACK waits for the rest of its packets (default 1000)\n"
+              << "  -i, --batch-size N         datagrams moved per sendmmsg or recvmmsg call (default 32)\n"
+              << "  -S, --segment-size BYTES   largest segment to propose, " << SEGMENT_SIZE << " to " << MAX_SEGMENT_SIZE << " (default " << MAX_SEGMENT_SIZE << ")\n"
+              << "  -P, --no-pmtu              propose the segment size as is, without looking up the path MTU\n"
+              << "  -v, --log-level LEVEL      trace, debug, info, error or off (default info)\n"
+              << "  -s, --stats-socket PATH    live stats socket, empty to disable\n"
+              << "                             (default " << STATS_SOCKET_PREFIX << "<pid>.stats)\n"
+              << "  -h, --help                 show this help" << std::endl;
+}
+
+
+// buffToUint32
+//
+//  Convert a char[4] buffer to an uint32_t
+//
+uint32_t buffToUint32(char* buffer)
+{
+    int a;
+    memcpy(&a, buffer, sizeof( int ) );
+    return a;
+}
+
+
+// empty_buffer
+//
+//  Set all cells of a char buffer to NUL character
+//
+void empty_buffer(char buffer[], int size) {
+    for (int i = 0; i < size; i++) {
+        buffer[i] = '\0';
+    }
+}
+
+
+// generate_checksum
+// 
+//  Given a packet number and its payload, generate a CRC32C covering the number, the payload
+//  length and the payload, and return the value in a provided char[4] buffer. Covering the
+//  header fields means a damaged header is caught too, and the payload may hold any bytes
+//  including NUL.
+//
+void generate_checksum(uint32_t packet_num, const char data_buffer[], int length, char checksum_buffer[]) {
+    uint16_t payload_length = length;
+    uint32_t checksum = crc32c(0, (const char *)&packet_num, sizeof(packet_num));
+    checksum = crc32c(checksum, (const char *)&payload_length, sizeof(payload_length));
+    checksum = crc32c(checksum, data_buffer, length);
+    memcpy(checksum_buffer, &checksum, sizeof(checksum));
+}
+
+
+// parse_response_options
+//
+//  Parse the NUL separated key=value options the server echoed back after its ACK
+//
+std::map<std::string, std::string> parse_response_options(char buffer[], int size) {
+    std::map<std::string, std::string> options;
+    int position = 0;
+
+    while (position < size && buffer[position] != '\0') {
+        std::string option(buffer + position, strnlen(buffer + position, size - position));
+        position += option.length() + 1;
+
+        size_t separator = option.find('=');
+        if (separator != std::string::npos) {
+            options[option.substr(0, separator)] = option.substr(separator + 1);
+        }
+    }
+
+    return options;
+}
+
+
+// init_datagram_batch
+//
+//  Allocate buffers of buffer_size bytes and message headers for a batch of up to BATCH_SIZE
+//  datagrams
+//
+void init_datagram_batch(datagram_batch &batch, int buffer_size) {
+    batch.buffers.assign(BATCH_SIZE, std::vector<char>(buffer_size));
+    batch.iovecs.assign(BATCH_SIZE, iovec());
+    batch.messages.assign(BATCH_SIZE, mmsghdr());
+    batch.buffer_size = buffer_size;
+    batch.count = 0;
+    batch.position = 0;
+
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        batch.iovecs[i].iov_base = &batch.buffers[i][0];
+        batch.iovecs[i].iov_len = buffer_size;
+        batch.messages[i].msg_hdr.msg_iov = &batch.iovecs[i];
+        batch.messages[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+
+// flush_datagram_batch
+//
+//  Send every datagram queued in the batch with as few sendmmsg calls as possible
+//
+void flush_datagram_batch(int sd, datagram_batch &batch) {
+    int sent = 0;
+
+    while (sent < batch.count) {
+        int result = sendmmsg(sd, &batch.messages[sent], batch.count - sent, 0);
+        if (result <= 0) {
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("[Error] Failed to send " << batch.count - sent << " responses");
+            break;
+        }
+        sent += result;
+    }
+
+    batch.count = 0;
+}
+
+
+// next_datagram
+//
+//  Hand out the next received packet from the batch, blocking in a single recvmmsg for as
+//  many packets as are ready whenever it runs dry. Returns NULL if nothing arrives before the
+//  socket's receive timeout.
+//
+char *next_datagram(int sd, datagram_batch &batch, int &length) {
+    while (batch.position >= batch.count) {
+        for (int i = 0; i < BATCH_SIZE; i++) {
+            batch.iovecs[i].iov_len = batch.buffer_size;
+            batch.messages[i].msg_hdr.msg_name = NULL;
+            batch.messages[i].msg_hdr.msg_namelen = 0;
+        }
+
+        batch.position = 0;
+        batch.count = recvmmsg(sd, &batch.messages[0], BATCH_SIZE, MSG_WAITFORONE, NULL);
+        if (batch.count < 0) {
+            batch.count = 0;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return NULL;
+            }
+        }
+    }
+
+    int index = batch.position++;
+    char *buffer = &batch.buffers[index][0];
+    length = batch.messages[index].msg_len;
+
+    // The last packet of a file may be shorter than a segment, clear what it did not fill
+    empty_buffer(buffer + length, batch.buffer_size - length);
+
+    return buffer;
+}
+
+
+// queue_response
+//
+//  Queue an ACK or NAK response carrying the given 32-bit packet number for the server,
+//  counting it in the transfer's metrics
+//
+void queue_response(int sd, datagram_batch &batch, char instruction[], uint32_t packet_number, struct sockaddr_in &server, transfer_metrics &metrics) {
+    char *response_packet = &batch.buffers[batch.count][0];
+    std::memcpy(response_packet, &packet_number, PACKET_COUNT_SIZE);
+    std::memcpy(response_packet + PACKET_COUNT_SIZE, instruction, 4);
+
+    batch.iovecs[batch.count].iov_len = RESPONSE_SIZE;
+    batch.messages[batch.count].msg_hdr.msg_name = &server;
+    batch.messages[batch.count].msg_hdr.msg_namelen = sizeof(server);
+    batch.count++;
+
+    metric_add(instruction == NAK_INSTR ? metrics.naks : metrics.acks, 1);
+    metric_add(metrics.segments_sent, 1);
+    metric_add(metrics.bytes_sent, RESPONSE_SIZE);
+
+    if (batch.count == BATCH_SIZE) {
+        flush_datagram_batch(sd, batch);
+    }
+}
+
+
+// queue_cumulative_ack
+//
+//  Answer every packet received before the window base with one ACK, Go-Back-N's usual one
+//  or a CAK in Selective Repeat, clearing the count of packets waiting for it
+//
+void queue_cumulative_ack(transfer_stream &stream, const transfer_settings &settings, uint32_t expected_sequence_number,
+                          int &coalesced_count, transfer_metrics &metrics) {
+    LOG_TRACE("\tSending a cumulative ACK for " << coalesced_count << " packets up to #: " << expected_sequence_number);
+    queue_response(stream.sd, stream.response_batch, settings.selective_repeat ? CAK_INSTR : ACK_INSTR, expected_sequence_number,
+                   stream.server, metrics);
+    coalesced_count = 0;
+}
+
+
+// wait_for_datagram
+//
+//  Wait for a datagram to arrive until the deadline, returning false if none did by then
+//
+bool wait_for_datagram(int sd, std::chrono::steady_clock::time_point deadline) {
+    auto remaining = deadline - std::chrono::steady_clock::now();
+    if (remaining <= std::chrono::steady_clock::duration::zero()) {
+        return false;
+    }
+
+    auto remaining_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(remaining).count();
+    struct timespec timeout = { (time_t)(remaining_ns / 1000000000), (long)(remaining_ns % 1000000000) };
+    struct pollfd readable = { sd, POLLIN, 0 };
+    return ppoll(&readable, 1, &timeout, NULL) != 0;
+}
+
+
+// append_option
+//
+//  Write a NUL terminated key=value option into a request at the given position, returning
+//  the position just past it, or -1 once the request is full
+//
+int append_option(char packet[], int position, const std::string &option) {
+    if (position < 0 || position + (int)option.length() + 1 >= SEGMENT_SIZE) {
+        return -1;
+    }
+
+    std::memcpy(packet + position, option.c_str(), option.length() + 1);
+    return position + option.length() + 1;
+}
+
+
+// sequence_before
+//
+//  Compare two 32-bit packet numbers, staying correct when the numbers wrap around
+//
+bool sequence_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+
+// window_ring_size
+//
+//  Round a window size up to a power of two so packet_number % size stays continuous when
+//  packet numbers wrap around
+//
+int window_ring_size(int window_size) {
+    int size = 1;
+    while (size < window_size) {
+        size <<= 1;
+    }
+    return size;
+}
+
+
+// probe_path_mtu
+//
+//  Ask the kernel for the path MTU towards an address, returning 0 if it does not know.
+//  Connecting a throwaway socket with fragmentation disabled gives us the route's MTU, or
+//  the smaller one learned from ICMP if the path has reported one.
+//
+int probe_path_mtu(const struct sockaddr_in &peer) {
+    int probe_sd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (probe_sd < 0) {
+        return 0;
+    }
+
+    int path_mtu = 0;
+    int discover = IP_PMTUDISC_DO;
+    socklen_t mtu_length = sizeof(path_mtu);
+
+    setsockopt(probe_sd, IPPROTO_IP, IP_MTU_DISCOVER, &discover, sizeof(discover));
+    if (connect(probe_sd, (const struct sockaddr *)&peer, sizeof(peer)) < 0 ||
+        getsockopt(probe_sd, IPPROTO_IP, IP_MTU, &path_mtu, &mtu_length) < 0) {
+        path_mtu = 0;
+    }
+
+    close(probe_sd);
+    return path_mtu;
+}
+
+
+// fec_block_for
+//
+//  Get the state of a block, creating it if nothing arrived for it yet
+//
+fec_block_state &fec_block_for(fec_receiver &fec, uint32_t block_number) {
+    auto found = fec.blocks.find(block_number);
+    if (found != fec.blocks.end()) {
+        return found->second;
+    }
+
+    fec_block_state &block = fec.blocks[block_number];
+    block.symbols.assign(fec.block, std::vector<char>());
+    block.present = 0;
+    block.count = -1;
+    block.given_up = false;
+    return block;
+}
+
+
+// store_fec_packet
+//
+//  Keep a received packet's symbol for rebuilding the rest of its block, returning the block
+//  number
+//
+uint32_t store_fec_packet(fec_receiver &fec, uint32_t packet_number, const char payload[], int payload_length) {
+    uint32_t block_number = packet_number / fec.block;
+    fec_block_state &block = fec_block_for(fec, block_number);
+    std::vector<char> &symbol = block.symbols[packet_number % fec.block];
+
+    if (symbol.empty()) {
+        fec_make_symbol(symbol, payload, payload_length, fec_symbol_size(fec.payload_size));
+        block.present++;
+    }
+
+    return block_number;
+}
+
+
+// store_fec_parity
+//
+//  Keep a received parity packet for rebuilding the rest of its block
+//
+void store_fec_parity(fec_receiver &fec, uint32_t block_number, const char payload[], int payload_length) {
+    int parity_index = (uint8_t)payload[0];
+    int count = (uint8_t)payload[1];
+    if (parity_index >= fec.parity || count < 1 || count > fec.block) {
+        return;
+    }
+
+    fec_block_state &block = fec_block_for(fec, block_number);
+    for (auto &parity : block.parity) {
+        if (parity.first == parity_index) {
+            return;
+        }
+    }
+
+    block.count = count;
+    block.parity.emplace_back(parity_index, std::vector<char>(payload + FEC_HEADER_SIZE, payload + payload_length));
+}
+
+
+// recover_fec_block
+//
+//  Rebuild a block's missing packets once enough parity is in, adding each packet number and
+//  symbol to recovered. Blocks that are complete afterwards are forgotten.
+//
+void recover_fec_block(fec_receiver &fec, uint32_t block_number, std::vector<std::pair<uint32_t, std::vector<char>>> &recovered) {
+    auto found = fec.blocks.find(block_number);
+    if (found == fec.blocks.end()) {
+        return;
+    }
+
+    fec_block_state &block = found->second;
+    int count = block.count < 0 ? fec.block : block.count;
+
+    if (block.count >= 0 && block.present < count && count - block.present <= (int)block.parity.size()) {
+        std::vector<bool> was_missing(count);
+        for (int i = 0; i < count; i++) {
+            was_missing[i] = block.symbols[i].empty();
+        }
+
+        if (fec_recover(fec.scheme, count, fec_symbol_size(fec.payload_size), block.symbols, block.parity)) {
+            for (int i = 0; i < count; i++) {
+                if (was_missing[i]) {
+                    recovered.emplace_back(block_number * fec.block + i, std::move(block.symbols[i]));
+                }
+            }
+            block.present = count;
+        }
+    }
+
+    if (block.present >= count) {
+        fec.blocks.erase(found);
+    }
+}
+
+
+// abandon_fec_blocks
+//
+//  Give up on rebuilding every block before the given one, since all of their parity has
+//  been sent, adding the packets they are missing to missing
+//
+void abandon_fec_blocks(fec_receiver &fec, uint32_t block_number, std::vector<uint32_t> &missing) {
+    for (auto &entry : fec.blocks) {
+        if (entry.first >= block_number) {
+            break;
+        }
+
+        fec_block_state &block = entry.second;
+        if (block.given_up) {
+            continue;
+        }
+        block.given_up = true;
+
+        int count = block.count < 0 ? fec.block : block.count;
+        for (int i = 0; i < count; i++) {
+            if (block.symbols[i].empty()) {
+                missing.push_back(entry.first * fec.block + i);
+            }
+        }
+    }
+}
+
+
+// release_fec_blocks
+//
+//  Forget every block whose packets are all before the window base
+//
+void release_fec_blocks(fec_receiver &fec, uint32_t window_base) {
+    while (!fec.blocks.empty()) {
+        auto oldest = fec.blocks.begin();
+        int count = oldest->second.count < 0 ? fec.block : oldest->second.count;
+        if (sequence_before(oldest->first * fec.block + count - 1, window_base)) {
+            fec.blocks.erase(oldest);
+        } else {
+            break;
+        }
+    }
+}
+
+
+// write_rebuilt_packets
+//
+//  Write out every packet parity rebuilt as if it had just arrived, ACKing each one in
+//  Selective Repeat, and empty the list
+//
+void write_rebuilt_packets(int sd, datagram_batch &batch, download_file &download, fec_receiver &fec, std::vector<std::pair<uint32_t, std::vector<char>>> &recovered,
+                           std::vector<bool> &packet_received, bool selective_repeat, struct sockaddr_in &server, transfer_metrics &metrics) {
+    for (auto &rebuilt : recovered) {
+        int slot = rebuilt.first % packet_received.size();
+        int length = fec_symbol_length(rebuilt.second);
+        if (packet_received[slot] || length > fec.payload_size) {
+            continue;
+        }
+
+        LOG_DEBUG("[Info] Rebuilt packet " << rebuilt.first << " from parity");
+        if (write_payload(download, rebuilt.first, &rebuilt.second[2], length, metrics) < 0) {
+            continue;
+        }
+        metric_add(metrics.fec_recovered, 1);
+        packet_received[slot] = true;
+
+        if (selective_repeat) {
+            queue_response(sd, batch, ACK_INSTR, rebuilt.first, server, metrics);
+        }
+    }
+
+    recovered.clear();
+}
+
+
+// write_payload
+//
+//  Write a packet's payload to its place in the file, decompressing it first in compressed
+//  transfers. Returns the file bytes written, -1 if the payload does not decompress, or -2
+//  if it belongs to a file of a batch whose frame has not arrived yet.
+//
+int write_payload(download_file &download, uint32_t packet_number, const char payload[], int payload_length, transfer_metrics &metrics) {
+    const char *data = payload;
+    int data_length = payload_length;
+    int fd = download.fd;
+    off_t file_offset = (off_t)packet_number * download.data_size;
+
+    // A batch announces each file with a frame, and the file's data follows it. Packets
+    // arriving ahead of their file's frame are left for the server to send again.
+    std::map<uint32_t, batch_entry>::iterator entry;
+    if (download.batch != NULL) {
+        if (payload_length >= BLOCK_METHOD_SIZE && payload[0] == BLOCK_FRAME) {
+            return open_batch_entry(*download.batch, packet_number, payload + BLOCK_METHOD_SIZE, payload_length - BLOCK_METHOD_SIZE,
+                                    download.data_size) ? 0 : -1;
+        }
+
+        entry = download.batch->files.lower_bound(packet_number);
+        if (entry == download.batch->files.begin() ||
+            sequence_before(std::prev(entry)->second.frame_packet + std::prev(entry)->second.packet_count, packet_number)) {
+            LOG_DEBUG("[Info] Packet " << packet_number << " arrived ahead of its file's frame");
+            return -2;
+        }
+        entry = std::prev(entry);
+
+        // The rest of a file the server could not send in full carries no data, only the
+        // file's packet count still has to be made up
+        if (payload_length >= BLOCK_METHOD_SIZE && payload[0] == BLOCK_ABORTED) {
+            abort_batch_entry(*download.batch, entry->second);
+            if (++entry->second.packets_written == entry->second.packet_count) {
+                finish_batch_entry(*download.batch, entry);
+            }
+            return 0;
+        }
+
+        fd = entry->second.fd;
+        file_offset = (off_t)(packet_number - entry->second.frame_packet - 1) * download.data_size;
+    }
+
+    if (download.block_methods) {
+        if (payload_length < BLOCK_METHOD_SIZE || (payload[0] != BLOCK_STORED && payload[0] != BLOCK_COMPRESSED)) {
+            LOG_ERROR("[Error] Packet " << packet_number << " has an unknown block method");
+            return -1;
+        }
+
+        data = payload + BLOCK_METHOD_SIZE;
+        data_length = payload_length - BLOCK_METHOD_SIZE;
+
+        if (payload[0] == BLOCK_COMPRESSED) {
+            data_length = lz_decompress(data, data_length, &download.buffer[0], download.data_size);
+            if (data_length < 0) {
+                LOG_ERROR("[Error] Packet " << packet_number << " does not decompress");
+                return -1;
+            }
+            metric_add(metrics.compressed_segments, 1);
+            metric_add(metrics.compression_saved_bytes, data_length + BLOCK_METHOD_SIZE - payload_length);
+            data = &download.buffer[0];
+        }
+    }
+
+    // Files of a batch that could not be opened are still read through to the next frame
+    if (fd >= 0 && pwrite(fd, data, data_length, file_offset) != data_length) {
+        LOG_ERROR("[Error] Could not write packet " << packet_number << ": " << strerror(errno));
+    }
+    metric_add(metrics.bytes_delivered, data_length);
+
+    if (download.batch != NULL && ++entry->second.packets_written == entry->second.packet_count) {
+        finish_batch_entry(*download.batch, entry);
+    }
+
+    return data_length;
+}
+
+
+// open_batch_entry
+//
+//  Start writing the file of a batch that a frame packet announces, or record that the
+//  server does not have it. Returns false if the frame makes no sense. A frame holds the
+//  file's index in the manifest, whether the server has it, its size and its etag as NUL
+//  separated key=value options. Empty files are complete as soon as their frame arrives.
+//
+bool open_batch_entry(batch_download &batch, uint32_t frame_packet, const char frame[], int frame_length, int data_size) {
+    std::map<std::string, std::string> options = parse_response_options((char *)frame, frame_length);
+
+    size_t index = strtoul(options["file"].c_str(), NULL, 10);
+    if (options["file"].empty() || index >= batch.names.size()) {
+        LOG_ERROR("[Error] Packet " << frame_packet << " announces a file that is not in the batch");
+        return false;
+    }
+
+    const std::string &name = batch.names[index];
+    if (options["status"] != "ok") {
+        LOG_ERROR("[Error] " << name << " does not exist on the server");
+        batch.results[index] = DOWNLOAD_MISSING;
+        return true;
+    }
+
+    uint64_t size = strtoull(options["size"].c_str(), NULL, 10);
+    batch_entry &entry = batch.files[frame_packet];
+    entry.index = index;
+    entry.filename = downloaded_path(name);
+    entry.frame_packet = frame_packet;
+    entry.packet_count = (size + data_size - 1) / data_size;
+    entry.packets_written = 0;
+
+    entry.fd = open(entry.filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (entry.fd < 0) {
+        LOG_ERROR("[Error] Could not open " << entry.filename << ": " << strerror(errno));
+    }
+    LOG_DEBUG("[Info] Receiving " << name << " as packets " << frame_packet + 1 << " to " << frame_packet + entry.packet_count);
+
+    if (entry.packet_count == 0) {
+        finish_batch_entry(batch, batch.files.find(frame_packet));
+    }
+    return true;
+}
+
+
+// abort_batch_entry
+//
+//  Throw away what was written of a file of a batch the server could not send in full. Its
+//  remaining packets are still counted, but written nowhere, and the file ends up failed.
+//
+void abort_batch_entry(batch_download &batch, batch_entry &entry) {
+    if (entry.fd < 0) {
+        return;
+    }
+
+    LOG_ERROR("[Error] " << batch.names[entry.index] << " changed on the server while it was being sent");
+    close(entry.fd);
+    unlink(entry.filename.c_str());
+    entry.fd = -1;
+}
+
+
+// finish_batch_entry
+//
+//  Close a file of a batch once every one of its packets is written
+//
+void finish_batch_entry(batch_download &batch, std::map<uint32_t, batch_entry>::iterator entry) {
+    if (entry->second.fd >= 0) {
+        close(entry->second.fd);
+        batch.results[entry->second.index] = DOWNLOAD_FINISHED;
+        LOG_INFO("[Info] Downloaded file written to: " << entry->second.filename);
+    } else {
+        batch.results[entry->second.index] = DOWNLOAD_FAILED;
+    }
+    batch.files.erase(entry);
+}
+
+
+// read_transfer_settings
+//
+//  Find what the server agreed to for a transfer from the options it echoed in its reply
+//
+void read_transfer_settings(std::map<std::string, std::string> &response_options, int proposed_segment_size, transfer_settings &settings) {
+    // The server only uses Selective Repeat if it echoed the mode back to us
+    settings.selective_repeat = response_options["mode"] == "sr";
+
+    // Servers that did not answer our proposal send the default segment size
+    settings.segment_size = SEGMENT_SIZE;
+    if (!response_options["seg"].empty()) {
+        settings.segment_size = std::max(SEGMENT_SIZE, std::min(proposed_segment_size, std::atoi(response_options["seg"].c_str())));
+    }
+
+    // Forward error correction is on if the server echoed a scheme, with the block and
+    // parity sizes it settled on
+    settings.fec_scheme = fec_scheme_from_name(response_options["fec"]);
+    settings.fec_block = std::max(1, std::min(FEC_MAX_BLOCK, std::atoi(response_options["fec_block"].c_str())));
+    settings.fec_parity = std::max(1, std::min(FEC_MAX_PARITY, std::atoi(response_options["fec_parity"].c_str())));
+
+    // Compression is on if the server echoed it, and a batch if the server echoed how many
+    // files it holds. Either puts a block method ahead of every payload.
+    settings.compressed = response_options["comp"] == "lz";
+    settings.batch = !response_options["batch"].empty();
+
+    // ACKs are only coalesced if the server echoed how many packets one may answer, servers
+    // that did not still expect every packet answered
+    settings.ack_every = std::max(1, std::min(MAX_ACK_EVERY, std::atoi(response_options["ack_every"].c_str())));
+    settings.ack_delay_us = std::max(0, std::min(MAX_ACK_DELAY_US, std::atoi(response_options["ack_delay"].c_str())));
+
+    // Every packet but the last carries data_size bytes of the file, so packet N starts at
+    // N * data_size. With forward error correction payloads leave room for parity to code
+    // their length, and compressed or batch payloads for their block method.
+    settings.payload_size = settings.segment_size - HEADER_SIZE - (settings.fec_scheme != FEC_NONE ? FEC_OVERHEAD : 0);
+    settings.data_size = settings.payload_size - (settings.compressed || settings.batch ? BLOCK_METHOD_SIZE : 0);
+}
+
+
+// log_transfer_settings
+//
+//  Record what the server agreed to in a transfer's metrics and tell the user about it
+//
+void log_transfer_settings(const transfer_settings &settings, transfer_metrics &metrics) {
+    metrics.mode = settings.selective_repeat ? "sr" : "gbn";
+    metrics.segment_size = settings.segment_size;
+    LOG_INFO("[Info] Receiving " << settings.segment_size << " byte segments");
+
+    if (settings.fec_scheme != FEC_NONE) {
+        metrics.fec = std::string(fec_scheme_name(settings.fec_scheme)) + ":" + std::to_string(settings.fec_block) + "+" + std::to_string(settings.fec_parity);
+        LOG_INFO("[Info] Server follows every " << settings.fec_block << " packets with " << settings.fec_parity << " "
+                 << fec_scheme_name(settings.fec_scheme) << " parity packets");
+    }
+
+    if (settings.compressed) {
+        metrics.compression = "lz";
+        LOG_INFO("[Info] Server compresses packets that get smaller for it");
+    }
+
+    if (settings.ack_every > 1) {
+        LOG_INFO("[Info] Answering every " << settings.ack_every << " packets in order with one ACK, or after "
+                 << settings.ack_delay_us << " us");
+    }
+}
+
+
+// open_transfer_stream
+//
+//  Open a socket to the server for one stream, proposing segments of up to
+//  proposed_segment_size bytes
+//
+void open_transfer_stream(transfer_stream &stream, const struct sockaddr_in &server, int proposed_segment_size) {
+    stream.sd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    // Waiting on the server gives up after STALL_TIMEOUT_MS, so stalled transfers can resume
+    struct timeval stall_timeout = { STALL_TIMEOUT_MS / 1000, (STALL_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(stream.sd, SOL_SOCKET, SO_RCVTIMEO, &stall_timeout, sizeof(stall_timeout));
+
+    stream.server = server;
+    stream.proposed_segment_size = proposed_segment_size;
+
+    // Packets come in and responses go out a batch at a time
+    init_datagram_batch(stream.receive_batch, proposed_segment_size);
+    init_datagram_batch(stream.response_batch, SEGMENT_SIZE);
+}
+
+
+// send_request
+//
+//  Ask the server for a file with the transfer options from the command line followed by
+//  extra_options, and wait for its reply. Returns the reply's length, -1 if none came, or
+//  REQUEST_TOO_LONG if the file name leaves no room for every option.
+//
+int send_request(transfer_stream &stream, const std::string &input_filename, const std::vector<std::string> &extra_options,
+                 char reply[], transfer_metrics &metrics) {
+    char packet[SEGMENT_SIZE];
+
+    //populate "packet" with GET, the file name and our requested transfer options
+    empty_buffer(packet, SEGMENT_SIZE);
+    strcpy(packet, GET_INSTR);
+
+    int options_position = -1;
+    if (4 + (int)input_filename.length() + 1 < SEGMENT_SIZE) {
+        memcpy(packet+4, input_filename.c_str(), input_filename.length());
+        options_position = 4 + input_filename.length() + 1;
+    }
+
+    options_position = append_option(packet, options_position, "ver=" + std::to_string(PROTOCOL_VERSION));
+    options_position = append_option(packet, options_position, "win=" + std::to_string(MAX_WINDOW_SIZE));
+    options_position = append_option(packet, options_position, "seg=" + std::to_string(stream.proposed_segment_size));
+
+    if (transfer_mode == "sr") {
+        options_position = append_option(packet, options_position, "mode=sr");
+    }
+
+    if (!fec_scheme.empty()) {
+        options_position = append_option(packet, options_position, "fec=" + fec_scheme);
+        options_position = append_option(packet, options_position, "fec_block=" + std::to_string(fec_block));
+        options_position = append_option(packet, options_position, "fec_parity=" + std::to_string(fec_parity));
+    }
+
+    if (compress_transfers) {
+        options_position = append_option(packet, options_position, "comp=lz");
+    }
+
+    if (ack_every > 1) {
+        options_position = append_option(packet, options_position, "ack_every=" + std::to_string(ack_every));
+        options_position = append_option(packet, options_position, "ack_delay=" + std::to_string(ack_delay_us));
+    }
+
+    for (const std::string &option : extra_options) {
+        options_position = append_option(packet, options_position, option);
+    }
+
+    // Sent without some of its options, the protocol version among them, the request would
+    // only be turned down as if the file did not exist
+    if (options_position < 0) {
+        LOG_ERROR("[Error] The name " << input_filename << " is too long to ask the server for");
+        return REQUEST_TOO_LONG;
+    }
+
+    // Time to first byte counts from the request
+    metrics.start_time = std::chrono::steady_clock::now();
+    sendto(stream.sd, packet, SEGMENT_SIZE, 0, (struct sockaddr*)&stream.server, sizeof(stream.server));
+    metric_add(metrics.segments_sent, 1);
+    metric_add(metrics.bytes_sent, SEGMENT_SIZE);
+
+    // Receive a response from the server, the only round trip the client can time. Packets
+    // still arriving from an earlier stalled attempt are skipped.
+    int n;
+    socklen_t serAddrLen = sizeof(stream.server);
+    do {
+        empty_buffer(reply, SEGMENT_SIZE);
+        n = recvfrom(stream.sd, reply, SEGMENT_SIZE, 0, (struct sockaddr*)&stream.server, &serAddrLen);
+    } while (n > 0 && strcmp(reply, ACK_INSTR) != 0 && strcmp(reply, NAK_INSTR) != 0);
+    histogram_record(metrics.rtt_us, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - metrics.start_time).count());
+
+    return n;
+}
+
+
+// receive_packets
+//
+//  Receive the packets of a transfer the server agreed to until its terminator arrives,
+//  writing each through download. expected_sequence_number is the window base, and
+//  packet_received marks the packets received ahead of it. Progress is saved to
+//  progress_filename along the way unless it is empty. Returns false if the transfer stalled.
+//
+bool receive_packets(transfer_stream &stream, const transfer_settings &settings, download_file &download,
+                     uint32_t &expected_sequence_number, std::vector<bool> &packet_received, transfer_metrics &metrics,
+                     download_progress &progress, const std::string &progress_filename) {
+    int n;
+    char packet_calculated_checksum_buff[CHECKSUM_SIZE];
+    char packet_checksum_buff[CHECKSUM_SIZE];
+    char packet_number_buff[PACKET_COUNT_SIZE];
+    uint16_t payload_length;
+    bool stalled = false;
+
+    bool selective_repeat = settings.selective_repeat;
+    int payload_size = settings.payload_size;
+    int ring_size = packet_received.size();
+
+    fec_receiver fec;
+    fec.scheme = settings.fec_scheme;
+    fec.block = settings.fec_block;
+    fec.parity = settings.fec_parity;
+    fec.payload_size = payload_size;
+
+    int symbol_size = fec_symbol_size(payload_size);
+    std::vector<std::pair<uint32_t, std::vector<char>>> recovered;
+    std::vector<uint32_t> missing;
+
+    auto last_progress_save = std::chrono::steady_clock::now();
+
+    // Packets received in order since our last cumulative ACK, and when the first of them
+    // arrived
+    bool coalescing = settings.ack_every > 1;
+    int coalesced_count = 0;
+    auto coalesced_since = std::chrono::steady_clock::now();
+
+    for (;;) {
+        // Send our queued responses before waiting on more packets, answering the packets
+        // owed a coalesced ACK once its delay runs out with nothing more arriving
+        if (stream.receive_batch.position == stream.receive_batch.count) {
+            if (coalesced_count > 0 && !wait_for_datagram(stream.sd, coalesced_since + std::chrono::microseconds(settings.ack_delay_us))) {
+                queue_cumulative_ack(stream, settings, expected_sequence_number, coalesced_count, metrics);
+            }
+            flush_datagram_batch(stream.sd, stream.response_batch);
+        }
+
+        // Get packet data, the last packet of a file may be shorter than a segment
+        char *packet_buffer = next_datagram(stream.sd, stream.receive_batch, n);
+        if (packet_buffer == NULL) {
+            LOG_ERROR("[Error] Nothing arrived for " << STALL_TIMEOUT_MS << " ms, transfer stalled at packet " << expected_sequence_number);
+            stalled = true;
+            break;
+        }
+        LOG_TRACE("[Info] Got " << n << " bytes in Response...");
+
+
+        // If the first byte of our buffer is \0, break out of our loop for receiving packets
+        if (packet_buffer[0] == '\0') {
+            break;
+        }
+
+        mark_first_byte(metrics);
+        metric_add(metrics.bytes_received, n);
+        metric_add(metrics.segments_received, 1);
+
+
+        // Determine the checksum, packet number and payload length values
+        std::memcpy(packet_checksum_buff, &packet_buffer[TERMINATOR_BYTE], CHECKSUM_SIZE);
+        std::memcpy(packet_number_buff, &packet_buffer[TERMINATOR_BYTE+CHECKSUM_SIZE], PACKET_COUNT_SIZE);
+        std::memcpy(&payload_length, &packet_buffer[TERMINATOR_BYTE+CHECKSUM_SIZE+PACKET_COUNT_SIZE], PAYLOAD_LENGTH_SIZE);
+
+        uint32_t packet_number = buffToUint32(packet_number_buff);
+        uint32_t packet_sequence_number = packet_number;
+
+        uint32_t packet_checksum = buffToUint32(packet_checksum_buff); 
+
+        LOG_TRACE("[Info] Got packet sequence number: " << packet_sequence_number);
+        LOG_TRACE("[Info] Got packet checksum: " << packet_checksum);
+
+
+        // Parity packets rebuild what is missing of their block, and are never answered
+        if (fec.scheme != FEC_NONE && packet_buffer[0] == FEC_PARITY_TERM) {
+            const char *parity_payload = &packet_buffer[HEADER_SIZE];
+            bool parity_valid = n == HEADER_SIZE + FEC_HEADER_SIZE + symbol_size && payload_length == n - HEADER_SIZE;
+
+            generate_checksum(packet_number, parity_payload, parity_valid ? payload_length : 0, packet_calculated_checksum_buff);
+            if (!parity_valid || buffToUint32(packet_calculated_checksum_buff) != packet_checksum) {
+                LOG_DEBUG("[Error] Parity packet for block " << packet_number << " damaged");
+                metric_add(metrics.damaged, 1);
+                continue;
+            }
+
+            LOG_TRACE("[Info] Got parity packet for block " << packet_number);
+            metric_add(metrics.fec_parity, 1);
+
+            // Parity for a block we already have all of is of no more use
+            if (sequence_before((packet_number + 1) * fec.block - 1, expected_sequence_number)) {
+                continue;
+            }
+
+            store_fec_parity(fec, packet_number, parity_payload, payload_length);
+            recover_fec_block(fec, packet_number, recovered);
+            if (recovered.empty()) {
+                continue;
+            }
+            write_rebuilt_packets(stream.sd, stream.response_batch, download, fec, recovered, packet_received, selective_repeat, stream.server, metrics);
+
+            // Slide the window base over every packet received so far
+            while (packet_received[expected_sequence_number % ring_size]) {
+                packet_received[expected_sequence_number % ring_size] = false;
+                expected_sequence_number++;
+            }
+            release_fec_blocks(fec, expected_sequence_number);
+
+            if (!selective_repeat) {
+                queue_cumulative_ack(stream, settings, expected_sequence_number, coalesced_count, metrics);
+            }
+            continue;
+        }
+
+
+        // How far past the window base the incoming packet is
+        uint32_t window_offset = packet_sequence_number - expected_sequence_number;
+
+        // Determine if the incoming packet number is in the correct packet sequence.
+        // With forward error correction Go-Back-N keeps packets after a gap too, since
+        // parity may still fill the gap in.
+        if (selective_repeat || fec.scheme != FEC_NONE) {
+            if (window_offset >= (uint32_t)MAX_WINDOW_SIZE) {
+                // Packets before the window base were already received, our ACK
+                // must have been lost so ACK them again
+                if (sequence_before(packet_sequence_number, expected_sequence_number)) {
+                    LOG_TRACE("[Info] Packet was already received, resending ACK");
+                    metric_add(metrics.duplicates, 1);
+                    queue_response(stream.sd, stream.response_batch, ACK_INSTR, selective_repeat ? packet_sequence_number : expected_sequence_number, stream.server, metrics);
+                }
+
+                // Drop the Packet
+                continue;
+            }
+
+            if (window_offset != 0) {
+                metric_add(metrics.out_of_order, 1);
+            }
+        } else if (window_offset == 0) {
+            LOG_TRACE("[Info] Packet was in sequence!");
+        } else {
+            LOG_DEBUG("[Error] Packet was not in sequence!");
+            LOG_DEBUG("\tGot sequence number " << packet_sequence_number);
+            LOG_DEBUG("\tExpected " << expected_sequence_number);
+            metric_add(sequence_before(packet_sequence_number, expected_sequence_number) ? metrics.duplicates : metrics.out_of_order, 1);
+
+            // Send NAK, which names the window base and so answers any packets owed a
+            // coalesced ACK as well
+            LOG_DEBUG("\tSending NAK Response...");
+            LOG_DEBUG("\tRequesting Packet #: " << expected_sequence_number);
+            queue_response(stream.sd, stream.response_batch, NAK_INSTR, expected_sequence_number, stream.server, metrics);
+            coalesced_count = 0;
+
+            // Drop the Packet
+            continue;
+        }
+
+
+        // The raw file data follows the header. A payload length running past the end
+        // of the datagram can only come from a damaged header.
+        const char *payload = &packet_buffer[HEADER_SIZE];
+        bool length_valid = payload_length <= n - HEADER_SIZE && payload_length <= payload_size;
+
+
+        // Generate the checksum from the packet and make sure it is
+        // correct to the one included in the header
+        generate_checksum(packet_number, payload, length_valid ? payload_length : 0, packet_calculated_checksum_buff);
+        uint32_t actual_checksum = buffToUint32(packet_calculated_checksum_buff);
+        if(!length_valid || actual_checksum != packet_checksum) {
+            LOG_DEBUG("[Error] Packet Damaged");
+            metric_add(metrics.damaged, 1);
+            LOG_DEBUG("\tRecieved: " << actual_checksum);
+            LOG_DEBUG("\tExpected: " << packet_checksum);
+
+            // A damaged packet is as good as lost when parity can rebuild it
+            if (fec.scheme != FEC_NONE) {
+                continue;
+            }
+
+            // Send NACK, Selective Repeat names the damaged packet itself after answering
+            // the packets owed a coalesced ACK, which the Go-Back-N one answers as it is
+            uint32_t nak_sequence_number = selective_repeat ? packet_sequence_number : expected_sequence_number;
+            if (selective_repeat && coalesced_count > 0) {
+                queue_cumulative_ack(stream, settings, expected_sequence_number, coalesced_count, metrics);
+            }
+            LOG_DEBUG("\tSending NAK Response...");
+            LOG_DEBUG("\tRequesting Packet #: " << nak_sequence_number);
+            queue_response(stream.sd, stream.response_batch, NAK_INSTR, nak_sequence_number, stream.server, metrics);
+            coalesced_count = 0;
+
+            // Drop the packet
+            continue;
+        } else {
+            LOG_TRACE("[Info] Packet contents OK");
+        }
+
+
+        // Both modes ignore duplicates, which Selective Repeat ACKs again
+        int window_slot = packet_sequence_number % ring_size;
+        if (packet_received[window_slot]) {
+            metric_add(metrics.duplicates, 1);
+            if (selective_repeat) {
+                queue_response(stream.sd, stream.response_batch, ACK_INSTR, packet_sequence_number, stream.server, metrics);
+            }
+            continue;
+        }
+
+
+        // Write the payload straight to its place in the file, packets that arrive
+        // out of order just land at a later offset. A payload that passed its checksum
+        // but does not decompress is left unanswered for the server to resend.
+        int written = write_payload(download, packet_number, payload, payload_length, metrics);
+        if (written < 0) {
+            if (written == -1) {
+                metric_add(metrics.damaged, 1);
+            }
+            continue;
+        }
+        packet_received[window_slot] = true;
+
+        // Selective Repeat ACKs every good packet individually, except that when coalescing
+        // the window base waits to be answered along with the packets after it. A packet past
+        // a gap is answered at once, after the packets owed a coalesced ACK before the gap.
+        if (selective_repeat && (!coalescing || window_offset != 0)) {
+            if (coalesced_count > 0) {
+                queue_cumulative_ack(stream, settings, expected_sequence_number, coalesced_count, metrics);
+            }
+            LOG_TRACE("\tSending ACK Response for packet #: " << packet_sequence_number);
+            queue_response(stream.sd, stream.response_batch, ACK_INSTR, packet_sequence_number, stream.server, metrics);
+        }
+
+
+        // Clear all our buffers
+        empty_buffer(packet_calculated_checksum_buff, 4);
+        empty_buffer(packet_checksum_buff, 4);
+        empty_buffer(packet_number_buff, 4);
+
+
+        // Keep the packet until its block is complete. Once a later block arrives,
+        // all parity of the earlier ones went out, so ask for a resend of what they are
+        // still missing: Selective Repeat once per packet, Go-Back-N for the window
+        // base on every such packet the way it NAKs out of order packets.
+        if (fec.scheme != FEC_NONE) {
+            uint32_t block_number = store_fec_packet(fec, packet_number, payload, payload_length);
+            recover_fec_block(fec, block_number, recovered);
+
+            abandon_fec_blocks(fec, block_number, missing);
+            if (selective_repeat) {
+                for (uint32_t missing_number : missing) {
+                    LOG_DEBUG("[Error] Parity could not rebuild packet " << missing_number << ", sending NAK");
+                    queue_response(stream.sd, stream.response_batch, NAK_INSTR, missing_number, stream.server, metrics);
+                }
+            } else if (block_number != expected_sequence_number / fec.block) {
+                LOG_DEBUG("[Error] Parity could not rebuild packet " << expected_sequence_number << ", sending NAK");
+                queue_response(stream.sd, stream.response_batch, NAK_INSTR, expected_sequence_number, stream.server, metrics);
+                coalesced_count = 0;
+            }
+            missing.clear();
+
+            write_rebuilt_packets(stream.sd, stream.response_batch, download, fec, recovered, packet_received, selective_repeat, stream.server, metrics);
+        }
+
+
+        // Slide the window base over every packet received so far
+        uint32_t previous_base = expected_sequence_number;
+        while (packet_received[expected_sequence_number % ring_size]) {
+            packet_received[expected_sequence_number % ring_size] = false;
+            expected_sequence_number++;
+        }
+
+        if (fec.scheme != FEC_NONE) {
+            release_fec_blocks(fec, expected_sequence_number);
+        }
+
+        // Keep the progress sidecar close behind what is in the file
+        if (!progress_filename.empty() &&
+            std::chrono::steady_clock::now() - last_progress_save >= std::chrono::milliseconds(PROGRESS_SAVE_INTERVAL_MS)) {
+            note_progress(progress, expected_sequence_number, packet_received);
+            save_progress(progress_filename, progress);
+            last_progress_save = std::chrono::steady_clock::now();
+        }
+
+        if (selective_repeat && (!coalescing || window_offset != 0)) {
+            continue;
+        }
+
+        // A packet that only moved the window base on by one is answered along with the ones
+        // after it. Anything else is answered at once, since the server is waiting to hear
+        // about the gap it filled or left.
+        if (coalescing) {
+            if (coalesced_count++ == 0) {
+                coalesced_since = std::chrono::steady_clock::now();
+            }
+            if (expected_sequence_number - previous_base != 1 || coalesced_count >= settings.ack_every) {
+                queue_cumulative_ack(stream, settings, expected_sequence_number, coalesced_count, metrics);
+            }
+            continue;
+        }
+
+        // Send ACK Response
+        LOG_TRACE("\tSending ACK Response...");
+        LOG_TRACE("\tRequesting Packet #: " << expected_sequence_number);
+        queue_response(stream.sd, stream.response_batch, ACK_INSTR, expected_sequence_number, stream.server, metrics);
+
+    }
+
+    flush_datagram_batch(stream.sd, stream.response_batch);
+    stream.receive_batch.position = stream.receive_batch.count = 0;
+
+    return !stalled;
+}
+
+
+// download_range
+//
+//  Download a file, or the part of it up to the target's end_byte, into the target. When
+//  resuming, the server is asked for what progress says is still missing of the version it
+//  names. Returns one of the DOWNLOAD_ results.
+//
+int download_range(transfer_stream &stream, const std::string &input_filename, download_target &target,
+                   download_progress &progress, bool resuming) {
+    int n;
+    char message_buffer[SEGMENT_SIZE];
+    char packet_instruction[INSTRUCTION_SIZE + 1];
+
+    // Ask for what is still missing of the version we have part of, up to the end of the
+    // range we are after
+    std::vector<std::string> range_options;
+    uint64_t first_byte = resuming ? (uint64_t)progress.contiguous * progress.data_size : 0;
+    if (resuming || target.end_byte != UINT64_MAX) {
+        range_options.push_back("range=" + std::to_string(first_byte) + "-" +
+                                (target.end_byte != UINT64_MAX ? std::to_string(target.end_byte - 1) : std::string()));
+    }
+    if (resuming) {
+        range_options.push_back("if_etag=" + progress.etag);
+    }
+
+    std::shared_ptr<transfer_metrics> metrics_pointer = std::make_shared<transfer_metrics>();
+    transfer_metrics &metrics = *metrics_pointer;
+    metrics.role = "client";
+    metrics.filename = input_filename;
+    metrics.peer = server_address + ":" + std::to_string(SERV_PORT);
+    if (!range_options.empty()) {
+        metrics.range = range_options[0].substr(strlen("range="));
+    }
+
+    n = send_request(stream, input_filename, range_options, message_buffer, metrics);
+    if (n == REQUEST_TOO_LONG) {
+        return DOWNLOAD_FAILED;
+    }
+    memcpy(packet_instruction, &message_buffer, 4);
+    
+    // Print the response instruction, either ACK or ERR
+    LOG_INFO("[Info] Server Response: " << packet_instruction);
+
+    if (n < 0) {
+        LOG_ERROR("[Error] Server did not answer the request for " << input_filename);
+        return DOWNLOAD_STALLED;
+    }
+
+    if (strcmp(packet_instruction, ACK_INSTR) != 0) {
+        LOG_ERROR("[Error] File name does not exist on server, please try again");
+        return DOWNLOAD_MISSING;
+    }
+
+    // Settle on what the server agreed to
+    std::map<std::string, std::string> response_options;
+    if (n > 4) {
+        response_options = parse_response_options(message_buffer + 4, n - 4);
+    }
+
+    transfer_settings settings;
+    read_transfer_settings(response_options, stream.proposed_segment_size, settings);
+    int data_size = settings.data_size;
+    log_transfer_settings(settings, metrics);
+
+    // Packets received ahead of the window base, indexed by packet number % the ring size
+    std::vector<bool> packet_received(window_ring_size(MAX_WINDOW_SIZE), false);
+
+    // The server only sends a range if the file is still the one we have part of, and
+    // then starts at the packet it echoes. Streams sharing a file with others cannot start
+    // over on their own.
+    bool resumed = resuming && !response_options["start"].empty();
+    if (resuming && !resumed && target.fd >= 0) {
+        LOG_ERROR("[Error] " << input_filename << " changed on the server during the download");
+        return DOWNLOAD_CHANGED;
+    }
+
+    bool size_known = !response_options["size"].empty();
+    uint32_t start_packet = !response_options["start"].empty() ? strtoul(response_options["start"].c_str(), NULL, 10) : 0;
+    if (!resumed || progress.data_size != data_size) {
+        progress.received.clear();
+        progress.contiguous = start_packet;
+    }
+    progress.etag = response_options["etag"];
+    progress.size = strtoull(response_options["size"].c_str(), NULL, 10);
+    progress.data_size = data_size;
+
+    if (resumed && target.fd < 0) {
+        LOG_INFO("[Info] Resuming download of " << input_filename << " from packet " << start_packet);
+    }
+
+    int downloaded_fd = target.fd;
+    if (downloaded_fd < 0) {
+        downloaded_fd = open(target.filename.c_str(), O_WRONLY | O_CREAT | (resumed ? 0 : O_TRUNC), 0644);
+    }
+    if (downloaded_fd < 0) {
+        LOG_ERROR("[Error] Could not open " << target.filename << ": " << strerror(errno));
+        return DOWNLOAD_FAILED;
+    }
+    download_file download = { downloaded_fd, data_size, settings.compressed, std::vector<char>(settings.compressed ? data_size : 0), NULL };
+    uint32_t expected_sequence_number = restore_progress(progress, start_packet, packet_received);
+
+    {
+        std::lock_guard<std::mutex> lock(current_transfers_mutex);
+        current_transfers.insert(metrics_pointer);
+    }
+
+    bool stalled = !receive_packets(stream, settings, download, expected_sequence_number, packet_received, metrics,
+                                    progress, target.progress_filename);
+
+    {
+        std::lock_guard<std::mutex> lock(current_transfers_mutex);
+        current_transfers.erase(metrics_pointer);
+    }
+
+    // Leave what we have for the next attempt to resume from
+    if (stalled) {
+        note_progress(progress, expected_sequence_number, packet_received);
+        if (!target.progress_filename.empty()) {
+            save_progress(target.progress_filename, progress);
+        }
+        if (target.fd < 0) {
+            close(downloaded_fd);
+        }
+        LOG_INFO("[Metrics] " << transfer_metrics_json(metrics, "stalled"));
+        return DOWNLOAD_STALLED;
+    }
+
+    LOG_INFO("[Info] Terminator packet received, end of transmission");
+    metrics.file_bytes.store(metrics.bytes_delivered.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+    // Every packet is already in place, close the file. A resumed download may have been
+    // written over a longer file, so cut it to the size it should be. A file shared with
+    // other streams is left to whoever opened it.
+    if (target.fd < 0) {
+        if (size_known && ftruncate(downloaded_fd, progress.size) < 0) {
+            LOG_ERROR("[Error] Could not truncate " << target.filename << ": " << strerror(errno));
+        }
+        close(downloaded_fd);
+        if (!target.progress_filename.empty()) {
+            unlink(target.progress_filename.c_str());
+        }
+        LOG_INFO("[Info] Downloaded file written to: " << target.filename);
+    }
+
+    LOG_INFO("[Metrics] " << transfer_metrics_json(metrics, "finished"));
+    return DOWNLOAD_FINISHED;
+}
+
+
+// send_upload
+//
+//  Send the server what it needs ahead of a request in as few request sized parts as the
+//  items fit in, never splitting an item between parts, counting them in the transfer's
+//  metrics. Returns false if there is too much of it. A part holds its number and the number
+//  of parts as 32-bit numbers after the instruction, then its items.
+//
+bool send_upload(transfer_stream &stream, const char instruction[], const std::vector<std::string> &items, transfer_metrics &metrics) {
+    int contents_start = 4 + 2 * PACKET_COUNT_SIZE;
+
+    std::vector<std::vector<const std::string *>> parts(1);
+    int part_length = contents_start;
+    for (const std::string &item : items) {
+        if (contents_start + (int)item.length() > SEGMENT_SIZE) {
+            return false;
+        }
+        if (part_length + (int)item.length() > SEGMENT_SIZE) {
+            parts.emplace_back();
+            part_length = contents_start;
+        }
+        parts.back().push_back(&item);
+        part_length += item.length();
+    }
+
+    if ((int)parts.size() > MAX_UPLOAD_PARTS) {
+        LOG_ERROR("[Error] " << items.size() << " items are too many to send ahead of a request");
+        return false;
+    }
+
+    uint32_t part_count = parts.size();
+    for (uint32_t part = 0; part < part_count; part++) {
+        char packet[SEGMENT_SIZE];
+        std::memcpy(packet, instruction, 4);
+        std::memcpy(packet + 4, &part, PACKET_COUNT_SIZE);
+        std::memcpy(packet + 4 + PACKET_COUNT_SIZE, &part_count, PACKET_COUNT_SIZE);
+
+        int position = contents_start;
+        for (const std::string *item : parts[part]) {
+            std::memcpy(packet + position, item->data(), item->length());
+            position += item->length();
+        }
+
+        sendto(stream.sd, packet, position, 0, (struct sockaddr*)&stream.server, sizeof(stream.server));
+        metric_add(metrics.segments_sent, 1);
+        metric_add(metrics.bytes_sent, position);
+    }
+
+    return true;
+}
+
+
+// send_manifest
+//
+//  Send the server the paths of a batch, returning false if a path cannot be sent. Every
+//  path goes NUL terminated, so none may be empty.
+//
+bool send_manifest(transfer_stream &stream, const std::vector<std::string> &paths, transfer_metrics &metrics) {
+    std::vector<std::string> items;
+    for (const std::string &path : paths) {
+        if (path.empty() || 4 + 2 * PACKET_COUNT_SIZE + (int)path.length() + 1 > SEGMENT_SIZE) {
+            LOG_ERROR("[Error] '" << path << "' cannot be asked for in a batch");
+            return false;
+        }
+        items.push_back(path + '\0');
+    }
+
+    return send_upload(stream, BAT_INSTR, items, metrics);
+}
+
+
+// download_batch
+//
+//  Download every file in files in one transfer, the server sending them back to back.
+//  Files that were written or that the server does not have are taken off the list, so a
+//  stalled batch can be asked for again with what is left. Returns one of the DOWNLOAD_
+//  results.
+//
+int download_batch(transfer_stream &stream, std::vector<std::string> &files) {
+    char reply[SEGMENT_SIZE];
+
+    std::shared_ptr<transfer_metrics> metrics_pointer = std::make_shared<transfer_metrics>();
+    transfer_metrics &metrics = *metrics_pointer;
+    metrics.role = "client";
+    metrics.filename = "batch of " + std::to_string(files.size()) + " files";
+    metrics.peer = server_address + ":" + std::to_string(SERV_PORT);
+
+    // The manifest goes first, and the server holds on to it until the request for the batch
+    if (!send_manifest(stream, files, metrics)) {
+        return DOWNLOAD_FAILED;
+    }
+
+    int n = send_request(stream, "", { "batch=" + std::to_string(files.size()) }, reply, metrics);
+    if (n == REQUEST_TOO_LONG) {
+        return DOWNLOAD_FAILED;
+    }
+    LOG_INFO("[Info] Server Response: " << reply);
+
+    if (n < 0) {
+        LOG_ERROR("[Error] Server did not answer the request for the " << metrics.filename);
+        return DOWNLOAD_STALLED;
+    }
+
+    // A server missing part of the manifest turns the batch down, so send all of it again
+    if (strcmp(reply, ACK_INSTR) != 0) {
+        LOG_ERROR("[Error] Server turned down the " << metrics.filename);
+        return DOWNLOAD_STALLED;
+    }
+
+    std::map<std::string, std::string> response_options = parse_response_options(reply + 4, n - 4);
+    transfer_settings settings;
+    read_transfer_settings(response_options, stream.proposed_segment_size, settings);
+    if (!settings.batch) {
+        LOG_ERROR("[Error] Server does not support batch downloads");
+        return DOWNLOAD_FAILED;
+    }
+    log_transfer_settings(settings, metrics);
+
+    // Every file is written as its frame and then its packets arrive
+    batch_download batch = { files, std::vector<int>(files.size(), DOWNLOAD_STALLED), {} };
+    download_file download = { -1, settings.data_size, true, std::vector<char>(settings.data_size), &batch };
+    std::vector<bool> packet_received(window_ring_size(MAX_WINDOW_SIZE), false);
+    uint32_t expected_sequence_number = 0;
+    download_progress progress = {};
+
+    {
+        std::lock_guard<std::mutex> lock(current_transfers_mutex);
+        current_transfers.insert(metrics_pointer);
+    }
+
+    bool stalled = !receive_packets(stream, settings, download, expected_sequence_number, packet_received, metrics, progress, "");
+
+    {
+        std::lock_guard<std::mutex> lock(current_transfers_mutex);
+        current_transfers.erase(metrics_pointer);
+    }
+
+    // Files a stall cut off are asked for again from the start
+    for (auto &entry : batch.files) {
+        if (entry.second.fd >= 0) {
+            close(entry.second.fd);
+        }
+    }
+
+    // Only the files still to come stay on the list
+    int written = 0, missing = 0, failed = 0;
+    files.clear();
+    for (size_t i = 0; i < batch.names.size(); i++) {
+        if (batch.results[i] == DOWNLOAD_FINISHED) {
+            written++;
+        } else if (batch.results[i] == DOWNLOAD_MISSING) {
+            missing++;
+        } else if (batch.results[i] == DOWNLOAD_FAILED || !stalled) {
+            failed++;
+        } else {
+            files.push_back(batch.names[i]);
+        }
+    }
+
+    metrics.file_bytes.store(metrics.bytes_delivered.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    LOG_INFO("[Metrics] " << transfer_metrics_json(metrics, stalled ? "stalled" : "finished"));
+
+    uint64_t duration_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - metrics.start_time).count();
+    uint64_t delivered = metrics.bytes_delivered.load(std::memory_order_relaxed);
+    LOG_INFO("[Stats] " << written << " files written, " << missing << " missing on the server, " << failed << " failed and "
+             << files.size() << " left in " << duration_us / 1000 << " ms, " << (duration_us > 0 ? delivered * 8 / duration_us : 0) << " Mbps goodput");
+
+    if (stalled) {
+        return DOWNLOAD_STALLED;
+    }
+    return failed > 0 ? DOWNLOAD_FAILED : (missing > 0 ? DOWNLOAD_MISSING : DOWNLOAD_FINISHED);
+}
+
+
+// download_delta
+//
+//  Download only what changed in a file since the complete copy we have of it. Our copy is
+//  signed block by block and the signatures sent ahead of the request, then the server
+//  sends a delta of copies of our blocks and literal data in their place. The delta is
+//  received next to the file and the file rebuilt next to it, so our copy stays whole
+//  until the new one replaces it. A server that does not send a delta sends the whole
+//  file instead, which replaces our copy all the same. Returns one of the DOWNLOAD_
+//  results.
+//
+int download_delta(transfer_stream &stream, const std::string &input_filename, const std::string &downloaded_filename) {
+    char reply[SEGMENT_SIZE];
+
+    int local_fd = open(downloaded_filename.c_str(), O_RDONLY);
+    struct stat local_stat;
+    if (local_fd < 0 || fstat(local_fd, &local_stat) < 0) {
+        LOG_ERROR("[Error] Could not open " << downloaded_filename << ": " << strerror(errno));
+        if (local_fd >= 0) {
+            close(local_fd);
+        }
+        return DOWNLOAD_FAILED;
+    }
+
+    // Bigger files get bigger blocks, so their signatures still fit in one upload
+    uint64_t local_size = local_stat.st_size;
+    int block_size = std::max<uint64_t>(DELTA_BLOCK_SIZE, (local_size + MAX_DELTA_BLOCKS - 1) / MAX_DELTA_BLOCKS);
+    uint32_t block_count = local_size / block_size;
+
+    // A copy smaller than a block has nothing to offer, so download all of the file
+    download_target full_target = { downloaded_filename, downloaded_filename + PROGRESS_SUFFIX, -1, UINT64_MAX };
+    download_progress full_progress;
+    if (block_count == 0) {
+        close(local_fd);
+        LOG_INFO("[Info] " << downloaded_filename << " is too small to sign, downloading all of it");
+        return download_range(stream, input_filename, full_target, full_progress, false);
+    }
+
+    std::vector<std::string> signatures;
+    std::vector<char> block(block_size);
+    for (uint32_t i = 0; i < block_count; i++) {
+        if (pread(local_fd, block.data(), block_size, (off_t)i * block_size) != block_size) {
+            LOG_ERROR("[Error] Could not read " << downloaded_filename << ": " << strerror(errno));
+            close(local_fd);
+            return DOWNLOAD_FAILED;
+        }
+        delta_signature signature = delta_sign_block(block.data(), block_size);
+        char signature_buffer[DELTA_SIGNATURE_SIZE];
+        memcpy(signature_buffer, &signature.rolling, sizeof(signature.rolling));
+        memcpy(signature_buffer + sizeof(signature.rolling), &signature.strong, sizeof(signature.strong));
+        signatures.emplace_back(signature_buffer, DELTA_SIGNATURE_SIZE);
+    }
+
+    std::shared_ptr<transfer_metrics> metrics_pointer = std::make_shared<transfer_metrics>();
+    transfer_metrics &metrics = *metrics_pointer;
+    metrics.role = "client";
+    metrics.filename = input_filename;
+    metrics.peer = server_address + ":" + std::to_string(SERV_PORT);
+
+    // The signatures go first, and the server holds on to them until the request
+    if (!send_upload(stream, SIG_INSTR, signatures, metrics)) {
+        close(local_fd);
+        return DOWNLOAD_FAILED;
+    }
+
+    std::string delta_option = "delta=" + std::to_string(block_size);
+    int n = send_request(stream, input_filename, { delta_option, "delta_blocks=" + std::to_string(block_count) }, reply, metrics);
+    if (n == REQUEST_TOO_LONG) {
+        close(local_fd);
+        return DOWNLOAD_FAILED;
+    }
+    LOG_INFO("[Info] Server Response: " << reply);
+
+    if (n < 0) {
+        LOG_ERROR("[Error] Server did not answer the request for " << input_filename);
+        close(local_fd);
+        return DOWNLOAD_STALLED;
+    }
+    if (strcmp(reply, ACK_INSTR) != 0) {
+        LOG_ERROR("[Error] File name does not exist on server, please try again");
+        close(local_fd);
+        return DOWNLOAD_MISSING;
+    }
+
+    std::map<std::string, std::string> response_options = parse_response_options(reply + 4, n - 4);
+    transfer_settings settings;
+    read_transfer_settings(response_options, stream.proposed_segment_size, settings);
+    log_transfer_settings(settings, metrics);
+
+    // The server echoes the block size only if it sends a delta rather than the whole file
+    bool delta = response_options["delta"] == std::to_string(block_size);
+    if (!delta) {
+        LOG_INFO("[Info] Server is sending all of " << input_filename << " instead of a delta");
+    }
+
+    std::string delta_filename = downloaded_filename + DELTA_SUFFIX;
+    int delta_fd = open(delta_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (delta_fd < 0) {
+        LOG_ERROR("[Error] Could not open " << delta_filename << ": " << strerror(errno));
+        close(local_fd);
+        return DOWNLOAD_FAILED;
+    }
+
+    download_file download = { delta_fd, settings.data_size, settings.compressed, std::vector<char>(settings.compressed ? settings.data_size : 0), NULL };
+    std::vector<bool> packet_received(window_ring_size(MAX_WINDOW_SIZE), false);
+    uint32_t expected_sequence_number = 0;
+    download_progress progress = {};
+
+    {
+        std::lock_guard<std::mutex> lock(current_transfers_mutex);
+        current_transfers.insert(metrics_pointer);
+    }
+
+    bool stalled = !receive_packets(stream, settings, download, expected_sequence_number, packet_received, metrics, progress, "");
+
+    {
+        std::lock_guard<std::mutex> lock(current_transfers_mutex);
+        current_transfers.erase(metrics_pointer);
+    }
+
+    // Part of a delta is no use to the next attempt, which signs our copy again
+    if (stalled) {
+        close(delta_fd);
+        close(local_fd);
+        unlink(delta_filename.c_str());
+        LOG_INFO("[Metrics] " << transfer_metrics_json(metrics, "stalled"));
+        return DOWNLOAD_STALLED;
+    }
+
+    LOG_INFO("[Info] Terminator packet received, end of transmission");
+    uint64_t delta_bytes = metrics.bytes_delivered.load(std::memory_order_relaxed);
+    metrics.file_bytes.store(delta_bytes, std::memory_order_relaxed);
+
+    // Rebuild the file beside our copy, then put it in its place
+    uint64_t copied_bytes = 0;
+    bool rebuilt = true;
+    if (delta) {
+        std::string rebuild_filename = downloaded_filename + REBUILD_SUFFIX;
+        int rebuild_fd = open(rebuild_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        rebuilt = rebuild_fd >= 0 && apply_delta(delta_fd, local_fd, block_size, rebuild_fd, copied_bytes);
+        if (rebuild_fd >= 0) {
+            close(rebuild_fd);
+        }
+        rebuilt = rebuilt && rename(rebuild_filename.c_str(), downloaded_filename.c_str()) == 0;
+        if (!rebuilt) {
+            unlink(rebuild_filename.c_str());
+        }
+        unlink(delta_filename.c_str());
+    } else {
+        rebuilt = rename(delta_filename.c_str(), downloaded_filename.c_str()) == 0;
+    }
+    close(delta_fd);
+    close(local_fd);
+
+    LOG_INFO("[Metrics] " << transfer_metrics_json(metrics, "finished"));
+
+    // Our copy is left as it was, so download all of the file instead
+    if (!rebuilt) {
+        LOG_ERROR("[Error] Could not rebuild " << downloaded_filename << " from the delta, downloading all of it");
+        unlink(delta_filename.c_str());
+        return download_range(stream, input_filename, full_target, full_progress, false);
+    }
+
+    LOG_INFO("[Info] Downloaded file written to: " << downloaded_filename);
+    if (delta) {
+        LOG_INFO("[Stats] Rebuilt " << strtoull(response_options["size"].c_str(), NULL, 10) << " bytes from " << delta_bytes
+                 << " bytes of delta, copying " << copied_bytes << " bytes from our copy");
+    }
+    return DOWNLOAD_FINISHED;
+}
+
+
+// apply_delta
+//
+//  Write the file a delta describes to output_fd, copying blocks from our copy in local_fd.
+//  The records are read one after another, and the CRC32C of everything written is checked
+//  against the end record. Returns false if the delta is malformed, names blocks we do not
+//  have or the result does not match the server's checksum.
+//
+bool apply_delta(int delta_fd, int local_fd, int block_size, int output_fd, uint64_t &copied_bytes) {
+    struct stat local_stat;
+    if (fstat(local_fd, &local_stat) < 0) {
+        return false;
+    }
+    uint64_t local_blocks = (uint64_t)local_stat.st_size / block_size;
+
+    std::vector<char> buffer(std::max(DELTA_BUFFER_SIZE, block_size));
+    uint64_t position = 0;
+    uint64_t output_position = 0;
+    uint32_t checksum = 0;
+    copied_bytes = 0;
+
+    while (true) {
+        char record[DELTA_COPY_SIZE];
+        if (pread(delta_fd, record, 1, position) != 1) {
+            LOG_ERROR("[Error] Delta ends without an end record");
+            return false;
+        }
+
+        int record_size = record[0] == DELTA_COPY ? DELTA_COPY_SIZE : (record[0] == DELTA_LITERAL ? DELTA_LITERAL_SIZE : DELTA_END_SIZE);
+        if (pread(delta_fd, record, record_size, position) != record_size) {
+            LOG_ERROR("[Error] Delta ends part way through a record");
+            return false;
+        }
+        position += record_size;
+
+        uint32_t first, second;
+        memcpy(&first, record + 1, sizeof(first));
+        memcpy(&second, record + 5, sizeof(second));
+
+        if (record[0] == DELTA_COPY) {
+            if ((uint64_t)first + second > local_blocks) {
+                LOG_ERROR("[Error] Delta copies block " << (uint64_t)first + second - 1 << " of our " << local_blocks);
+                return false;
+            }
+            uint64_t length = (uint64_t)second * block_size;
+            if (!append_file_bytes(local_fd, (uint64_t)first * block_size, length, output_fd, output_position, checksum, buffer)) {
+                return false;
+            }
+            copied_bytes += length;
+        } else if (record[0] == DELTA_LITERAL) {
+            if (!append_file_bytes(delta_fd, position, first, output_fd, output_position, checksum, buffer)) {
+                LOG_ERROR("[Error] Delta ends part way through a literal");
+                return false;
+            }
+            position += first;
+        } else if (record[0] == DELTA_END) {
+            if (checksum != first) {
+                LOG_ERROR("[Error] Rebuilt file does not match the server's checksum");
+                return false;
+            }
+            return true;
+        } else {
+            LOG_ERROR("[Error] Delta holds an unknown record type " << (int)(uint8_t)record[0]);
+            return false;
+        }
+    }
+}
+
+
+// append_file_bytes
+//
+//  Copy length bytes at offset from one file to the end of what has been written to
+//  output_fd, adding them to the running checksum. Returns false if either file falls short.
+//
+bool append_file_bytes(int from_fd, uint64_t offset, uint64_t length, int output_fd, uint64_t &output_position,
+                       uint32_t &checksum, std::vector<char> &buffer) {
+    while (length > 0) {
+        ssize_t chunk = std::min<uint64_t>(length, buffer.size());
+        if (pread(from_fd, buffer.data(), chunk, offset) != chunk) {
+            return false;
+        }
+        if (pwrite(output_fd, buffer.data(), chunk, output_position) != chunk) {
+            LOG_ERROR("[Error] Could not write the rebuilt file: " << strerror(errno));
+            return false;
+        }
+        checksum = crc32c(checksum, buffer.data(), chunk);
+        offset += chunk;
+        output_position += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+
+// download_parallel
+//
+//  Split a file into stream_count ranges and download them at the same time, each over a
+//  stream of its own writing straight to its place in the file. Returns one of the
+//  DOWNLOAD_ results.
+//
+int download_parallel(const struct sockaddr_in &server, int proposed_segment_size, const std::string &input_filename,
+                      const std::string &downloaded_filename) {
+    // Ask only for the file's size and version first, along with the transfer settings every
+    // stream will get, so the ranges can be cut on packet boundaries
+    transfer_stream probe;
+    open_transfer_stream(probe, server, proposed_segment_size);
+
+    char reply[SEGMENT_SIZE];
+    transfer_metrics probe_metrics{};
+    int n = send_request(probe, input_filename, { "head=1" }, reply, probe_metrics);
+    close(probe.sd);
+
+    if (n == REQUEST_TOO_LONG) {
+        return DOWNLOAD_FAILED;
+    }
+
+    if (n < 0) {
+        LOG_ERROR("[Error] Server did not answer the request for " << input_filename);
+        return DOWNLOAD_STALLED;
+    }
+    if (strcmp(reply, ACK_INSTR) != 0) {
+        LOG_ERROR("[Error] File name does not exist on server, please try again");
+        return DOWNLOAD_MISSING;
+    }
+
+    std::map<std::string, std::string> response_options = parse_response_options(reply + 4, n - 4);
+    transfer_settings settings;
+    read_transfer_settings(response_options, proposed_segment_size, settings);
+
+    // Ranges are whole packets, and whole blocks with forward error correction since the
+    // server starts a range on a block, spread as evenly as they go between the streams
+    uint64_t file_size = strtoull(response_options["size"].c_str(), NULL, 10);
+    uint64_t unit = (uint64_t)settings.data_size * (settings.fec_scheme != FEC_NONE ? settings.fec_block : 1);
+    uint64_t units = (file_size + unit - 1) / unit;
+    int streams = std::min<uint64_t>(stream_count, units);
+
+    // Every stream writes straight into the one file, which no longer matches the progress
+    // an earlier download may have left
+    int downloaded_fd = open(downloaded_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (downloaded_fd < 0) {
+        LOG_ERROR("[Error] Could not open " << downloaded_filename << ": " << strerror(errno));
+        return DOWNLOAD_FAILED;
+    }
+    unlink((downloaded_filename + PROGRESS_SUFFIX).c_str());
+
+    LOG_INFO("[Info] Downloading " << input_filename << " over " << streams << " streams");
+    auto start_time = std::chrono::steady_clock::now();
+
+    std::vector<int> results(streams, DOWNLOAD_FINISHED);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < streams; i++) {
+        uint64_t first_byte = units * i / streams * unit;
+        uint64_t end_byte = std::min(file_size, units * (i + 1) / streams * unit);
+
+        download_target target = { downloaded_filename, "", downloaded_fd, end_byte };
+        download_progress progress = { response_options["etag"], file_size, settings.data_size, (uint32_t)(first_byte / settings.data_size), {} };
+        workers.emplace_back(download_stream, std::cref(server), proposed_segment_size, std::cref(input_filename),
+                             target, progress, std::ref(results[i]));
+    }
+
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    close(downloaded_fd);
+
+    // A stream that could not finish leaves a hole in the file
+    for (int result : results) {
+        if (result != DOWNLOAD_FINISHED) {
+            return result == DOWNLOAD_STALLED ? DOWNLOAD_FAILED : result;
+        }
+    }
+
+    uint64_t duration_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time).count();
+    LOG_INFO("[Info] Downloaded file written to: " << downloaded_filename);
+    LOG_INFO("[Stats] " << file_size << " bytes over " << streams << " streams in " << duration_us / 1000 << " ms, "
+             << (duration_us > 0 ? file_size * 8 / duration_us : 0) << " Mbps goodput");
+    return DOWNLOAD_FINISHED;
+}
+
+
+// download_stream
+//
+//  Download one range of a parallel download over a stream of its own, asking for what is
+//  still missing of it again whenever it stalls
+//
+void download_stream(const struct sockaddr_in &server, int proposed_segment_size, const std::string &input_filename,
+                     download_target target, download_progress progress, int &result) {
+    transfer_stream stream;
+    open_transfer_stream(stream, server, proposed_segment_size);
+
+    for (int stalls = 1; ; stalls++) {
+        result = download_range(stream, input_filename, target, progress, true);
+        if (result != DOWNLOAD_STALLED) {
+            break;
+        }
+        if (stalls == RESUME_ATTEMPTS) {
+            LOG_ERROR("[Error] Giving up on the range of " << input_filename << " ending at byte " << target.end_byte
+                      << " after " << stalls << " stalled attempts");
+            break;
+        }
+        LOG_INFO("[Info] Asking for " << input_filename << " again from packet " << progress.contiguous);
+    }
+
+    close(stream.sd);
+}
+
+
+// downloaded_path
+//
+//  Where a file downloaded from the server is written: its base name, in the output
+//  directory if there is one
+//
+std::string downloaded_path(const std::string &input_filename) {
+    std::string downloaded_filename = input_filename.substr(input_filename.find_last_of("/\\") + 1);
+    if (!output_directory.empty()) {
+        downloaded_filename = output_directory + "/" + downloaded_filename;
+    }
+    return downloaded_filename;
+}
+
+
+// load_progress
+//
+//  Read the progress sidecar of an earlier download, returning false if there is none or it
+//  makes no sense. The sidecar holds one key=value per line, received as hex digits each
+//  covering four packets, lowest bit first.
+//
+bool load_progress(const std::string &path, download_progress &progress) {
+    std::ifstream sidecar(path);
+    if (!sidecar) {
+        return false;
+    }
+
+    std::map<std::string, std::string> values;
+    std::string line;
+    while (std::getline(sidecar, line)) {
+        size_t separator = line.find('=');
+        if (separator != std::string::npos) {
+            values[line.substr(0, separator)] = line.substr(separator + 1);
+        }
+    }
+
+    progress.etag = values["etag"];
+    progress.size = strtoull(values["size"].c_str(), NULL, 10);
+    progress.data_size = std::atoi(values["data_size"].c_str());
+    progress.contiguous = strtoul(values["contiguous"].c_str(), NULL, 10);
+    progress.received.clear();
+
+    for (char digit : values["received"]) {
+        int bits = isdigit(digit) ? digit - '0' : (isxdigit(digit) ? tolower(digit) - 'a' + 10 : -1);
+        if (bits < 0) {
+            return false;
+        }
+        for (int bit = 0; bit < 4; bit++) {
+            progress.received.push_back(bits & (1 << bit));
+        }
+    }
+
+    return !progress.etag.empty() && progress.data_size > 0;
+}
+
+
+// note_progress
+//
+//  Record the packets written so far, with the window base at window_base
+//
+void note_progress(download_progress &progress, uint32_t window_base, const std::vector<bool> &packet_received) {
+    progress.contiguous = window_base;
+    progress.received.assign(MAX_WINDOW_SIZE, false);
+    for (int i = 0; i < MAX_WINDOW_SIZE; i++) {
+        progress.received[i] = packet_received[(window_base + i) % packet_received.size()];
+    }
+    while (!progress.received.empty() && !progress.received.back()) {
+        progress.received.pop_back();
+    }
+}
+
+
+// save_progress
+//
+//  Write what progress records to the progress sidecar, replacing it in one step so an
+//  interrupted save leaves the previous one in place
+//
+void save_progress(const std::string &path, const download_progress &progress) {
+    std::string received;
+    for (size_t i = 0; i < progress.received.size(); i += 4) {
+        int bits = 0;
+        for (int bit = 0; bit < 4 && i + bit < progress.received.size(); bit++) {
+            bits |= progress.received[i + bit] << bit;
+        }
+        received += "0123456789abcdef"[bits];
+    }
+
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream sidecar(temporary, std::ios_base::trunc);
+        sidecar << "etag=" << progress.etag << "\n"
+                << "size=" << progress.size << "\n"
+                << "data_size=" << progress.data_size << "\n"
+                << "contiguous=" << progress.contiguous << "\n"
+                << "received=" << received << "\n";
+        if (!sidecar.flush()) {
+            LOG_ERROR("[Error] Could not write " << temporary);
+            return;
+        }
+    }
+
+    if (rename(temporary.c_str(), path.c_str()) < 0) {
+        LOG_ERROR("[Error] Could not replace " << path << ": " << strerror(errno));
+    }
+}
+
+
+// restore_progress
+//
+//  Mark the packets an earlier download already wrote as received, for a transfer starting at
+//  start_packet, and return the window base past them. The transfer may start before the
+//  earlier one stopped, and packets arriving again for what we have are answered as
+//  duplicates.
+//
+uint32_t restore_progress(const download_progress &progress, uint32_t start_packet, std::vector<bool> &packet_received) {
+    uint32_t window_base = start_packet;
+
+    for (uint32_t i = 0; i < (uint32_t)MAX_WINDOW_SIZE; i++) {
+        uint32_t packet_number = start_packet + i;
+        bool received = sequence_before(packet_number, progress.contiguous);
+        if (!received && packet_number - progress.contiguous < progress.received.size()) {
+            received = progress.received[packet_number - progress.contiguous];
+        }
+        packet_received[packet_number % packet_received.size()] = received;
+    }
+
+    // Slide the window base over every packet we already have
+    while (packet_received[window_base % packet_received.size()]) {
+        packet_received[window_base % packet_received.size()] = false;
+        window_base++;
+    }
+
+    return window_base;
+}
@@ -0,0 +1,139 @@
+// crc32c.h
+//
+//  CRC32C (Castagnoli) checksums shared by the client and server. Uses the SSE4.2 crc32
+//  instruction when the CPU has it and a slicing-by-8 table otherwise, picking between the
+//  two once at runtime.
+
+#ifndef	__CRC32C_H
+#define	__CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// Reflected CRC32C polynomial
+#define	CRC32C_POLYNOMIAL 0x82F63B78
+
+
+// crc32c_table
+//
+//  Lookup tables for slicing-by-8, built the first time they are needed. Table k holds the
+//  CRC of a byte followed by k zero bytes.
+//
+struct crc32c_table {
+    uint32_t entries[8][256];
+
+    crc32c_table() {
+        for (int i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (CRC32C_POLYNOMIAL & (0 - (crc & 1)));
+            }
+            entries[0][i] = crc;
+        }
+
+        for (int i = 0; i < 256; i++) {
+            for (int k = 1; k < 8; k++) {
+                entries[k][i] = (entries[k - 1][i] >> 8) ^ entries[0][entries[k - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+
+// crc32c_slicing_by_8
+//
+//  Continue a CRC32C over length more bytes, eight bytes per step using the lookup tables
+//
+inline uint32_t crc32c_slicing_by_8(uint32_t crc, const char *data, size_t length) {
+    static const crc32c_table table;
+    const unsigned char *bytes = (const unsigned char *)data;
+    const uint32_t (*t)[256] = table.entries;
+
+    crc = ~crc;
+
+    while (length >= 8) {
+        uint32_t low, high;
+        memcpy(&low, bytes, 4);
+        memcpy(&high, bytes + 4, 4);
+        low ^= crc;
+
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+              t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+
+        bytes += 8;
+        length -= 8;
+    }
+
+    while (length-- > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *bytes++) & 0xFF];
+    }
+
+    return ~crc;
+}
+
+
+#if defined(__x86_64__)
+
+// crc32c_sse42
+//
+//  Continue a CRC32C over length more bytes with the SSE4.2 crc32 instruction. Only call this
+//  when crc32c_hardware_available says the CPU supports it.
+//
+__attribute__((target("sse4.2")))
+inline uint32_t crc32c_sse42(uint32_t crc, const char *data, size_t length) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint64_t crc64 = ~crc;
+
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        bytes += 8;
+        length -= 8;
+    }
+
+    uint32_t crc32 = (uint32_t)crc64;
+    while (length-- > 0) {
+        crc32 = _mm_crc32_u8(crc32, *bytes++);
+    }
+
+    return ~crc32;
+}
+
+#endif
+
+
+// crc32c_hardware_available
+//
+//  Check whether this CPU can run crc32c_sse42
+//
+inline bool crc32c_hardware_available() {
+#if defined(__x86_64__)
+    return __builtin_cpu_supports("sse4.2");
+#else
+    return false;
+#endif
+}
+
+
+// crc32c
+//
+//  Continue a CRC32C over length more bytes with the fastest implementation this CPU has.
+//  Start a new checksum with a crc of 0.
+//
+inline uint32_t crc32c(uint32_t crc, const char *data, size_t length) {
+#if defined(__x86_64__)
+    static const bool hardware = crc32c_hardware_available();
+    if (hardware) {
+        return crc32c_sse42(crc, data, length);
+    }
+#endif
+    return crc32c_slicing_by_8(crc, data, length);
+}
+
+#endif
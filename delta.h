@@ -0,0 +1,385 @@
+// delta.h
+//
+//  Block-hash delta encoding shared by the client and server, in the spirit of rsync. The
+//  client cuts its copy of a file into blocks of block_size bytes and sends the signature of
+//  every whole block: a rolling checksum, which can slide along a byte at a time, and a strong
+//  hash that confirms a match. The server slides a block-sized window over its copy. Wherever
+//  the window matches one of the client's blocks, the delta tells the client to copy that
+//  block. Everything in between goes as literal data. The window slides a step at a time, so
+//  the delta can be sent while the rest of it is still being written.
+//
+//  A delta is a run of records, each a type byte and 32-bit numbers: a copy of count blocks
+//  starting at block, or a literal of length bytes that follow the record. It ends with an
+//  end record holding the CRC32C of the whole file, so the client can check what it rebuilt.
+
+#ifndef	__DELTA_H
+#define	__DELTA_H
+
+#include "crc32c.h"
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+
+#define	DELTA_COPY 'C'
+#define	DELTA_LITERAL 'L'
+#define	DELTA_END 'E'
+
+// Bytes of each record ahead of any literal data
+#define	DELTA_COPY_SIZE 9
+#define	DELTA_LITERAL_SIZE 5
+#define	DELTA_END_SIZE 5
+
+// Bytes of a block signature on the wire, the rolling checksum followed by the strong hash
+#define	DELTA_SIGNATURE_SIZE 12
+
+// Longest literal one record carries, longer runs take several
+#define	DELTA_MAX_LITERAL (1 << 30)
+
+// Bits of the rolling checksum that index the table of checksums worth looking up
+#define	DELTA_TAG_BITS 16
+
+// Literal data is written out at least every DELTA_LITERAL_CHUNK bytes, so a delta read as
+// it is written never waits long for a literal to end
+#define	DELTA_LITERAL_CHUNK (1 << 16)
+
+// Windows whose rolling checksum matches a block but whose strong hash does not may cost at
+// most this many times the file's size in hashing. After that the rest of the file goes as
+// literal data.
+#define	DELTA_FALSE_MATCH_FACTOR 4
+
+
+// delta_signature
+//
+//  Signature of one block of the client's copy
+//
+struct delta_signature {
+    uint32_t rolling;
+    uint64_t strong;
+};
+
+
+// delta_rolling
+//
+//  Rolling checksum of a window of length bytes: a is the sum of its bytes and b the sum of
+//  each byte times its distance from the end of the window, both kept to 16 bits when read
+//
+struct delta_rolling {
+    uint32_t a;
+    uint32_t b;
+    uint32_t length;
+};
+
+
+// delta_rolling_init
+//
+//  Start a rolling checksum over a window
+//
+inline void delta_rolling_init(delta_rolling &rolling, const char data[], int length) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    rolling.a = 0;
+    rolling.b = 0;
+    rolling.length = length;
+    for (int i = 0; i < length; i++) {
+        rolling.a += bytes[i];
+        rolling.b += (uint32_t)(length - i) * bytes[i];
+    }
+}
+
+
+// delta_rolling_roll
+//
+//  Slide the window one byte along, dropping the byte out and taking in the byte in
+//
+inline void delta_rolling_roll(delta_rolling &rolling, uint8_t out, uint8_t in) {
+    rolling.a += in - out;
+    rolling.b += rolling.a - rolling.length * out;
+}
+
+
+// delta_rolling_value
+//
+//  The 32-bit checksum of the window
+//
+inline uint32_t delta_rolling_value(const delta_rolling &rolling) {
+    return (rolling.a & 0xFFFF) | (rolling.b << 16);
+}
+
+
+// delta_tag
+//
+//  Slot of a rolling checksum in the table of checksums worth looking up
+//
+inline uint32_t delta_tag(uint32_t rolling) {
+    return (rolling ^ (rolling >> DELTA_TAG_BITS)) & ((1 << DELTA_TAG_BITS) - 1);
+}
+
+
+// delta_strong_hash
+//
+//  64-bit hash confirming that two blocks with the same rolling checksum match: CRC32C in
+//  the low half and 32-bit FNV-1a, which has nothing in common with it, in the high half
+//
+inline uint64_t delta_strong_hash(const char data[], int length) {
+    uint32_t fnv = 2166136261U;
+    for (int i = 0; i < length; i++) {
+        fnv = (fnv ^ (uint8_t)data[i]) * 16777619U;
+    }
+    return (uint64_t)fnv << 32 | crc32c(0, data, length);
+}
+
+
+// delta_sign_block
+//
+//  Signature of one block of the client's copy
+//
+inline delta_signature delta_sign_block(const char block[], int length) {
+    delta_rolling rolling;
+    delta_rolling_init(rolling, block, length);
+    return { delta_rolling_value(rolling), delta_strong_hash(block, length) };
+}
+
+
+// delta_append_record
+//
+//  Add a record of the given type holding one or two 32-bit numbers to a delta
+//
+inline void delta_append_record(std::vector<char> &delta, char type, uint32_t first, uint32_t second, int size) {
+    char record[DELTA_COPY_SIZE];
+    record[0] = type;
+    memcpy(record + 1, &first, sizeof(first));
+    memcpy(record + 5, &second, sizeof(second));
+    delta.insert(delta.end(), record, record + size);
+}
+
+
+// delta_append_literal
+//
+//  Add literal records carrying a run of the server's copy to a delta
+//
+inline void delta_append_literal(std::vector<char> &delta, const char data[], size_t length) {
+    while (length > 0) {
+        uint32_t chunk = length < DELTA_MAX_LITERAL ? length : DELTA_MAX_LITERAL;
+        delta_append_record(delta, DELTA_LITERAL, chunk, 0, DELTA_LITERAL_SIZE);
+        delta.insert(delta.end(), data, data + chunk);
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+
+// delta_encoder
+//
+//  A delta being written a step at a time as its reader needs more of it. The window has
+//  slid up to position, literal data from literal_start on is not written out yet, and the
+//  copy being built covers copy_count blocks from copy_block. checksum covers the file up to
+//  literal_start. Blocks are indexed by rolling checksum and by strong hash, the first of
+//  several identical blocks standing for all of them.
+//
+struct delta_encoder {
+    const char *file;
+    size_t size;
+    int block_size;
+    std::vector<delta_signature> signatures;
+    std::unordered_set<uint32_t> rolling_values;
+    std::unordered_map<uint64_t, uint32_t> strong_blocks;
+    std::vector<bool> tags;
+
+    size_t position;
+    size_t literal_start;
+    uint32_t copy_block;
+    uint32_t copy_count;
+    delta_rolling rolling;
+    bool rolling_valid;
+    uint32_t checksum;
+
+    // Bytes hashed, checksummed or slid over so far, which bounds the work of each step
+    uint64_t work;
+
+    // Hashing spent on windows that matched no block, and whether it is still worth looking
+    uint64_t false_match_bytes;
+    bool matching;
+
+    uint64_t copied;
+    bool finished;
+};
+
+
+// delta_encoder_init
+//
+//  Start writing the delta turning the client's copy, known by its block signatures, into
+//  the server's copy of size bytes
+//
+inline void delta_encoder_init(delta_encoder &encoder, const char file[], size_t size, int block_size,
+                               std::vector<delta_signature> signatures) {
+    encoder.file = file;
+    encoder.size = size;
+    encoder.block_size = block_size;
+    encoder.signatures = std::move(signatures);
+
+    // A table of tags rules out most windows before the index is looked at
+    encoder.tags.assign(1 << DELTA_TAG_BITS, false);
+    for (uint32_t i = 0; i < encoder.signatures.size(); i++) {
+        encoder.rolling_values.insert(encoder.signatures[i].rolling);
+        encoder.strong_blocks.emplace(encoder.signatures[i].strong, i);
+        encoder.tags[delta_tag(encoder.signatures[i].rolling)] = true;
+    }
+
+    encoder.position = 0;
+    encoder.literal_start = 0;
+    encoder.copy_block = 0;
+    encoder.copy_count = 0;
+    encoder.rolling_valid = false;
+    encoder.checksum = 0;
+    encoder.work = 0;
+    encoder.false_match_bytes = 0;
+    encoder.matching = block_size > 0 && !encoder.signatures.empty();
+    encoder.copied = 0;
+    encoder.finished = false;
+}
+
+
+// delta_find_block
+//
+//  Look for a block of the client's copy matching the window, preferring the block right
+//  after the copy being built so runs of blocks stay one copy. Returns -1 if there is none.
+//  Every window is hashed at most once, however many blocks share its rolling checksum.
+//
+inline int64_t delta_find_block(delta_encoder &encoder) {
+    uint32_t value = delta_rolling_value(encoder.rolling);
+    if (!encoder.tags[delta_tag(value)] || encoder.rolling_values.count(value) == 0) {
+        return -1;
+    }
+
+    uint64_t strong = delta_strong_hash(encoder.file + encoder.position, encoder.block_size);
+    encoder.work += encoder.block_size;
+
+    uint32_t next = encoder.copy_block + encoder.copy_count;
+    if (encoder.copy_count > 0 && next < encoder.signatures.size() && encoder.signatures[next].rolling == value &&
+        encoder.signatures[next].strong == strong) {
+        return next;
+    }
+
+    auto found = encoder.strong_blocks.find(strong);
+    if (found != encoder.strong_blocks.end() && encoder.signatures[found->second].rolling == value) {
+        return found->second;
+    }
+
+    // Once rolling checksums that match for nothing have cost more than the budget, stop
+    // looking for matches
+    encoder.false_match_bytes += encoder.block_size;
+    if (encoder.false_match_bytes > (uint64_t)DELTA_FALSE_MATCH_FACTOR * encoder.size) {
+        encoder.matching = false;
+    }
+    return -1;
+}
+
+
+// delta_flush_copy
+//
+//  Write out the copy being built, if there is one
+//
+inline void delta_flush_copy(delta_encoder &encoder, std::vector<char> &delta) {
+    if (encoder.copy_count > 0) {
+        delta_append_record(delta, DELTA_COPY, encoder.copy_block, encoder.copy_count, DELTA_COPY_SIZE);
+        encoder.copy_count = 0;
+    }
+}
+
+
+// delta_flush_literal
+//
+//  Write out the literal data from literal_start up to end
+//
+inline void delta_flush_literal(delta_encoder &encoder, std::vector<char> &delta, size_t end) {
+    const char *literal = encoder.file + encoder.literal_start;
+    size_t length = end - encoder.literal_start;
+    delta_append_literal(delta, literal, length);
+    encoder.checksum = crc32c(encoder.checksum, literal, length);
+    encoder.work += length;
+    encoder.literal_start = end;
+}
+
+
+// delta_slide_window
+//
+//  Take the block the window matches, or slide the window one byte along if it matches none
+//
+inline void delta_slide_window(delta_encoder &encoder, std::vector<char> &delta) {
+    const char *window = encoder.file + encoder.position;
+    int block_size = encoder.block_size;
+
+    if (!encoder.rolling_valid) {
+        delta_rolling_init(encoder.rolling, window, block_size);
+        encoder.rolling_valid = true;
+        encoder.work += block_size;
+    }
+
+    int64_t match = delta_find_block(encoder);
+    if (match < 0) {
+        if (encoder.position + block_size < encoder.size) {
+            delta_rolling_roll(encoder.rolling, window[0], window[block_size]);
+        }
+        encoder.position++;
+        encoder.work++;
+
+        if (encoder.position - encoder.literal_start >= DELTA_LITERAL_CHUNK) {
+            delta_flush_copy(encoder, delta);
+            delta_flush_literal(encoder, delta, encoder.position);
+        }
+        return;
+    }
+
+    // Literal data since the last match ends the copy being built
+    bool follows_copy = encoder.copy_count > 0 && match == encoder.copy_block + encoder.copy_count;
+    if (encoder.literal_start < encoder.position || (encoder.copy_count > 0 && !follows_copy)) {
+        delta_flush_copy(encoder, delta);
+        delta_flush_literal(encoder, delta, encoder.position);
+    }
+    if (encoder.copy_count == 0) {
+        encoder.copy_block = match;
+    }
+    encoder.copy_count++;
+    encoder.copied += block_size;
+
+    encoder.checksum = crc32c(encoder.checksum, window, block_size);
+    encoder.work += block_size;
+    encoder.position += block_size;
+    encoder.literal_start = encoder.position;
+    encoder.rolling_valid = false;
+}
+
+
+// delta_encode_step
+//
+//  Slide the window along until about max_work more bytes have been hashed, checksummed or
+//  slid over, appending the records that completes to delta. Past the last whole window, or
+//  once matching is not worth it, the rest of the file goes as literal data a chunk at a
+//  time. Returns true once the delta ends with its end record, holding the CRC32C of the
+//  whole file.
+//
+inline bool delta_encode_step(delta_encoder &encoder, std::vector<char> &delta, uint64_t max_work) {
+    uint64_t step_end = encoder.work + max_work;
+
+    while (!encoder.finished && encoder.work < step_end) {
+        if (encoder.matching && encoder.position + encoder.block_size <= encoder.size) {
+            delta_slide_window(encoder, delta);
+            continue;
+        }
+
+        delta_flush_copy(encoder, delta);
+        encoder.position = std::min(encoder.size, encoder.literal_start + DELTA_LITERAL_CHUNK);
+        delta_flush_literal(encoder, delta, encoder.position);
+
+        if (encoder.literal_start == encoder.size) {
+            delta_append_record(delta, DELTA_END, encoder.checksum, 0, DELTA_END_SIZE);
+            encoder.finished = true;
+        }
+    }
+
+    return encoder.finished;
+}
+
+#endif
@@ -0,0 +1,299 @@
+// fec.h
+//
+//  Forward error correction shared by the client and server. A transfer is cut into blocks
+//  of consecutive packets, and the server follows each block with parity packets the client
+//  can rebuild lost or damaged packets of the block from, without waiting for a resend.
+//
+//  Every packet of a block is coded as a symbol holding its payload length and its payload
+//  padded with zeros to the full payload size. XOR parity is one symbol that is the XOR of
+//  the block's symbols and rebuilds one lost packet. Reed-Solomon parity uses a Cauchy matrix
+//  over GF(256), so any M parity symbols rebuild up to M lost packets of the block.
+//
+//  A parity packet carries its parity index and the number of packets in its block ahead of
+//  the coded symbol, and the block number in place of the packet number.
+
+#ifndef	__FEC_H
+#define	__FEC_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+
+#define	FEC_NONE 0
+#define	FEC_XOR 1
+#define	FEC_REED_SOLOMON 2
+
+// Terminator byte marking a parity packet, data packets use '1'
+#define	FEC_PARITY_TERM 'F'
+
+// Parity index and block packet count ahead of the coded symbol in a parity packet
+#define	FEC_HEADER_SIZE 2
+
+// Payload bytes a data packet gives up so a parity packet, which also codes the payload
+// length, still fits in a segment
+#define	FEC_OVERHEAD (FEC_HEADER_SIZE + 2)
+
+// Block packet counts travel in one byte, and Cauchy parity needs a distinct point in
+// GF(256) for every packet and parity index of a block, so packets plus parity stay at or
+// below 256
+#define	FEC_MAX_BLOCK 255
+#define	FEC_MAX_PARITY 32
+
+
+// gf256_tables
+//
+//  Exponent and logarithm tables for GF(256) with the polynomial x^8 + x^4 + x^3 + x^2 + 1
+//
+struct gf256_tables {
+    uint8_t exp[512];
+    uint8_t log[256];
+
+    gf256_tables() {
+        int value = 1;
+        for (int i = 0; i < 255; i++) {
+            exp[i] = value;
+            log[value] = i;
+            value <<= 1;
+            if (value & 0x100) {
+                value ^= 0x11D;
+            }
+        }
+        for (int i = 255; i < 512; i++) {
+            exp[i] = exp[i - 255];
+        }
+        log[0] = 0;
+    }
+};
+
+inline const gf256_tables gf256;
+
+
+// gf256_mul
+//
+//  Multiply two elements of GF(256)
+//
+inline uint8_t gf256_mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) {
+        return 0;
+    }
+    return gf256.exp[gf256.log[a] + gf256.log[b]];
+}
+
+
+// gf256_inverse
+//
+//  Multiplicative inverse of a non-zero element of GF(256)
+//
+inline uint8_t gf256_inverse(uint8_t a) {
+    return gf256.exp[255 - gf256.log[a]];
+}
+
+
+// gf256_mul_add
+//
+//  Add coefficient * source into destination, element by element. A coefficient of 1 is a
+//  plain XOR, which is all XOR parity ever needs.
+//
+inline void gf256_mul_add(uint8_t destination[], const uint8_t source[], uint8_t coefficient, size_t length) {
+    if (coefficient == 0) {
+        return;
+    }
+
+    if (coefficient == 1) {
+        size_t i = 0;
+        for (; i + 8 <= length; i += 8) {
+            uint64_t a, b;
+            memcpy(&a, destination + i, 8);
+            memcpy(&b, source + i, 8);
+            a ^= b;
+            memcpy(destination + i, &a, 8);
+        }
+        for (; i < length; i++) {
+            destination[i] ^= source[i];
+        }
+        return;
+    }
+
+    // One row of the multiplication table makes every element a single lookup
+    uint8_t row[256];
+    for (int value = 0; value < 256; value++) {
+        row[value] = gf256_mul(coefficient, value);
+    }
+    for (size_t i = 0; i < length; i++) {
+        destination[i] ^= row[source[i]];
+    }
+}
+
+
+// fec_scheme_from_name
+//
+//  Look up a scheme by the name used in requests, returning FEC_NONE for anything unknown
+//
+inline int fec_scheme_from_name(const std::string &name) {
+    if (name == "xor") {
+        return FEC_XOR;
+    }
+    if (name == "rs") {
+        return FEC_REED_SOLOMON;
+    }
+    return FEC_NONE;
+}
+
+
+// fec_scheme_name
+//
+//  Name of a scheme as used in requests
+//
+inline const char *fec_scheme_name(int scheme) {
+    return scheme == FEC_XOR ? "xor" : (scheme == FEC_REED_SOLOMON ? "rs" : "none");
+}
+
+
+// fec_coefficient
+//
+//  Weight of a block's data packet in one of its parity symbols. Reed-Solomon uses the
+//  Cauchy matrix 1 / (x + y) with points x = 255 - parity index and y = packet index, every
+//  square submatrix of which can be inverted as long as the points never meet.
+//
+inline uint8_t fec_coefficient(int scheme, int parity_index, int data_index) {
+    if (scheme == FEC_XOR) {
+        return 1;
+    }
+    return gf256_inverse((uint8_t)((255 - parity_index) ^ data_index));
+}
+
+
+// fec_symbol_size
+//
+//  Bytes in the symbol of a packet with the given payload size
+//
+inline int fec_symbol_size(int data_size) {
+    return 2 + data_size;
+}
+
+
+// fec_make_symbol
+//
+//  Symbol of one received data packet: its payload length, low byte first, then its payload
+//  padded with zeros
+//
+inline void fec_make_symbol(std::vector<char> &symbol, const char payload[], int payload_length, int symbol_size) {
+    symbol.assign(symbol_size, '\0');
+    symbol[0] = (char)(payload_length & 0xFF);
+    symbol[1] = (char)(payload_length >> 8);
+    memcpy(&symbol[2], payload, payload_length);
+}
+
+
+// fec_symbol_length
+//
+//  Payload length held in a symbol
+//
+inline int fec_symbol_length(const std::vector<char> &symbol) {
+    return (uint8_t)symbol[0] | (uint8_t)symbol[1] << 8;
+}
+
+
+// fec_encode_symbol
+//
+//  Add one data packet into the parity symbols of its block. The parity symbols start out
+//  zeroed and are symbol_size bytes each, one after another.
+//
+inline void fec_encode_symbol(int scheme, int parity_count, int data_index, const char payload[], int payload_length,
+                              int symbol_size, uint8_t parity[]) {
+    uint8_t length[2] = {(uint8_t)(payload_length & 0xFF), (uint8_t)(payload_length >> 8)};
+
+    for (int j = 0; j < parity_count; j++) {
+        uint8_t coefficient = fec_coefficient(scheme, j, data_index);
+        uint8_t *symbol = parity + (size_t)j * symbol_size;
+        gf256_mul_add(symbol, length, coefficient, 2);
+        gf256_mul_add(symbol + 2, (const uint8_t *)payload, coefficient, payload_length);
+    }
+}
+
+
+// fec_recover
+//
+//  Rebuild the missing symbols of a block of count packets. symbols holds every packet's
+//  symbol, with the missing ones empty, and parity the received parity symbols keyed by
+//  parity index. Fills in the missing symbols and returns true if there was enough parity.
+//
+inline bool fec_recover(int scheme, int count, int symbol_size, std::vector<std::vector<char>> &symbols,
+                        const std::vector<std::pair<int, std::vector<char>>> &parity) {
+    std::vector<int> missing;
+    for (int i = 0; i < count; i++) {
+        if (symbols[i].empty()) {
+            missing.push_back(i);
+        }
+    }
+
+    int unknowns = missing.size();
+    if (unknowns == 0) {
+        return true;
+    }
+    if (unknowns > (int)parity.size()) {
+        return false;
+    }
+
+    // Take what the known packets contributed out of each parity symbol we use, leaving a
+    // square system in the missing symbols
+    std::vector<std::vector<uint8_t>> matrix(unknowns, std::vector<uint8_t>(unknowns));
+    std::vector<std::vector<uint8_t>> rows(unknowns);
+
+    for (int r = 0; r < unknowns; r++) {
+        int parity_index = parity[r].first;
+        rows[r].assign(parity[r].second.begin(), parity[r].second.end());
+
+        for (int i = 0; i < count; i++) {
+            if (!symbols[i].empty()) {
+                gf256_mul_add(&rows[r][0], (const uint8_t *)&symbols[i][0], fec_coefficient(scheme, parity_index, i), symbol_size);
+            }
+        }
+        for (int t = 0; t < unknowns; t++) {
+            matrix[r][t] = fec_coefficient(scheme, parity_index, missing[t]);
+        }
+    }
+
+    // Gauss-Jordan elimination, applying every row operation to the symbols as well
+    for (int column = 0; column < unknowns; column++) {
+        int pivot = column;
+        while (pivot < unknowns && matrix[pivot][column] == 0) {
+            pivot++;
+        }
+        if (pivot == unknowns) {
+            return false;
+        }
+        std::swap(matrix[pivot], matrix[column]);
+        std::swap(rows[pivot], rows[column]);
+
+        uint8_t scale = gf256_inverse(matrix[column][column]);
+        if (scale != 1) {
+            for (int t = 0; t < unknowns; t++) {
+                matrix[column][t] = gf256_mul(matrix[column][t], scale);
+            }
+            std::vector<uint8_t> scaled(symbol_size, 0);
+            gf256_mul_add(&scaled[0], &rows[column][0], scale, symbol_size);
+            rows[column].swap(scaled);
+        }
+
+        for (int r = 0; r < unknowns; r++) {
+            uint8_t factor = matrix[r][column];
+            if (r == column || factor == 0) {
+                continue;
+            }
+            for (int t = 0; t < unknowns; t++) {
+                matrix[r][t] ^= gf256_mul(factor, matrix[column][t]);
+            }
+            gf256_mul_add(&rows[r][0], &rows[column][0], factor, symbol_size);
+        }
+    }
+
+    for (int t = 0; t < unknowns; t++) {
+        symbols[missing[t]].assign(rows[t].begin(), rows[t].end());
+    }
+
+    return true;
+}
+
+#endif
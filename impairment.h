@@ -0,0 +1,316 @@
+// impairment.h
+//
+//  Network impairment sitting between the protocol and the socket. Decides for each outgoing
+//  datagram whether it is lost, damaged, duplicated, delayed or reordered, and holds delayed
+//  datagrams in a timer wheel until they are due, so a late datagram never holds up the ones
+//  behind it. Every decision comes from a seeded PRNG, so runs with the same seed and traffic
+//  make the same decisions.
+
+#ifndef	__IMPAIRMENT_H
+#define	__IMPAIRMENT_H
+
+#include <chrono>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+
+// Held datagrams are released with this resolution, and one turn of the wheel covers
+// IMPAIRMENT_WHEEL_SLOTS ticks. Longer holds just wait for the wheel to come round again.
+#define	IMPAIRMENT_TICK_US 50
+#define	IMPAIRMENT_WHEEL_SLOTS 1024
+
+
+// impairment_settings
+//
+//  Chances of each impairment, all between 0 and 1. Loss follows a Gilbert-Elliott model: the
+//  link moves from its good state to a bursty bad state with burst_enter_chance and back with
+//  burst_exit_chance per datagram, losing loss_chance of datagrams while good and
+//  burst_loss_chance while bad. Delayed datagrams arrive delay_us late, reordered ones up to
+//  reorder_us late.
+//
+struct impairment_settings {
+    double loss_chance = 0;
+    double damage_chance = 0;
+    double delay_chance = 0;
+    int64_t delay_us = 0;
+    double reorder_chance = 0;
+    int64_t reorder_us = 1000;
+    double duplicate_chance = 0;
+    double burst_enter_chance = 0;
+    double burst_exit_chance = 0.25;
+    double burst_loss_chance = 1;
+    uint64_t seed = 1;
+};
+
+
+// impairment_verdict
+//
+//  What happens to one datagram. A held datagram goes out hold_us from now.
+//
+struct impairment_verdict {
+    bool drop = false;
+    bool burst = false;
+    int damaged_bytes = 0;
+    bool duplicate = false;
+    bool delayed = false;
+    bool reordered = false;
+    int64_t hold_us = 0;
+};
+
+
+// held_datagram
+//
+//  A copy of a datagram waiting in the timer wheel
+//
+struct held_datagram {
+    std::vector<char> data;
+    struct sockaddr_in to;
+    uint64_t release_tick;
+};
+
+
+// impairment_engine
+//
+//  Impairment state for one sending thread: its settings, PRNG, Gilbert-Elliott state and
+//  timer wheel. Buffers of released datagrams are kept for reuse.
+//
+struct impairment_engine {
+    impairment_settings settings;
+    bool enabled;
+    uint64_t rng[4];
+    bool burst_state;
+
+    std::chrono::steady_clock::time_point start_time;
+    uint64_t current_tick;
+    size_t held_count;
+    std::vector<std::vector<held_datagram>> wheel;
+    std::vector<std::vector<char>> spare_buffers;
+    std::vector<char> scratch;
+};
+
+
+// impairment_active
+//
+//  Check whether settings would ever touch a datagram
+//
+inline bool impairment_active(const impairment_settings &settings) {
+    return settings.loss_chance > 0 || settings.damage_chance > 0 || settings.delay_chance > 0 ||
+           settings.reorder_chance > 0 || settings.duplicate_chance > 0 || settings.burst_enter_chance > 0;
+}
+
+
+// impairment_random
+//
+//  Next number from the engine's xoshiro256** generator
+//
+inline uint64_t impairment_random(impairment_engine &engine) {
+    uint64_t *s = engine.rng;
+    uint64_t result = ((s[1] * 5) << 7 | (s[1] * 5) >> 57) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = s[3] << 45 | s[3] >> 19;
+
+    return result;
+}
+
+
+// impairment_chance
+//
+//  Return true with the given probability. A chance of 0 never draws a number.
+//
+inline bool impairment_chance(impairment_engine &engine, double chance) {
+    if (chance <= 0) {
+        return false;
+    }
+    return (impairment_random(engine) >> 11) * 0x1.0p-53 < chance;
+}
+
+
+// init_impairment
+//
+//  Set an engine up with the given settings. Engines given different streams draw different
+//  numbers from the same seed, so each thread's decisions are reproducible on their own.
+//
+inline void init_impairment(impairment_engine &engine, const impairment_settings &settings, uint64_t stream) {
+    engine.settings = settings;
+    engine.enabled = impairment_active(settings);
+    engine.burst_state = false;
+
+    // Expand the seed into the generator state with splitmix64
+    uint64_t seed = settings.seed ^ (stream * 0x9E3779B97F4A7C15ULL);
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        engine.rng[i] = z ^ (z >> 31);
+    }
+
+    engine.start_time = std::chrono::steady_clock::now();
+    engine.current_tick = 0;
+    engine.held_count = 0;
+    engine.wheel.assign(IMPAIRMENT_WHEEL_SLOTS, std::vector<held_datagram>());
+    engine.spare_buffers.clear();
+}
+
+
+// impair_datagram
+//
+//  Decide the fate of the next datagram
+//
+inline impairment_verdict impair_datagram(impairment_engine &engine) {
+    const impairment_settings &settings = engine.settings;
+    impairment_verdict verdict;
+
+    // Move between the good and bad Gilbert-Elliott states, then lose the datagram at the
+    // current state's rate
+    if (engine.burst_state) {
+        engine.burst_state = !impairment_chance(engine, settings.burst_exit_chance);
+    } else {
+        engine.burst_state = impairment_chance(engine, settings.burst_enter_chance);
+    }
+
+    if (impairment_chance(engine, engine.burst_state ? settings.burst_loss_chance : settings.loss_chance)) {
+        verdict.drop = true;
+        verdict.burst = engine.burst_state;
+        return verdict;
+    }
+
+    // Damage one byte 70% of the time, two bytes 20% and three 10%
+    if (impairment_chance(engine, settings.damage_chance)) {
+        uint64_t spread = impairment_random(engine) % 10;
+        verdict.damaged_bytes = spread < 7 ? 1 : (spread < 9 ? 2 : 3);
+    }
+
+    verdict.duplicate = impairment_chance(engine, settings.duplicate_chance);
+
+    // A delayed datagram arrives a fixed time late, a reordered one a random time up to
+    // reorder_us late so that datagrams sent after it overtake it
+    if (impairment_chance(engine, settings.delay_chance)) {
+        verdict.delayed = true;
+        verdict.hold_us = std::max<int64_t>(1, settings.delay_us);
+    } else if (impairment_chance(engine, settings.reorder_chance)) {
+        verdict.reordered = true;
+        verdict.hold_us = 1 + impairment_random(engine) % std::max<int64_t>(1, settings.reorder_us);
+    }
+
+    return verdict;
+}
+
+
+// damage_datagram
+//
+//  Flip bits in the given number of randomly picked bytes
+//
+inline void damage_datagram(impairment_engine &engine, char data[], int length, int damaged_bytes) {
+    for (int i = 0; i < damaged_bytes && length > 0; i++) {
+        uint64_t random = impairment_random(engine);
+        data[random % length] ^= (char)(1 + (random >> 32) % 255);
+    }
+}
+
+
+// impairment_tick
+//
+//  Wheel tick a time falls in
+//
+inline uint64_t impairment_tick(const impairment_engine &engine, std::chrono::steady_clock::time_point time) {
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(time - engine.start_time).count();
+    return elapsed < 0 ? 0 : elapsed / IMPAIRMENT_TICK_US;
+}
+
+
+// hold_datagram
+//
+//  Put a copy of a datagram into the timer wheel to go out hold_us from now. Returns the
+//  held copy so the caller can still damage it.
+//
+inline char *hold_datagram(impairment_engine &engine, const char header[], int header_length, const char payload[],
+                           int payload_length, const struct sockaddr_in &to, int64_t hold_us) {
+    auto release_time = std::chrono::steady_clock::now() + std::chrono::microseconds(hold_us);
+    uint64_t release_tick = std::max(engine.current_tick + 1, impairment_tick(engine, release_time) + 1);
+
+    std::vector<held_datagram> &slot = engine.wheel[release_tick % IMPAIRMENT_WHEEL_SLOTS];
+    slot.emplace_back();
+    held_datagram &held = slot.back();
+
+    if (!engine.spare_buffers.empty()) {
+        held.data.swap(engine.spare_buffers.back());
+        engine.spare_buffers.pop_back();
+    }
+
+    held.data.resize(header_length + payload_length);
+    memcpy(&held.data[0], header, header_length);
+    memcpy(&held.data[header_length], payload, payload_length);
+    held.to = to;
+    held.release_tick = release_tick;
+    engine.held_count++;
+
+    return &held.data[0];
+}
+
+
+// release_datagrams
+//
+//  Hand every held datagram that is now due to send(data, length, to), in the order they
+//  were due
+//
+template <typename Send>
+void release_datagrams(impairment_engine &engine, Send send) {
+    uint64_t now_tick = impairment_tick(engine, std::chrono::steady_clock::now());
+
+    while (engine.held_count > 0 && engine.current_tick < now_tick) {
+        // A whole turn without looking at the wheel only needs each slot visited once
+        if (now_tick - engine.current_tick > IMPAIRMENT_WHEEL_SLOTS) {
+            engine.current_tick = now_tick - IMPAIRMENT_WHEEL_SLOTS;
+        }
+
+        engine.current_tick++;
+        std::vector<held_datagram> &slot = engine.wheel[engine.current_tick % IMPAIRMENT_WHEEL_SLOTS];
+
+        // Datagrams due on a later turn stay in the slot
+        size_t kept = 0;
+        for (size_t i = 0; i < slot.size(); i++) {
+            if (slot[i].release_tick <= now_tick) {
+                send(&slot[i].data[0], (int)slot[i].data.size(), slot[i].to);
+                engine.spare_buffers.push_back(std::move(slot[i].data));
+                engine.held_count--;
+            } else {
+                if (kept != i) {
+                    slot[kept] = std::move(slot[i]);
+                }
+                kept++;
+            }
+        }
+        slot.resize(kept);
+    }
+
+    engine.current_tick = std::max(engine.current_tick, now_tick);
+}
+
+
+// next_release_time
+//
+//  When the next held datagram may be due, or time_point::max() when nothing is held
+//
+inline std::chrono::steady_clock::time_point next_release_time(const impairment_engine &engine) {
+    if (engine.held_count == 0) {
+        return std::chrono::steady_clock::time_point::max();
+    }
+
+    // Wake at the first slot holding anything, which may turn out to be for a later turn
+    for (uint64_t tick = engine.current_tick + 1; tick <= engine.current_tick + IMPAIRMENT_WHEEL_SLOTS; tick++) {
+        if (!engine.wheel[tick % IMPAIRMENT_WHEEL_SLOTS].empty()) {
+            return engine.start_time + std::chrono::microseconds(tick * IMPAIRMENT_TICK_US);
+        }
+    }
+
+    return engine.start_time + std::chrono::microseconds((engine.current_tick + 1) * IMPAIRMENT_TICK_US);
+}
+
+#endif
@@ -0,0 +1,272 @@
+// logger.h
+//
+//  Leveled logging shared by the client and server. Log lines are formatted into a fixed
+//  buffer on the calling thread, pushed onto a lock-free ring and written out by a background
+//  thread, so the send and receive loops never block on stdout. Levels below
+//  LOG_COMPILED_LEVEL are compiled out entirely, the rest can be filtered at runtime.
+
+#ifndef	__LOGGER_H
+#define	__LOGGER_H
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <string>
+#include <memory>
+#include <charconv>
+#include <type_traits>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define	LOG_LEVEL_TRACE 0
+#define	LOG_LEVEL_DEBUG 1
+#define	LOG_LEVEL_INFO 2
+#define	LOG_LEVEL_ERROR 3
+#define	LOG_LEVEL_OFF 4
+
+// Release builds (-DNDEBUG) drop per-packet trace and debug logging unless asked otherwise
+#ifndef LOG_COMPILED_LEVEL
+#ifdef NDEBUG
+#define	LOG_COMPILED_LEVEL LOG_LEVEL_INFO
+#else
+#define	LOG_COMPILED_LEVEL LOG_LEVEL_TRACE
+#endif
+#endif
+
+// Longest log line kept, enough for a JSON metrics summary. Longer lines are cut short.
+#define	LOG_LINE_SIZE 1024
+
+// Number of lines the ring holds before new lines are dropped, must be a power of two
+#define	LOG_RING_SIZE 4096
+
+
+// log_line
+//
+//  One log line being formatted on the stack, without touching the heap
+//
+struct log_line {
+    char text[LOG_LINE_SIZE];
+    int length = 0;
+
+    log_line &operator<<(const char *value) {
+        return append(value, strlen(value));
+    }
+
+    log_line &operator<<(const std::string &value) {
+        return append(value.data(), value.length());
+    }
+
+    log_line &operator<<(char value) {
+        return append(&value, 1);
+    }
+
+    template <typename T, typename std::enable_if<std::is_arithmetic<T>::value && !std::is_same<T, bool>::value, int>::type = 0>
+    log_line &operator<<(T value) {
+        char number[32];
+        auto result = std::to_chars(number, number + sizeof(number), value);
+        return append(number, result.ptr - number);
+    }
+
+    log_line &append(const char *value, size_t value_length) {
+        size_t room = LOG_LINE_SIZE - 1 - length;
+        value_length = std::min(value_length, room);
+        memcpy(text + length, value, value_length);
+        length += value_length;
+        return *this;
+    }
+};
+
+
+// log_slot
+//
+//  One entry of the ring. The sequence number tells producers and the writer thread whose
+//  turn it is to use the slot.
+//
+struct log_slot {
+    std::atomic<uint64_t> sequence;
+    int length;
+    char text[LOG_LINE_SIZE];
+};
+
+
+// log_ring
+//
+//  Bounded multi-producer ring drained by a single writer thread. Producers claim a slot with
+//  one compare and swap and never wait, a full ring drops the line and counts it instead.
+//
+struct log_ring {
+    std::unique_ptr<log_slot[]> slots;
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) uint64_t tail;
+    std::atomic<uint64_t> dropped;
+    std::atomic<bool> running;
+    std::thread writer;
+};
+
+// Lines below this level are skipped at runtime
+inline std::atomic<int> log_level(LOG_LEVEL_INFO);
+
+inline log_ring log_queue;
+
+
+// log_push
+//
+//  Queue a finished line for the writer thread, or write it straight away when the writer
+//  is not running
+//
+inline void log_push(log_line &line) {
+    line.text[line.length++] = '\n';
+
+    if (!log_queue.running.load(std::memory_order_acquire)) {
+        fwrite(line.text, 1, line.length, stdout);
+        fflush(stdout);
+        return;
+    }
+
+    uint64_t position = log_queue.head.load(std::memory_order_relaxed);
+    while (true) {
+        log_slot &slot = log_queue.slots[position & (LOG_RING_SIZE - 1)];
+        int64_t difference = (int64_t)(slot.sequence.load(std::memory_order_acquire) - position);
+
+        if (difference == 0) {
+            if (log_queue.head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                slot.length = line.length;
+                memcpy(slot.text, line.text, line.length);
+                slot.sequence.store(position + 1, std::memory_order_release);
+                return;
+            }
+        } else if (difference < 0) {
+            // The writer has fallen a whole ring behind, drop the line rather than wait
+            log_queue.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            position = log_queue.head.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+
+// log_drain
+//
+//  Write every line queued so far to stdout, returning whether there were any
+//
+inline bool log_drain() {
+    static char output[64 * 1024];
+    size_t output_length = 0;
+    bool drained = false;
+
+    while (true) {
+        log_slot &slot = log_queue.slots[log_queue.tail & (LOG_RING_SIZE - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != log_queue.tail + 1) {
+            break;
+        }
+
+        if (output_length + slot.length > sizeof(output)) {
+            fwrite(output, 1, output_length, stdout);
+            output_length = 0;
+        }
+
+        memcpy(output + output_length, slot.text, slot.length);
+        output_length += slot.length;
+
+        slot.sequence.store(log_queue.tail + LOG_RING_SIZE, std::memory_order_release);
+        log_queue.tail++;
+        drained = true;
+    }
+
+    if (drained) {
+        fwrite(output, 1, output_length, stdout);
+        fflush(stdout);
+    }
+
+    return drained;
+}
+
+
+// log_start
+//
+//  Start the writer thread, logging lines at or above the given level from now on
+//
+inline void log_start(int level) {
+    log_level.store(level, std::memory_order_relaxed);
+
+    log_queue.slots.reset(new log_slot[LOG_RING_SIZE]);
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++) {
+        log_queue.slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    log_queue.head.store(0, std::memory_order_relaxed);
+    log_queue.tail = 0;
+    log_queue.dropped.store(0, std::memory_order_relaxed);
+    log_queue.running.store(true, std::memory_order_release);
+
+    log_queue.writer = std::thread([]() {
+        uint64_t reported_dropped = 0;
+
+        while (log_queue.running.load(std::memory_order_acquire)) {
+            if (!log_drain()) {
+                usleep(1000);
+            }
+
+            uint64_t dropped = log_queue.dropped.load(std::memory_order_relaxed);
+            if (dropped != reported_dropped) {
+                fprintf(stdout, "[Error] Logger fell behind and dropped %llu lines\n", (unsigned long long)(dropped - reported_dropped));
+                reported_dropped = dropped;
+            }
+        }
+
+        log_drain();
+    });
+}
+
+
+// log_stop
+//
+//  Write out everything still queued and stop the writer thread
+//
+inline void log_stop() {
+    if (!log_queue.running.load(std::memory_order_acquire)) {
+        return;
+    }
+
+    log_queue.running.store(false, std::memory_order_release);
+    log_queue.writer.join();
+}
+
+
+// log_level_from_name
+//
+//  Look up a level by its name, trace, debug, info, error or off. Returns -1 for anything else.
+//
+inline int log_level_from_name(const std::string &name) {
+    const char *names[] = { "trace", "debug", "info", "error", "off" };
+    for (int level = LOG_LEVEL_TRACE; level <= LOG_LEVEL_OFF; level++) {
+        if (name == names[level]) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+
+// LOG_AT
+//
+//  Log a line built with << at the given level. The level test against LOG_COMPILED_LEVEL is
+//  a constant, so disabled levels leave no code behind.
+//
+#define	LOG_AT(level, message) \
+    do { \
+        if ((level) >= LOG_COMPILED_LEVEL && (level) >= log_level.load(std::memory_order_relaxed)) { \
+            log_line log_line_; \
+            log_line_ << message; \
+            log_push(log_line_); \
+        } \
+    } while (0)
+
+#define	LOG_TRACE(message) LOG_AT(LOG_LEVEL_TRACE, message)
+#define	LOG_DEBUG(message) LOG_AT(LOG_LEVEL_DEBUG, message)
+#define	LOG_INFO(message) LOG_AT(LOG_LEVEL_INFO, message)
+#define	LOG_ERROR(message) LOG_AT(LOG_LEVEL_ERROR, message)
+
+#endif
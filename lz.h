@@ -0,0 +1,251 @@
+// lz.h
+//
+//  Fast LZ77 block compression shared by the client and server, using the LZ4 block format.
+//  A block is a run of sequences, each a token holding the literal and match lengths, the
+//  literals, a two byte little-endian offset back into the output and any length bytes the
+//  token could not hold. The last sequence is literals only. Blocks are compressed on their
+//  own, so each can be decompressed without any other.
+//
+//  Blocks are at most 64 KB, the most a packet can carry, so positions fit in 16 bits.
+
+#ifndef	__LZ_H
+#define	__LZ_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define	LZ_MIN_MATCH 4
+#define	LZ_HASH_BITS 12
+
+// Matches never reach into the last LZ_LAST_LITERALS bytes of a block, and none start in its
+// last LZ_MATCH_LIMIT bytes, which the LZ4 format expects of every block
+#define	LZ_LAST_LITERALS 5
+#define	LZ_MATCH_LIMIT 12
+
+
+// lz_read32
+//
+//  Read four bytes from any alignment
+//
+inline uint32_t lz_read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+
+// lz_hash
+//
+//  Hash table slot for the four bytes at a position
+//
+inline uint32_t lz_hash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+
+// lz_write_length
+//
+//  Write the part of a length its token could not hold, 255 at a time. Returns the new
+//  output position, or -1 if the output is full.
+//
+inline int lz_write_length(uint8_t dst[], int op, int capacity, int length) {
+    while (length >= 255) {
+        if (op >= capacity) {
+            return -1;
+        }
+        dst[op++] = 255;
+        length -= 255;
+    }
+    if (op >= capacity) {
+        return -1;
+    }
+    dst[op++] = length;
+    return op;
+}
+
+
+// lz_write_sequence
+//
+//  Write one sequence of literals followed by a match, or literals only when match_length
+//  is 0. Returns the new output position, or -1 if the output is full.
+//
+inline int lz_write_sequence(uint8_t dst[], int op, int capacity, const uint8_t literals[], int literal_length,
+                             int offset, int match_length) {
+    if (op >= capacity) {
+        return -1;
+    }
+
+    int token = op++;
+    dst[token] = (literal_length < 15 ? literal_length : 15) << 4;
+    if (literal_length >= 15 && (op = lz_write_length(dst, op, capacity, literal_length - 15)) < 0) {
+        return -1;
+    }
+
+    if (literal_length > capacity - op) {
+        return -1;
+    }
+    if (literal_length > 0) {
+        memcpy(dst + op, literals, literal_length);
+        op += literal_length;
+    }
+
+    if (match_length == 0) {
+        return op;
+    }
+
+    if (capacity - op < 2) {
+        return -1;
+    }
+    dst[op++] = offset & 0xFF;
+    dst[op++] = offset >> 8;
+
+    int extra = match_length - LZ_MIN_MATCH;
+    dst[token] |= extra < 15 ? extra : 15;
+    if (extra >= 15 && (op = lz_write_length(dst, op, capacity, extra - 15)) < 0) {
+        return -1;
+    }
+
+    return op;
+}
+
+
+// lz_compress
+//
+//  Compress a block of up to 64 KB into at most capacity bytes, returning the compressed
+//  length or -1 if it does not fit. Passing the block's own length less one as the capacity
+//  gives up as soon as compressing would not save anything.
+//
+inline int lz_compress(const char source[], int length, char destination[], int capacity) {
+    const uint8_t *src = (const uint8_t *)source;
+    uint8_t *dst = (uint8_t *)destination;
+    uint16_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    int ip = 0;
+    int anchor = 0;
+    int op = 0;
+    int match_start_limit = length - LZ_MATCH_LIMIT;
+    int match_end_limit = length - LZ_LAST_LITERALS;
+
+    while (ip < match_start_limit) {
+        uint32_t sequence = lz_read32(src + ip);
+        uint32_t slot = lz_hash(sequence);
+        int candidate = table[slot];
+        table[slot] = ip;
+
+        if (candidate >= ip || lz_read32(src + candidate) != sequence) {
+            // Step faster through data that keeps failing to match
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        // Grow the match backwards over literals and forwards as far as it goes
+        while (ip > anchor && candidate > 0 && src[ip - 1] == src[candidate - 1]) {
+            ip--;
+            candidate--;
+        }
+
+        int match_length = LZ_MIN_MATCH;
+        while (ip + match_length < match_end_limit && src[ip + match_length] == src[candidate + match_length]) {
+            match_length++;
+        }
+
+        op = lz_write_sequence(dst, op, capacity, src + anchor, ip - anchor, ip - candidate, match_length);
+        if (op < 0) {
+            return -1;
+        }
+
+        ip += match_length;
+        anchor = ip;
+
+        // Remember a position inside the match so runs of it are found again
+        if (ip - 2 < match_start_limit) {
+            table[lz_hash(lz_read32(src + ip - 2))] = ip - 2;
+        }
+    }
+
+    return lz_write_sequence(dst, op, capacity, src + anchor, length - anchor, 0, 0);
+}
+
+
+// lz_read_length
+//
+//  Read the part of a length its token could not hold. Returns false if the block ends first.
+//
+inline bool lz_read_length(const uint8_t src[], int length, int &ip, int &value) {
+    uint8_t byte;
+    do {
+        if (ip >= length) {
+            return false;
+        }
+        byte = src[ip++];
+        value += byte;
+    } while (byte == 255);
+    return true;
+}
+
+
+// lz_decompress
+//
+//  Decompress a block into at most capacity bytes, returning the decompressed length or -1 if
+//  the block is malformed or would not fit. Never reads or writes out of bounds, whatever the
+//  block holds.
+//
+inline int lz_decompress(const char source[], int length, char destination[], int capacity) {
+    const uint8_t *src = (const uint8_t *)source;
+    uint8_t *dst = (uint8_t *)destination;
+    int ip = 0;
+    int op = 0;
+
+    while (ip < length) {
+        int token = src[ip++];
+
+        int literal_length = token >> 4;
+        if (literal_length == 15 && !lz_read_length(src, length, ip, literal_length)) {
+            return -1;
+        }
+        if (literal_length > length - ip || literal_length > capacity - op) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+
+        // The last sequence ends with its literals
+        if (ip == length) {
+            break;
+        }
+
+        if (length - ip < 2) {
+            return -1;
+        }
+        int offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op) {
+            return -1;
+        }
+
+        int match_length = token & 15;
+        if (match_length == 15 && !lz_read_length(src, length, ip, match_length)) {
+            return -1;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (match_length > capacity - op) {
+            return -1;
+        }
+
+        // Matches may overlap the bytes they produce, which repeats them
+        if (offset >= match_length) {
+            memcpy(dst + op, dst + op - offset, match_length);
+            op += match_length;
+        } else {
+            for (int i = 0; i < match_length; i++, op++) {
+                dst[op] = dst[op - offset];
+            }
+        }
+    }
+
+    return op;
+}
+
+#endif
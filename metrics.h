@@ -0,0 +1,370 @@
+// metrics.h
+//
+//  Per-transfer counters and histograms shared by the client and server, the JSON they are
+//  reported as, and a local stats socket that hands out a live JSON snapshot to anything that
+//  connects to it.
+
+#ifndef	__METRICS_H
+#define	__METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Histograms keep 8 linear buckets per power of two, so percentiles are within about 12%
+#define	HISTOGRAM_SUB_BUCKETS 8
+#define	HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_BUCKETS)
+
+
+// metrics_histogram
+//
+//  Distribution of a non-negative value such as an RTT in microseconds. Only one thread
+//  records into a histogram, but any thread may read it while it is being recorded.
+//
+struct metrics_histogram {
+    std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> min;
+    std::atomic<uint64_t> max;
+};
+
+
+// transfer_metrics
+//
+//  Everything measured about one transfer. The descriptive fields are filled in before the
+//  transfer is shared and never change afterwards. The counters have a single writer, the
+//  thread running the transfer, and are read live by the stats socket. On the server acks and
+//  naks count responses received, on the client responses sent. fec_parity counts parity
+//  packets sent or received and fec_recovered the packets the client rebuilt from them.
+//  compressed_segments counts packets whose payload went out compressed, and
+//  compression_saved_bytes what compressing them took off the file bytes they carry. range
+//  is the first and last byte of a transfer of only part of the file, empty for all of it.
+//
+struct transfer_metrics {
+    std::string role;
+    std::string filename;
+    std::string range;
+    std::string peer;
+    std::string mode;
+    int segment_size;
+    std::string fec;
+    std::string compression;
+    std::chrono::steady_clock::time_point start_time;
+
+    std::atomic<uint64_t> file_bytes;
+    std::atomic<uint64_t> bytes_delivered;
+    std::atomic<uint64_t> first_byte_us;
+    std::atomic<uint64_t> bytes_sent;
+    std::atomic<uint64_t> bytes_received;
+    std::atomic<uint64_t> segments_sent;
+    std::atomic<uint64_t> segments_received;
+    std::atomic<uint64_t> retransmissions;
+    std::atomic<uint64_t> acks;
+    std::atomic<uint64_t> naks;
+    std::atomic<uint64_t> timeouts;
+    std::atomic<uint64_t> duplicates;
+    std::atomic<uint64_t> out_of_order;
+    std::atomic<uint64_t> damaged;
+    std::atomic<uint64_t> gremlin_drops;
+    std::atomic<uint64_t> gremlin_corruptions;
+    std::atomic<uint64_t> gremlin_delays;
+    std::atomic<uint64_t> gremlin_reorders;
+    std::atomic<uint64_t> gremlin_duplicates;
+    std::atomic<uint64_t> fec_parity;
+    std::atomic<uint64_t> fec_recovered;
+    std::atomic<uint64_t> compressed_segments;
+    std::atomic<uint64_t> compression_saved_bytes;
+    metrics_histogram rtt_us;
+};
+
+
+// stats_socket
+//
+//  Listening Unix socket and the thread answering it
+//
+struct stats_socket {
+    int listen_fd = -1;
+    std::string path;
+    std::thread thread;
+};
+
+
+// metric_add
+//
+//  Add to a counter that only the calling thread writes. A plain load and store is enough
+//  for readers on other threads and avoids a locked instruction per packet.
+//
+inline void metric_add(std::atomic<uint64_t> &counter, uint64_t value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+
+// histogram_bucket
+//
+//  Find the bucket a value falls into
+//
+inline int histogram_bucket(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+
+    int exponent = 63 - __builtin_clzll(value);
+    int sub_bucket = (value >> (exponent - 3)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (exponent - 2) * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+
+// histogram_bucket_value
+//
+//  Smallest value that falls into a bucket
+//
+inline uint64_t histogram_bucket_value(int bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    int exponent = bucket / HISTOGRAM_SUB_BUCKETS + 2;
+    uint64_t sub_bucket = bucket % HISTOGRAM_SUB_BUCKETS;
+    return (HISTOGRAM_SUB_BUCKETS + sub_bucket) << (exponent - 3);
+}
+
+
+// histogram_record
+//
+//  Add one value to a histogram
+//
+inline void histogram_record(metrics_histogram &histogram, uint64_t value) {
+    metric_add(histogram.buckets[histogram_bucket(value)], 1);
+    metric_add(histogram.sum, value);
+
+    if (histogram.count.load(std::memory_order_relaxed) == 0 || value < histogram.min.load(std::memory_order_relaxed)) {
+        histogram.min.store(value, std::memory_order_relaxed);
+    }
+    if (value > histogram.max.load(std::memory_order_relaxed)) {
+        histogram.max.store(value, std::memory_order_relaxed);
+    }
+
+    metric_add(histogram.count, 1);
+}
+
+
+// histogram_percentile
+//
+//  Estimate the value below which the given fraction of recorded values fall
+//
+inline uint64_t histogram_percentile(const metrics_histogram &histogram, double fraction) {
+    uint64_t count = histogram.count.load(std::memory_order_relaxed);
+    if (count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = std::max<uint64_t>(1, fraction * count + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram.buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            return std::min(histogram_bucket_value(i), histogram.max.load(std::memory_order_relaxed));
+        }
+    }
+
+    return histogram.max.load(std::memory_order_relaxed);
+}
+
+
+// json_string
+//
+//  Quote a string for JSON, escaping anything that would break the document
+//
+inline std::string json_string(const std::string &value) {
+    std::string quoted = "\"";
+    for (unsigned char c : value) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+
+// histogram_json
+//
+//  Summarize a histogram as a JSON object
+//
+inline std::string histogram_json(const metrics_histogram &histogram) {
+    uint64_t count = histogram.count.load(std::memory_order_relaxed);
+    std::ostringstream json;
+
+    json << "{\"count\":" << count
+         << ",\"min\":" << histogram.min.load(std::memory_order_relaxed)
+         << ",\"mean\":" << (count > 0 ? histogram.sum.load(std::memory_order_relaxed) / count : 0)
+         << ",\"p50\":" << histogram_percentile(histogram, 0.5)
+         << ",\"p90\":" << histogram_percentile(histogram, 0.9)
+         << ",\"p99\":" << histogram_percentile(histogram, 0.99)
+         << ",\"max\":" << histogram.max.load(std::memory_order_relaxed) << "}";
+
+    return json.str();
+}
+
+
+// transfer_metrics_json
+//
+//  Report a transfer as a single line JSON object, with goodput measured over the file bytes
+//  delivered so far
+//
+inline std::string transfer_metrics_json(const transfer_metrics &metrics, const std::string &status) {
+    auto elapsed = std::chrono::steady_clock::now() - metrics.start_time;
+    uint64_t duration_us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    uint64_t bytes_delivered = metrics.bytes_delivered.load(std::memory_order_relaxed);
+    double goodput_mbps = duration_us > 0 ? bytes_delivered * 8.0 / duration_us : 0;
+
+    std::ostringstream json;
+    json << "{\"role\":" << json_string(metrics.role)
+         << ",\"file\":" << json_string(metrics.filename)
+         << ",\"range\":" << json_string(metrics.range.empty() ? "all" : metrics.range)
+         << ",\"peer\":" << json_string(metrics.peer)
+         << ",\"status\":" << json_string(status)
+         << ",\"mode\":" << json_string(metrics.mode)
+         << ",\"segment_size\":" << metrics.segment_size
+         << ",\"file_bytes\":" << metrics.file_bytes.load(std::memory_order_relaxed)
+         << ",\"bytes_delivered\":" << bytes_delivered
+         << ",\"duration_us\":" << duration_us
+         << ",\"time_to_first_byte_us\":" << metrics.first_byte_us.load(std::memory_order_relaxed)
+         << ",\"goodput_mbps\":" << goodput_mbps
+         << ",\"bytes_sent\":" << metrics.bytes_sent.load(std::memory_order_relaxed)
+         << ",\"bytes_received\":" << metrics.bytes_received.load(std::memory_order_relaxed)
+         << ",\"segments_sent\":" << metrics.segments_sent.load(std::memory_order_relaxed)
+         << ",\"segments_received\":" << metrics.segments_received.load(std::memory_order_relaxed)
+         << ",\"retransmissions\":" << metrics.retransmissions.load(std::memory_order_relaxed)
+         << ",\"acks\":" << metrics.acks.load(std::memory_order_relaxed)
+         << ",\"naks\":" << metrics.naks.load(std::memory_order_relaxed)
+         << ",\"timeouts\":" << metrics.timeouts.load(std::memory_order_relaxed)
+         << ",\"duplicates\":" << metrics.duplicates.load(std::memory_order_relaxed)
+         << ",\"out_of_order\":" << metrics.out_of_order.load(std::memory_order_relaxed)
+         << ",\"damaged\":" << metrics.damaged.load(std::memory_order_relaxed)
+         << ",\"gremlin\":{\"drops\":" << metrics.gremlin_drops.load(std::memory_order_relaxed)
+         << ",\"corruptions\":" << metrics.gremlin_corruptions.load(std::memory_order_relaxed)
+         << ",\"delays\":" << metrics.gremlin_delays.load(std::memory_order_relaxed)
+         << ",\"reorders\":" << metrics.gremlin_reorders.load(std::memory_order_relaxed)
+         << ",\"duplicates\":" << metrics.gremlin_duplicates.load(std::memory_order_relaxed) << "}"
+         << ",\"fec\":{\"scheme\":" << json_string(metrics.fec.empty() ? "none" : metrics.fec)
+         << ",\"parity\":" << metrics.fec_parity.load(std::memory_order_relaxed)
+         << ",\"recovered\":" << metrics.fec_recovered.load(std::memory_order_relaxed) << "}"
+         << ",\"compression\":{\"method\":" << json_string(metrics.compression.empty() ? "none" : metrics.compression)
+         << ",\"segments\":" << metrics.compressed_segments.load(std::memory_order_relaxed)
+         << ",\"saved_bytes\":" << metrics.compression_saved_bytes.load(std::memory_order_relaxed) << "}"
+         << ",\"rtt_us\":" << histogram_json(metrics.rtt_us) << "}";
+
+    return json.str();
+}
+
+
+// mark_first_byte
+//
+//  Record the time to first byte the first time it is called for a transfer
+//
+inline void mark_first_byte(transfer_metrics &metrics) {
+    if (metrics.first_byte_us.load(std::memory_order_relaxed) == 0) {
+        auto elapsed = std::chrono::steady_clock::now() - metrics.start_time;
+        metrics.first_byte_us.store(std::max<int64_t>(1, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()), std::memory_order_relaxed);
+    }
+}
+
+
+// stats_socket_start
+//
+//  Listen on a Unix stream socket at path, answering every connection with the JSON the
+//  snapshot function returns. Returns false if the socket could not be created.
+//
+inline bool stats_socket_start(stats_socket &stats, const std::string &path, std::function<std::string()> snapshot) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (path.empty() || path.length() >= sizeof(address.sun_path)) {
+        return false;
+    }
+    strcpy(address.sun_path, path.c_str());
+
+    stats.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (stats.listen_fd < 0) {
+        return false;
+    }
+
+    // A socket file left behind by an earlier run would make bind fail
+    unlink(path.c_str());
+    if (bind(stats.listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(stats.listen_fd, 16) < 0) {
+        close(stats.listen_fd);
+        stats.listen_fd = -1;
+        return false;
+    }
+
+    stats.path = path;
+    int listen_fd = stats.listen_fd;
+
+    stats.thread = std::thread([listen_fd, snapshot]() {
+        while (true) {
+            int connection = accept(listen_fd, NULL, NULL);
+            if (connection < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                break;
+            }
+
+            // A reader that hung up before its reply is written out is an ordinary EPIPE, not a
+            // SIGPIPE taking the whole program down with it
+            std::string json = snapshot() + "\n";
+            size_t written = 0;
+            while (written < json.length()) {
+                ssize_t result = send(connection, json.data() + written, json.length() - written, MSG_NOSIGNAL);
+                if (result < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (result <= 0) {
+                    break;
+                }
+                written += result;
+            }
+
+            close(connection);
+        }
+    });
+
+    return true;
+}
+
+
+// stats_socket_stop
+//
+//  Stop answering the stats socket and remove it
+//
+inline void stats_socket_stop(stats_socket &stats) {
+    if (stats.listen_fd < 0) {
+        return;
+    }
+
+    // Shutting the listening socket down wakes the blocked accept
+    shutdown(stats.listen_fd, SHUT_RDWR);
+    stats.thread.join();
+    close(stats.listen_fd);
+    unlink(stats.path.c_str());
+    stats.listen_fd = -1;
+}
+
+#endif
@@ -8,6 +8,13 @@
 //  Easton Rayner
 
 #include "unp.h"
+#include "crc32c.h"
+#include "logger.h"
+#include "metrics.h"
+#include "impairment.h"
+#include "fec.h"
+#include "lz.h"
+#include "delta.h"
 #include <iostream>
 #include <fstream>
 #include <vector>
@@ -15,40 +22,491 @@
 #include <cstring>
 #include <tuple>
 #include <unistd.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <bits/stdc++.h>
 
+// Requests and their replies always use SEGMENT_SIZE, which is also the smallest segment a
+// transfer will use. Clients may propose bigger segments up to MAX_SEGMENT_SIZE, the largest
+// UDP payload of a 9000 byte jumbo frame.
 int SEGMENT_SIZE = 512;
+int MAX_SEGMENT_SIZE = 8972;
 int TERMINATOR_BYTE = 1;
 int CHECKSUM_SIZE = 4;
 int PACKET_COUNT_SIZE = 4;
+int PAYLOAD_LENGTH_SIZE = 2;
 int INSTRUCTION_SIZE = 3;
-int HEADER_SIZE = TERMINATOR_BYTE + CHECKSUM_SIZE + PACKET_COUNT_SIZE;
-int DATA_SIZE = SEGMENT_SIZE - HEADER_SIZE;
+int HEADER_SIZE = TERMINATOR_BYTE + CHECKSUM_SIZE + PACKET_COUNT_SIZE + PAYLOAD_LENGTH_SIZE;
 
-int MAX_WINDOW_SIZE = 32;
-int REQUEST_NUM_MOD_SIZE = 64;
+// Bytes of IPv4 and UDP header around every segment
+int IP_UDP_HEADER_SIZE = 28;
+
+// Protocol revision we speak, packet numbers and responses carry full 32-bit numbers since 2
+// and packet headers carry the payload length since 3
+int PROTOCOL_VERSION = 3;
+
+// Largest window we will use, clients may ask for a smaller one. Within it the congestion
+// controller decides how many packets are actually in flight.
+int MAX_WINDOW_SIZE = 4096;
+
+// Congestion controller every session starts with, one of the CONGESTION_CONTROLS that
+// make_congestion_control can create, and its window before the first ACK
+std::string CONGESTION_CONTROL = "reno";
+std::vector<std::string> CONGESTION_CONTROLS = { "reno" };
+int INITIAL_CONGESTION_WINDOW = 10;
+
+// Spread each window's packets over a round trip instead of sending them back to back,
+// letting at most PACING_BURST packets go out together after the sender was held up
+bool PACKET_PACING = true;
+int PACING_BURST = 8;
+
+int RESPONSE_SIZE = PACKET_COUNT_SIZE + 4;
+
+// Most packets a client coalescing its ACKs may answer with one, and longest it may hold an
+// ACK back waiting for them
+int MAX_ACK_EVERY = 64;
+int MAX_ACK_DELAY_US = 100000;
+
+// Retransmission timeout used until the first RTT sample, and the bounds the adaptive
+// timeout is kept within
+int RETRANSMIT_TIMEOUT_US = 15000;
+int MIN_RETRANSMIT_TIMEOUT_US = 1000;
+int MAX_RETRANSMIT_TIMEOUT_US = 2000000;
+
+// Sessions whose client has not responded for this long are abandoned
+int SESSION_IDLE_TIMEOUT_US = 10000000;
+
+// Number of datagrams moved by a single sendmmsg or recvmmsg call, which the kernel caps at
+// MAX_BATCH_SIZE (UIO_MAXIOV)
+int BATCH_SIZE = 32;
+int MAX_BATCH_SIZE = 1024;
+
+// Number of worker threads, each with its own SO_REUSEPORT socket. 0 starts one per core
+int WORKER_COUNT = 0;
+
+// Seconds between per-worker stats reports
+int STATS_INTERVAL_SEC = 5;
+
+// Unix socket answering with live JSON stats for every worker and transfer, empty disables it
+std::string STATS_SOCKET_PATH = "/tmp/udp_ftp_server.stats";
+
+// Send payloads straight out of a memory mapped file instead of copying them into packets
+bool ZERO_COPY_SEND = true;
+
+// Bytes of packetized files, headers included, kept in memory across requests. 0 disables
+// the packet cache, and files bigger than this are always served from disk.
+size_t PACKET_CACHE_BYTES = 256 * 1024 * 1024;
+
+// Lowest level of log line written out. Per-packet lines are LOG_LEVEL_TRACE and
+// LOG_LEVEL_DEBUG, and are compiled out entirely in builds with -DNDEBUG.
+int LOG_LEVEL = LOG_LEVEL_INFO;
+
+// Cap the segment size a client proposes by the path MTU our routing table knows for it
+bool PMTU_DISCOVERY = true;
+
+// Compress packets for clients that ask for it. Transfers whose first COMPRESSION_PROBE_PACKETS
+// packets compressed by less than COMPRESSION_MIN_SAVING stop trying and send the rest stored.
+bool BLOCK_COMPRESSION = true;
+int COMPRESSION_PROBE_PACKETS = 16;
+double COMPRESSION_MIN_SAVING = 0.05;
 
 char TERM_OKAY = '1';
+
+// In transfers with compression every payload starts with one of these, saying whether the
+// rest of it is the file block as is or LZ compressed. Batch transfers always start payloads
+// with one, and announce each file with a frame. The packets left of a batch file the server
+// could no longer read in full carry nothing but BLOCK_ABORTED.
+int BLOCK_METHOD_SIZE = 1;
+char BLOCK_STORED = 0;
+char BLOCK_COMPRESSED = 1;
+char BLOCK_FRAME = 2;
+char BLOCK_ABORTED = 3;
+
+// Most parts a client may upload ahead of a request in, a batch manifest or the block
+// signatures of its copy of a file for a delta
+int MAX_UPLOAD_PARTS = 4096;
+
+// Smallest and largest blocks a delta may be built from
+int MIN_DELTA_BLOCK = 256;
+int MAX_DELTA_BLOCK = 1 << 20;
+
+// Bytes of the file a worker hashes or slides over at most each time it writes more of a
+// delta, so one large delta never holds up the other sessions on its worker
+int DELTA_ENCODE_STEP = 1 << 18;
+
 char GET_INSTR[4] = "GET";
+char BAT_INSTR[4] = "BAT";
+char SIG_INSTR[4] = "SIG";
 char ACK_INSTR[4] = "ACK";
 char NAK_INSTR[4] = "NAK";
+char CAK_INSTR[4] = "CAK";
 
-std::string input_packet_loss_rate;
-std::string input_packet_damage_rate;
-std::string input_packet_delay_rate;
-std::string input_packet_delay_time;
+// How outgoing datagrams are impaired, nothing is touched unless asked for on the command line
+impairment_settings impairment_config;
 
-float packet_loss_rate;
-float packet_damage_rate;
-float packet_delay_rate;
-float packet_delay_time;
+// Metrics of every transfer in progress on any worker, for the stats socket
+std::mutex live_transfers_mutex;
+std::set<std::shared_ptr<transfer_metrics>> live_transfers;
 
-// gremlins
-// 
-//  Given a char buffer, corruption chance, and loss chance, mutate the packets data to create an
-//  invalid packet.
+// Bytes in a page of memory, the unit the SIGBUS handler swaps in for a file that shrank
+size_t mapping_page_size = sysconf(_SC_PAGESIZE);
+
+
+// packet_slot
+//
+//  One packet in the ring. The header and payload point either at the slot's own buffers,
+//  into the memory mapped file, or into a packetized file from the packet cache. raw_length
+//  is how much of the file the packet carries, which compression makes differ from its
+//  payload length.
+//
+struct packet_slot {
+    const char *header;
+    std::vector<char> header_buffer;
+    std::vector<char> data;
+    std::vector<char> packed;
+    const char *payload;
+    int payload_length;
+    int raw_length;
+};
+
+
+// compression_probe
+//
+//  How well a transfer's first packets compressed, deciding whether the rest are worth trying
+//
+struct compression_probe {
+    bool skipped;
+    uint32_t packets;
+    uint64_t raw_bytes;
+    uint64_t packed_bytes;
+};
+
+
+// packetized_file
+//
+//  A whole file cut into payloads of data_size bytes with every header already built, along
+//  with what identified the file on disk when it was read. Compressed files keep their
+//  payloads back to back, packet N's starting at offsets[N]. Entries never change once built,
+//  so any number of transfers can share one without locking.
+//
+struct packetized_file {
+    std::string path;
+    int data_size;
+    bool compressed;
+    std::vector<size_t> offsets;
+    dev_t device;
+    ino_t inode;
+    struct timespec modified;
+    off_t size;
+    uint32_t packet_count;
+    std::vector<char> data;
+    std::vector<char> headers;
+};
+
+
+// packet_cache_job
+//
+//  A file the cache thread is to read and packetize, as it was on disk when it was missed
+//
+struct packet_cache_job {
+    std::string key;
+    std::string path;
+    int data_size;
+    bool compressed;
+    struct stat file_stat;
+};
+
+
+// packet_cache
+//
+//  Least recently used packetized files, shared by every worker and kept within
+//  PACKET_CACHE_BYTES. Entries are keyed by path, payload size and compression, most
+//  recently used first. Transfers hold on to their entry, so an evicted file lives until its
+//  last transfer ends. Missed files are packetized by a thread of the cache's own, never by
+//  the worker whose transfer missed, and queued only once however often they are missed.
+//
+struct packet_cache {
+    std::mutex mutex;
+    size_t used_bytes;
+    std::list<std::shared_ptr<const packetized_file>> entries;
+    std::unordered_map<std::string, std::list<std::shared_ptr<const packetized_file>>::iterator> index;
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> evictions;
+
+    std::deque<packet_cache_job> jobs;
+    std::set<std::string> queued_keys;
+    std::condition_variable job_ready;
+    bool stopping;
+    std::thread packetizer;
+};
+
+// Packetized files shared by every worker
+packet_cache file_cache;
+
+
+// worker_stats
+//
+//  Counters for one worker thread. Only the worker writes them and the main thread reads
+//  them, so each worker's counters sit on their own cache line.
+//
+struct alignas(64) worker_stats {
+    std::atomic<uint64_t> sessions_started;
+    std::atomic<uint64_t> sessions_finished;
+    std::atomic<uint64_t> sessions_abandoned;
+    std::atomic<uint64_t> datagrams_received;
+    std::atomic<uint64_t> packets_sent;
+    std::atomic<uint64_t> bytes_sent;
+    std::atomic<uint64_t> retransmissions;
+};
+
+
+// datagram_batch
+//
+//  Buffers and message headers for moving a batch of datagrams with a single sendmmsg or
+//  recvmmsg call. Each message owns two iovecs so packets can gather header and payload.
+//
+struct datagram_batch {
+    std::vector<std::vector<char>> buffers;
+    std::vector<struct iovec> iovecs;
+    std::vector<struct mmsghdr> messages;
+    std::vector<struct sockaddr_in> addresses;
+    worker_stats *stats;
+    impairment_engine *impairment;
+    int buffer_size;
+    int count;
+    int position;
+};
+
+
+// batch_file
+//
+//  One file of a batch transfer. Its frame goes out as packet frame_packet once the file
+//  before it is read, followed by packet_count data packets read from fd. A file that shrank
+//  or could not be read after its frame went out is aborted.
+//
+struct batch_file {
+    std::string path;
+    int fd;
+    uint64_t size;
+    std::string etag;
+    uint32_t frame_packet;
+    uint32_t packet_count;
+    bool aborted;
+};
+
+
+// pending_upload
+//
+//  Parts of what a client uploads ahead of its next GET that arrived so far: the manifest of
+//  a batch, or the block signatures of its copy of a file for a delta, as told by instruction
+//
+struct pending_upload {
+    std::string instruction;
+    std::vector<std::string> parts;
+    std::vector<bool> received;
+    uint32_t received_count;
+    std::chrono::steady_clock::time_point updated;
+};
+
+
+// file_mapping
+//
+//  A file a worker has memory mapped to send from. Reading past the end of a file that shrank
+//  after it was mapped raises SIGBUS, whose handler swaps zeros in for the missing pages and
+//  marks the mapping truncated so the transfer can be abandoned.
+//
+struct file_mapping {
+    const char *start;
+    size_t size;
+    volatile sig_atomic_t truncated;
+};
+
+// Files mapped by the worker running on this thread, for the SIGBUS handler to tell a file
+// that shrank from any other fault
+thread_local std::list<file_mapping> worker_mappings;
+
+
+// packet_ring
+//
+//  Fixed ring of packets read ahead from the file being served. Senders only ever look at
+//  the packets inside their window, so one slot per window position is all the memory a
+//  transfer needs.
+//
+struct packet_ring {
+    std::ifstream *file;
+    std::shared_ptr<const packetized_file> cached_file;
+    const char *mapped_file;
+    size_t mapped_size;
+    file_mapping *mapping;
+    int data_size;
+
+    // Delta transfers map the file and send the delta written from it as packets need it.
+    // delta holds what is written but not yet in a packet from delta_sent on, and
+    // delta_length counts every byte written so far.
+    std::unique_ptr<delta_encoder> encoder;
+    std::vector<char> delta;
+    size_t delta_sent;
+    uint64_t delta_length;
+
+    // Compressed transfers put a block method ahead of every payload, so payloads run up to
+    // payload_size bytes for data_size bytes of the file
+    bool compressed;
+    int payload_size;
+    compression_probe probe;
+
+    // Batch transfers read the files of a manifest one after another, batch_position being
+    // the one packets are read from now
+    bool batch;
+    std::vector<batch_file> batch_files;
+    size_t batch_position;
+
+    // Packets are read from packets_read up to but not including end_packet, which is past
+    // the end of any file unless the client asked for a range
+    std::vector<packet_slot> slots;
+    uint64_t packets_read;
+    uint64_t end_packet;
+    bool finished;
+};
+
+
+// rtt_estimator
+//
+//  Smoothed round trip time and its variation for one transfer, giving the retransmission
+//  timeout the way TCP does (RFC 6298). The timeout also allows for ack_delay_us, the
+//  longest the client holds back a coalesced ACK.
+//
+struct rtt_estimator {
+    double srtt_us;
+    double rttvar_us;
+    double rto_us;
+    double ack_delay_us;
+    int backoff;
+    bool has_sample;
+};
+
+
+// congestion_control
+//
+//  Decides how many packets a transfer may have in flight and how quickly to send them.
+//  Loss based controllers react to the loss signals, while a delay based one can follow the
+//  RTT estimate handed to every ACK instead.
+//
+struct congestion_control {
+    virtual ~congestion_control() {}
+    virtual const char *name() const = 0;
+    virtual void on_ack(uint32_t acked_count, const rtt_estimator &rtt) = 0;
+    virtual void on_loss() = 0;
+    virtual void on_timeout() = 0;
+    virtual double window() const = 0;
+    virtual double pacing_interval_us(const rtt_estimator &rtt) const = 0;
+};
+
+
+// reno_control
+//
+//  Slow start up to the threshold, then additive increase and multiplicative decrease
+//
+struct reno_control : congestion_control {
+    double congestion_window;
+    double slow_start_threshold;
+    int max_window;
+
+    reno_control(int max_window);
+    const char *name() const;
+    void on_ack(uint32_t acked_count, const rtt_estimator &rtt);
+    void on_loss();
+    void on_timeout();
+    double window() const;
+    double pacing_interval_us(const rtt_estimator &rtt) const;
+};
+
+
+// transfer_session
 //
-int gremlins(char buffer[], double corruptionChance, double lossChance, double delayChance);
+//  Everything the event loop needs to drive one client's transfer. Sessions are keyed by the
+//  client's address, so datagrams from different clients never touch each other's state.
+//
+struct transfer_session {
+    struct sockaddr_in client;
+    worker_stats *stats;
+    std::string filename;
+    std::ifstream file;
+    packet_ring ring;
+    bool selective_repeat;
+    int window_size;
+    int segment_size;
+
+    // Clients coalescing their ACKs answer up to ack_every packets received in order with one
+    int ack_every;
+
+    // window_base is the oldest unacknowledged packet and packet_index is the next packet
+    // to put on the wire. All of them are 32-bit packet numbers that may wrap around.
+    // Transfers of a range start at start_packet rather than 0.
+    uint32_t start_packet;
+    uint32_t window_base;
+    uint32_t packet_index;
+    uint32_t highest_sent;
+    int64_t last_fast_retransmit;
+
+    // Go-Back-N keeps one timer for the window base, Selective Repeat one per window slot.
+    // Both remember when each packet was sent and whether it was ever resent, so RTT samples
+    // only come from packets that went out once.
+    std::chrono::steady_clock::time_point base_sent_time;
+    std::vector<bool> packet_acked;
+    std::vector<bool> packet_retransmitted;
+    std::vector<std::chrono::steady_clock::time_point> packet_sent_time;
+    rtt_estimator rtt;
+
+    // Losses of packets sent before recovery_point belong to a window we already backed off
+    // for, and next_send_time is when the pacer lets the next packet out
+    std::unique_ptr<congestion_control> congestion;
+    uint32_t recovery_point;
+    std::chrono::steady_clock::time_point next_send_time;
+
+    std::chrono::steady_clock::time_point last_response_time;
+    std::chrono::steady_clock::time_point next_deadline;
+
+    // Forward error correction follows every fec_block packets with fec_parity parity
+    // packets. The block's parity symbols build up in fec_symbols as its packets first go
+    // out, and fec_count of them have so far.
+    int fec_scheme;
+    int fec_block;
+    int fec_parity;
+    int fec_count;
+    uint32_t fec_block_start;
+    std::vector<uint8_t> fec_symbols;
+    std::vector<packet_slot> fec_packets;
+
+    // Shared with the stats socket for as long as the transfer runs
+    std::shared_ptr<transfer_metrics> metrics;
+};
+
+// parse_arguments
+//
+//  Read the impairment settings and tunables from the command line, returning false after
+//  printing the usage if they do not make sense
+//
+bool parse_arguments(int argc, char **argv);
+
+// print_usage
+//
+//  Describe the command line options
+//
+void print_usage(const char *program);
 
 // empty_buffer
 //
@@ -59,9 +517,10 @@ void empty_buffer(char buffer[], int size);
 
 // generate_checksum
 // 
-//  Given a char buffer, generate a checksum and return the value in a provided char[4] buffer
+//  Given a packet number and its payload, generate a CRC32C covering the number, the payload
+//  length and the payload, and return the value in a provided char[4] buffer
 //
-void generate_checksum(char input_buffer[], char output_buffer[]);
+void generate_checksum(uint32_t packet_num, const char data_buffer[], int length, char checksum_buffer[]);
 
 
 // generate_packet_num
@@ -78,379 +537,3454 @@ void generate_packet_num(uint32_t packet_num, char packet_num_buffer[]);
 uint32_t buffToUint32(char* buffer);
 
 
-int main() {
+// parse_request_options
+//
+//  Parse the NUL separated key=value options that follow the filename in a GET request
+//
+std::map<std::string, std::string> parse_request_options(char buffer[], int size);
+
 
-    // Start our network connection code
+// append_option
+//
+//  Write a NUL terminated key=value option into a response at the given position, returning
+//  the position just past it
+//
+int append_option(char packet[], int position, const std::string &option);
 
-    int n, sd, client_fd;
-    struct sockaddr_in server;
-    socklen_t serverLen = sizeof(server);
 
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = htonl(INADDR_ANY);
-    server.sin_port = htons(SERV_PORT);
+// requested_range
+//
+//  Find the bytes a request asks for, from either range=FIRST-LAST or start=SEGMENT, as the
+//  first byte and the byte past the last. Returns false if it asks for the whole file.
+//
+bool requested_range(std::map<std::string, std::string> &request_options, int data_size, uint64_t &first_byte, uint64_t &end_byte);
 
-    sd = socket(AF_INET, SOCK_DGRAM, 0);
 
-    // Bind the server to the socket
-    bind(sd, (struct sockaddr *)&server, sizeof(server));
+// file_etag
+//
+//  Tag naming one version of a file, which changes whenever the file is replaced or rewritten
+//
+std::string file_etag(ino_t inode, off_t size, const struct timespec &modified);
 
-    listen(sd, 10);
 
-    struct sockaddr_storage client_addr;
-    socklen_t client_size = sizeof(client_addr);
-    client_fd = accept(sd, (struct sockaddr *)&client_addr, &client_size);
+// sequence_before
+//
+//  Compare two 32-bit packet numbers, staying correct when the numbers wrap around
+//
+bool sequence_before(uint32_t a, uint32_t b);
 
-    struct timeval gbn_tv;
-    struct timeval request_tv;
 
-    // Specify our timeout of 15 ms for the socket connection
-    gbn_tv.tv_sec, request_tv.tv_sec, request_tv.tv_usec = 0;
-    gbn_tv.tv_usec = 15000;
-    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &request_tv, sizeof(request_tv));
+// window_ring_size
+//
+//  Round a window size up to a power of two so packet_number % size stays continuous when
+//  packet numbers wrap around
+//
+int window_ring_size(int window_size);
 
-    std::cout << "Enter packet loss chance: " << std::flush;
-    std::getline(std::cin, input_packet_loss_rate);
-    packet_loss_rate = std::stof(input_packet_loss_rate);
 
-    std::cout << "Enter packet damage chance: " << std::flush;
-    std::getline(std::cin, input_packet_damage_rate);
-    packet_damage_rate = std::stof(input_packet_damage_rate);
+// init_rtt_estimator
+//
+//  Start an estimator with no samples and the default retransmission timeout
+//
+void init_rtt_estimator(rtt_estimator &rtt);
 
-    std::cout << "Enter packet delay chance: " << std::flush;
-    std::getline(std::cin, input_packet_delay_rate);
-    packet_delay_rate = std::stof(input_packet_delay_rate);
 
-    std::cout << "Enter packet delay time in microseconds: " << std::flush;
-    std::getline(std::cin, input_packet_delay_time);
-    packet_delay_time = std::stoi(input_packet_delay_time);
+// rtt_sample
+//
+//  Fold a measured round trip time into the estimator and recompute the retransmission timeout
+//
+void rtt_sample(rtt_estimator &rtt, double sample_us);
 
-    std::cout << "Ready" << std::endl;
 
+// rtt_backoff
+//
+//  Double the retransmission timeout after it expires
+//
+void rtt_backoff(rtt_estimator &rtt);
 
 
-    // Integer to keep track of our packet counts
-    int packet_count = 0;
-    
-    // Define char buffers  based on our segment size
-    char data_buffer[DATA_SIZE];
-    
-    // Define an empty buffer for our generated checksum
-    char checksum_buffer[CHECKSUM_SIZE];
+// rtt_reset_backoff
+//
+//  Drop back to the estimated timeout once the client acknowledges new data
+//
+void rtt_reset_backoff(rtt_estimator &rtt);
 
-    // Define an empty buffer for our generated checksum
-    char packet_count_buffer[PACKET_COUNT_SIZE];   
 
-    // Define our empty packet
-    char packet[SEGMENT_SIZE];
+// retransmit_timeout
+//
+//  Get the estimator's current retransmission timeout, with time for a coalesced ACK to be
+//  held back on top
+//
+std::chrono::microseconds retransmit_timeout(const rtt_estimator &rtt);
 
-    // Define our buffer to store our incoming message
-    char message_buffer[SEGMENT_SIZE];
 
-    // Define a buffer to store the GET instruction of the message 
-    char instruction_buffer[4];
+// make_congestion_control
+//
+//  Create the named congestion controller for a transfer, returning NULL for names we do
+//  not know
+//
+std::unique_ptr<congestion_control> make_congestion_control(const std::string &name, int max_window);
 
-    // Define a buffer to store the filename passed in the GET packet
-    char filename_buffer[SEGMENT_SIZE - INSTRUCTION_SIZE];
 
-    // Input string to open
-    std::string input_name;
+// init_packet_ring
+//
+//  Prepare an empty ring with one packet slot per window position for the given file, cut
+//  into payloads of data_size bytes, compressing every payload if asked to
+//
+void init_packet_ring(packet_ring &ring, std::ifstream &file, int window_size, int data_size, bool compressed);
 
-    // File in stream
-    std::ifstream file_in;
 
-    // Vector that holds the entire file contents divided into packets
-    std::vector<std::vector<char>> file_data_vector;
+// map_packet_ring
+//
+//  Memory map the file so packets are sent straight from the mapping, returning false if the
+//  file cannot be mapped and must be read instead
+//
+bool map_packet_ring(packet_ring &ring, const std::string &filename);
 
-    // Vector that holds the 
 
-    // Poll infinitely for requests from the client
-    while (true) {
+// handle_mapping_fault
+//
+//  SIGBUS handler. A fault inside one of the worker's mapped files means the file shrank, so
+//  the missing page is replaced with zeros and the mapping marked truncated. Any other fault
+//  kills the server as it always would have.
+//
+void handle_mapping_fault(int signal_number, siginfo_t *info, void *context);
 
-        // Clear our timeout value so we are waiting indefinitely for the next request
-        setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &request_tv, sizeof(request_tv));
 
-        std::cout << "Waiting for request" << std::endl;
+// packet_ring_truncated
+//
+//  Check whether the file being sent shrank under its mapping, so packets past its new end
+//  would carry zeros instead of the file
+//
+bool packet_ring_truncated(const packet_ring &ring);
 
-        // Capture the recieved message bytes to the message buffer
-        n = recvfrom(sd, message_buffer, SEGMENT_SIZE, 0, (struct sockaddr *)&server, &serverLen);
-        
-        // Pull the instruction out of the message buffer into the instruction buffer 
-        std::copy(message_buffer, message_buffer+4, instruction_buffer);
 
-        // Check if the instruction is a GET request
-        if (strcmp(instruction_buffer, GET_INSTR) == 0) {
+// packet_ring_waiting
+//
+//  Check whether the next packet is not ready yet only because the delta it comes from is
+//  still being written
+//
+bool packet_ring_waiting(const packet_ring &ring);
 
-            // Copy the file name from the request to the filename char buffer
-            std::copy(message_buffer+4, message_buffer+SEGMENT_SIZE, filename_buffer);
 
-            // Cast the buffer to a std::string
-            std::string target_filename = std::string(filename_buffer);
+// cache_packet_ring
+//
+//  Serve the file from the packet cache. Returns false if it is not cached yet or cannot be
+//  cached, and must be read or mapped instead.
+//
+bool cache_packet_ring(packet_ring &ring, const std::string &filename);
 
-            // Open the targe file
-            file_in.open(target_filename.c_str(), std::ios_base::binary);
 
-            // Check if the file exists
-            if (file_in) {
+// delta_packet_ring
+//
+//  Serve the delta turning the client's copy of the file, known by its block signatures,
+//  into ours instead of the file itself. Returns false if the file cannot be read for it.
+//
+bool delta_packet_ring(packet_ring &ring, const std::string &filename, int block_size, std::vector<delta_signature> signatures);
 
-                // Send an ACK packet to the client
-                sendto(sd, ACK_INSTR, 4, 0, (struct sockaddr*)&server, sizeof(server));
 
-                int unack_count = 0;
+// seek_packet_ring
+//
+//  Serve only the packets from first_packet up to but not including end_packet
+//
+void seek_packet_ring(packet_ring &ring, uint32_t first_packet, uint64_t end_packet);
 
-                setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &gbn_tv, sizeof(gbn_tv));
 
+// packet_cache_start
+//
+//  Start the thread packetizing the files the packet cache misses, unless the cache is off
+//
+void packet_cache_start();
 
-                while(!file_in.eof()) {
-                    empty_buffer(packet, SEGMENT_SIZE);
-                    empty_buffer(data_buffer, DATA_SIZE);
-                    empty_buffer(checksum_buffer, CHECKSUM_SIZE);
-                    empty_buffer(packet_count_buffer, PACKET_COUNT_SIZE);
 
-                    file_in.read(data_buffer, DATA_SIZE);
+// packet_cache_stop
+//
+//  Finish the file being packetized, drop the rest of the queue and stop the cache thread
+//
+void packet_cache_stop();
 
-                    std::cout << "[Info] Generating packets..." << std::endl;
 
-                    // Generate our checksum using our buffer
-                    generate_checksum(data_buffer, checksum_buffer);
-                    generate_packet_num(packet_count, packet_count_buffer);
+// acquire_packetized_file
+//
+//  Find the file in the packet cache. Returns NULL on a miss, or when the file changed on
+//  disk since it was cached, after queueing it for the cache thread, and for files that
+//  cannot be cached.
+//
+std::shared_ptr<const packetized_file> acquire_packetized_file(const std::string &filename, int data_size, bool compressed);
 
-                    std::memcpy(packet, &TERM_OKAY, TERMINATOR_BYTE);    
-                    std::memcpy(packet+TERMINATOR_BYTE, &checksum_buffer, CHECKSUM_SIZE);
-                    std::memcpy(packet+TERMINATOR_BYTE+CHECKSUM_SIZE, &packet_count_buffer, PACKET_COUNT_SIZE);
-                    std::memcpy(packet+HEADER_SIZE, &data_buffer, DATA_SIZE);
-                    
-                    std::vector<char> packet_char_vector(packet, packet + SEGMENT_SIZE);
-                    file_data_vector.push_back(packet_char_vector);
 
+// cache_packetized_file
+//
+//  Put a freshly packetized file in the packet cache under key, evicting the least recently
+//  used files to make room. Called with the cache's lock held.
+//
+void cache_packetized_file(const std::string &key, std::shared_ptr<const packetized_file> packetized);
 
-                    packet_count++;
-                }
 
+// packet_cache_key
+//
+//  Key of a packetized file in the packet cache
+//
+std::string packet_cache_key(const std::string &filename, int data_size, bool compressed);
 
-                // File requested exists, send all of the packets for the file
-                int packet_index = 0;
-                int packet_index_offset = 0;
 
-                std::cout << file_data_vector.size() << std::endl;
+// packetize_file
+//
+//  Read a whole regular file and build the header of every packet it is cut into,
+//  compressing the payloads if asked to
+//
+std::shared_ptr<packetized_file> packetize_file(const std::string &filename, int data_size, bool compressed, const struct stat &file_stat);
 
-                while(packet_index < file_data_vector.size()) {
 
-                    std::vector<char> outgoing_packet_vector = file_data_vector[packet_index];
+// packetized_file_bytes
+//
+//  Memory a packetized file takes up, counted against PACKET_CACHE_BYTES
+//
+size_t packetized_file_bytes(const packetized_file &file);
 
-                    char outgoing_packet[SEGMENT_SIZE];
-                    std::memcpy(outgoing_packet, &outgoing_packet_vector[0], outgoing_packet_vector.size());
 
-                    int gremlin_status = gremlins(outgoing_packet, packet_damage_rate, packet_loss_rate, packet_delay_rate);
+// pack_payload
+//
+//  Write a block of the file as a compressed transfer's payload, compressed unless that
+//  would not make it smaller or the transfer's probe gave up on compressing. Returns the
+//  payload length.
+//
+int pack_payload(compression_probe &probe, const char raw[], int raw_length, char packed[]);
 
-                    if (gremlin_status != 1) {
 
-                        if (gremlin_status == 2) {
-                            // Delay the packet being sent
-                            usleep(packet_delay_time);
-                        }
+// build_packet_header
+//
+//  Write the header for a packet carrying the given payload
+//
+void build_packet_header(uint32_t packet_num, const char payload[], int payload_length, char header[]);
 
 
-                        if (unack_count > MAX_WINDOW_SIZE) {
-                            std::cout << "[Info] UNACK limit reached, not sending packets until an ACK is received! " << std::endl;
-                        } else {
-                            // Send packet to client
-                            sendto(sd, outgoing_packet, SEGMENT_SIZE, 0, (struct sockaddr *)&server, sizeof(server));
-                            std::cout << "[Info] Successfully sent packet " << packet_index << std::endl;
-                        }
+// batch_packet_ring
+//
+//  Serve the files of a batch manifest one after another instead of a single file, returning
+//  the total size of the ones that exist
+//
+uint64_t batch_packet_ring(packet_ring &ring, const std::vector<std::string> &manifest);
 
 
-                        // Wait for a response from the client, either an ACK or NAK
-                        char response_msg_buffer[5];
-                        int n = recvfrom(sd, response_msg_buffer, SEGMENT_SIZE, 0, (struct sockaddr *)&server, &serverLen);
+// open_batch_file
+//
+//  Open the next file of a batch as its frame goes out, working out how many packets follow
+//
+void open_batch_file(packet_ring &ring, batch_file &file);
 
 
-                        // Check if we received any data
-                        if (n > 0) {
-                            
-                            // Get the response type the received
-                            char response_type_buffer[4];
-                            std::memcpy(response_type_buffer, response_msg_buffer+1, 4);
+// build_batch_frame
+//
+//  Write the frame packet announcing a file of a batch, returning the payload length
+//
+int build_batch_frame(const batch_file &file, size_t index, char payload[], int payload_size);
 
-                            // Get the packet num requested
-                            int packet_num_requested = (int)response_msg_buffer[0];
 
+// batch_packet_available
+//
+//  Read a batch ahead until the given packet is in the ring, returning false once the packet
+//  is past the last file
+//
+bool batch_packet_available(packet_ring &ring, uint32_t packet_index);
 
-                            if (strcmp(response_type_buffer, ACK_INSTR) == 0) {
-                                // Got an ACK response, everything's good
-                                std::cout << "[Info] Received an ACK response type" << std::endl;
-                                std::cout << "\tRequested packet #: " << packet_num_requested << std::endl;
 
-                                // Decrement our missed packet count
-                                unack_count = (unack_count > 0) ? unack_count-1 : 0;
+// release_packet_ring
+//
+//  Unmap the file, let go of the cached file or delta, or close the batch's open file once
+//  the transfer is finished
+//
+void release_packet_ring(packet_ring &ring);
 
-                                // Send requested packet...
-                                if (packet_num_requested == 0) {
-                                    packet_index_offset += 64;
-                                }
 
-                                packet_index = packet_num_requested + packet_index_offset;
+// packet_available
+//
+//  Read the file ahead until the given packet is in the ring, returning false once the
+//  packet is past the end of the file, or while the delta it comes from is still being
+//  written
+//
+bool packet_available(packet_ring &ring, uint32_t packet_index);
 
-                                continue;
 
-                            }
+// ring_packet
+//
+//  Get the stored packet for a packet index that is inside the current window
+//
+packet_slot &ring_packet(packet_ring &ring, uint32_t packet_index);
 
-                            else if (strcmp(response_type_buffer, NAK_INSTR) == 0) {
-                                // Got a NAK response, resend what it requests
-                                std::cout << "[Error] Received a NAK response type" << std::endl;
-                                std::cout << "\tRequested packet #: " << packet_num_requested << std::endl;
 
-                                // Send requested packet...
-                                packet_index = packet_num_requested + packet_index_offset;
+// init_datagram_batch
+//
+//  Allocate buffers of buffer_size bytes and message headers for a batch of up to BATCH_SIZE
+//  datagrams
+//
+void init_datagram_batch(datagram_batch &batch, worker_stats *stats, int buffer_size);
 
-                                continue;
-                            }
 
-                            else {
-                                // Unsupported response
-                                std::cout << "[Error] Received an unknown response type!" << std::endl;
-                            }
+// flush_datagram_batch
+//
+//  Send every datagram queued in the batch with as few sendmmsg calls as possible
+//
+void flush_datagram_batch(int sd, datagram_batch &batch);
 
-                        } else {
-                            // We timed out, and did not recieve a response from the client
-                            std::cout << "[Info] Timeout reached..." << std::endl;
-                            
-                            // TODO: Increase window...
-                            unack_count = (unack_count >= MAX_WINDOW_SIZE) ? MAX_WINDOW_SIZE : unack_count+1;
-                            if (unack_count != MAX_WINDOW_SIZE) {
-                                packet_index++;
-                            }
-                        }
 
-                    } else {
-                        // Gremlin, packet was not sent
-                        std::cout << "[Gremlin] Dropped packet " << packet_count << std::endl;
-                    }
-                }
+// next_datagram
+//
+//  Hand out the next datagram from the batch and the address it came from, refilling the
+//  batch with a single non-blocking recvmmsg when it runs dry. Returns NULL once the socket
+//  has nothing left.
+//
+char *next_datagram(int sd, datagram_batch &batch, int &length, struct sockaddr_in *&from);
 
-                // Send terminal \0 byte to the client marking end of tranmission
-                sendto(sd, "\0", 1, 0, (struct sockaddr *)&server, sizeof(server));
 
-            } else {
+// queue_packet
+//
+//  Queue a stored packet, gathering the header and payload so the payload is never copied
+//
+void queue_packet(int sd, datagram_batch &batch, packet_slot &slot, struct sockaddr_in &to);
 
-                // File does not exist, send a NAK packet to the client
-                std::cout << "[Error] Received request for file " << target_filename << " that does not exist" << std::endl;
-                sendto(sd, NAK_INSTR, 4, 0, (struct sockaddr*)&server, sizeof(server));
 
-            }
+// queue_datagram
+//
+//  Queue a copy of a datagram, for ones the impairment layer changed or held back
+//
+void queue_datagram(int sd, datagram_batch &batch, const char data[], int length, const struct sockaddr_in &to);
 
-            // Clear all of our working buffers
-            empty_buffer(packet, SEGMENT_SIZE);
-            empty_buffer(message_buffer, SEGMENT_SIZE);
-            empty_buffer(data_buffer, DATA_SIZE);
-            
-            // Close our file and reset our packet counts
-            file_in.close();
-            packet_count = 0;
-        }
-    }
-    
-    close(sd);
 
-    return 0;
-}
+// transmit_packet
+//
+//  Run one of the session's stored packets through the impairment layer and queue whatever
+//  survives for the client
+//
+void transmit_packet(int sd, datagram_batch &batch, transfer_session &session, uint32_t packet_index);
 
 
-// empty_buffer
+// transmit_slot
 //
-//  Set all cells of a char buffer to NUL character
+//  Run a packet through the impairment layer and queue whatever survives for the client,
+//  naming it in log lines by kind and number
 //
-void empty_buffer(char buffer[], int size) {
-    for (int i = 0; i < size; i++) {
-        buffer[i] = '\0';
-    }
-}
+void transmit_slot(int sd, datagram_batch &batch, transfer_session &session, packet_slot &slot, const char *kind, uint32_t number);
 
 
-// generate_packet_num
-// 
-//  Given a uint32_t packet number, return the value in a provided char[4] buffer
+// release_held_datagrams
 //
-void generate_packet_num(uint32_t packet_num, char packet_num_buffer[]) {
-    std::cout << "\tGenerated Packet Number: " << packet_num << std::endl;
-    memcpy(packet_num_buffer, &packet_num, sizeof(packet_num));
-}
+//  Queue every datagram the impairment layer held back that is now due
+//
+void release_held_datagrams(int sd, datagram_batch &batch);
 
 
-// generate_checksum
-// 
-//  Given a char buffer, generate a checksum and return the value in a provided char[4] buffer
+// probe_path_mtu
 //
-void generate_checksum(char data_buffer[], char checksum_buffer[]) {
-    uint32_t sum = 0;
-    for(int i = 0; i < DATA_SIZE; i++) {
-        if (data_buffer[i] == '\0') break;
-        sum += data_buffer[i];
-    }
-    std::cout << "\tGenerated Checksum: " << sum << std::endl;
-    memcpy(checksum_buffer, &sum, sizeof(sum));
-}
+//  Ask the kernel for the path MTU towards an address, returning 0 if it does not know
+//
+int probe_path_mtu(const struct sockaddr_in &peer);
 
-// gremlins
-// 
-//  Given a char buffer, corruption chance, and loss chance, mutate the packets data to create an
-//  invalid packet.
+
+// open_worker_socket
+//
+//  Create a non-blocking UDP socket bound to SERV_PORT with SO_REUSEPORT, so every worker
+//  gets its own socket and the kernel spreads clients across them. Returns -1 if it cannot.
 //
-int gremlins(char buffer[], double corruptionChance, double lossChance, double delayChance){
-    double randomNum;
-    int randomByte;
-    srand(rand()*time(NULL));
-    int returnValue = 0;
+int open_worker_socket();
 
-    //Error Checking.
-    if (corruptionChance > 1 || corruptionChance < 0 || lossChance > 1 || lossChance < 0) { 
-        returnValue = -1;
-        return returnValue;
-    } 
 
-    double rand_losschance = (double) rand() / RAND_MAX;
+// run_worker
+//
+//  Event loop for one worker, serving every client the kernel hashes to its socket sd until
+//  the shutdown eventfd fires, then closing the socket
+//
+void run_worker(int worker_id, int sd, worker_stats &stats, int shutdown_fd);
 
-    if(rand_losschance < lossChance){ //Checks for loss of packet
-        std::cout << "[Gremlin] Packet was lost" << std::endl;
-        returnValue = 1;
-        return returnValue;
-    }
-    else if ((double) rand()/RAND_MAX < delayChance){ //Checks for delay of packet
-        returnValue = 2;
-    }
 
-    if ((double) rand()/RAND_MAX < corruptionChance) { //Checks for corruption of packet
-        randomNum = (double) rand()/RAND_MAX;
-        if(randomNum <= 0.7){ //70% only one packet is affected
-            std::cout << "[Gremlin] 1/3 bytes were affected" << std::endl;
-            randomByte = rand() % 512;
-            buffer[randomByte] = '1';
-        }
-        
-        if(randomNum <= 0.2){ //20% chance two packets are affected
-            std::cout << "[Gremlin] 2/3 bytes were affected" << std::endl;
-            randomByte = rand() % 512;
-            buffer[randomByte] = '1';
-        }
+// report_worker_stats
+//
+//  Print each worker's counters, with rates over the interval since the previous report
+//
+void report_worker_stats(std::vector<worker_stats> &stats, std::vector<uint64_t> &last_packets_sent, double interval_sec);
 
-        if(randomNum <= 0.1){ //10% chance three packets are affected
-            std::cout << "[Gremlin] 3/3 bytes were affected" << std::endl;
-            randomByte = rand() % 512;
-            buffer[randomByte] = '1';
-        }
-    }
 
-    return returnValue;
- 
-}
+// server_stats_json
+//
+//  Every worker's counters, the packet cache's and the metrics of every transfer in progress,
+//  as one JSON object
+//
+std::string server_stats_json(std::vector<worker_stats> &stats);
 
-// buffToUint32
+
+// session_key
 //
-//  Convert a char[4] buffer to an uint32_t
+//  Identify a session by its client's IPv4 address and port
 //
-uint32_t buffToUint32(char* buffer)
-{
-    int a;
-    memcpy(&a, buffer, sizeof( int ) );
-    return a;
-}
\ No newline at end of file
+uint64_t session_key(const struct sockaddr_in &client);
+
+
+// store_upload_part
+//
+//  Keep one part of what a client uploads ahead of its GET until the GET arrives
+//
+void store_upload_part(pending_upload &upload, char message_buffer[], int n);
+
+
+// upload_contents
+//
+//  Put together what the client uploaded for its GET, returning false unless it is what the
+//  instruction names and every part of it arrived
+//
+bool upload_contents(const pending_upload &upload, const char instruction[], std::string &contents);
+
+
+// parse_manifest
+//
+//  Split an uploaded batch manifest into its NUL terminated paths
+//
+std::vector<std::string> parse_manifest(const std::string &contents);
+
+
+// parse_signatures
+//
+//  Read the block signatures of an uploaded delta request
+//
+std::vector<delta_signature> parse_signatures(const std::string &contents);
+
+
+// start_session
+//
+//  Answer a GET request, returning a new session for the client if the file exists or NULL
+//  after NAKing the request if it does not. Batch requests send the files of the manifest
+//  the client uploaded before, delta requests the delta from the block signatures it
+//  uploaded.
+//
+std::unique_ptr<transfer_session> start_session(int sd, char message_buffer[], int n, struct sockaddr_in &client, worker_stats &stats,
+                                                const pending_upload &upload);
+
+
+// finish_session
+//
+//  Send the terminator marking the end of transmission and release the session's file
+//
+void finish_session(int sd, transfer_session &session);
+
+
+// publish_transfer_metrics
+//
+//  Log the session's metrics as a JSON summary and take them off the stats socket
+//
+void publish_transfer_metrics(transfer_session &session, const std::string &status);
+
+
+// session_finished
+//
+//  Check whether every packet of the session's file has been acknowledged
+//
+bool session_finished(transfer_session &session);
+
+
+// service_session
+//
+//  Put new packets on the wire and handle expired timers, recording when the session next
+//  needs attention
+//
+void service_session(int sd, datagram_batch &batch, transfer_session &session);
+
+
+// handle_response
+//
+//  Apply an ACK or NAK response from the session's client, counting it in the session's
+//  metrics
+//
+void handle_response(int sd, datagram_batch &batch, transfer_session &session, char response_msg_buffer[]);
+
+
+// record_sent_packet
+//
+//  Note when a packet went on the wire and whether it was a retransmission
+//
+void record_sent_packet(transfer_session &session, uint32_t packet_index, bool retransmission);
+
+
+// sample_acked_packet
+//
+//  Clear any timeout backoff now that new data got through, and take an RTT sample from the
+//  packet unless it was resent, since then we cannot tell which copy the client answered
+//  (Karn's algorithm)
+//
+void sample_acked_packet(transfer_session &session, uint32_t packet_index);
+
+
+// record_delivered_bytes
+//
+//  Count every file byte between the first packet sent and the window base as delivered
+//
+void record_delivered_bytes(transfer_session &session);
+
+
+// signal_congestion
+//
+//  Tell the session's controller a packet was lost or a timer expired, reacting at most once
+//  per window of packets in flight
+//
+void signal_congestion(transfer_session &session, uint32_t packet_index, bool timeout);
+
+
+// send_window
+//
+//  Number of packets the session may have in flight, the smaller of the client's window and
+//  the congestion window
+//
+uint32_t send_window(transfer_session &session);
+
+
+// pacing_ready
+//
+//  Check whether the pacer lets the session put another packet on the wire yet
+//
+bool pacing_ready(transfer_session &session);
+
+
+// pace_packet
+//
+//  Move the session's next send time along by one packet at the controller's pacing rate
+//
+void pace_packet(transfer_session &session);
+
+
+// init_fec
+//
+//  Set the session up to follow every block of packets with parity packets, clamping what
+//  the client asked for to what the scheme supports
+//
+void init_fec(transfer_session &session, int scheme, int block, int parity);
+
+
+// add_fec_packet
+//
+//  Code a packet going out for the first time into its block's parity, sending the parity
+//  once the block is complete
+//
+void add_fec_packet(int sd, datagram_batch &batch, transfer_session &session, uint32_t packet_index);
+
+
+// finish_fec_block
+//
+//  Send the parity of the file's last, short block once every packet has gone out
+//
+void finish_fec_block(int sd, datagram_batch &batch, transfer_session &session);
+
+
+// send_fec_parity
+//
+//  Send the parity packets of the block built up so far and start a new block
+//
+void send_fec_parity(int sd, datagram_batch &batch, transfer_session &session);
+
+
+// go_back_n_service
+//
+//  Go back to the window base when the oldest packet times out, then fill the window
+//
+void go_back_n_service(int sd, datagram_batch &batch, transfer_session &session);
+
+
+// go_back_n_response
+//
+//  Slide the window over a cumulative ACK, or go back to the packet a NAK requests
+//
+void go_back_n_response(transfer_session &session, char response_msg_buffer[]);
+
+
+// selective_repeat_service
+//
+//  Fill the window and resend only the packets whose own timer expired
+//
+void selective_repeat_service(int sd, datagram_batch &batch, transfer_session &session);
+
+
+// selective_repeat_response
+//
+//  Mark an individually ACKed packet, or resend the single packet a NAK names
+//
+void selective_repeat_response(int sd, datagram_batch &batch, transfer_session &session, char response_msg_buffer[]);
+
+
+int main(int argc, char **argv) {
+
+    if (!parse_arguments(argc, argv)) {
+        return 1;
+    }
+
+    // Shutdown signals are only ever collected by the main thread, so block them before
+    // any worker starts and inherits the mask
+    sigset_t shutdown_signals;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, NULL);
+
+    // A mapped file that shrinks under a transfer only ends that transfer
+    struct sigaction fault_action = {};
+    fault_action.sa_sigaction = handle_mapping_fault;
+    fault_action.sa_flags = SA_SIGINFO;
+    sigaction(SIGBUS, &fault_action, NULL);
+
+    // Log lines are written out by a background thread from here on
+    log_start(LOG_LEVEL);
+
+    if (impairment_active(impairment_config)) {
+        const impairment_settings &config = impairment_config;
+        LOG_INFO("[Info] Impairing packets with seed " << config.seed << ": loss " << config.loss_chance
+                 << ", damage " << config.damage_chance << ", delay " << config.delay_chance << " by " << config.delay_us << " us"
+                 << ", reorder " << config.reorder_chance << " within " << config.reorder_us << " us"
+                 << ", duplicate " << config.duplicate_chance << ", bursts " << config.burst_enter_chance
+                 << "/" << config.burst_exit_chance << " losing " << config.burst_loss_chance);
+    }
+
+    // Start one worker per core unless told otherwise. Every worker's socket is bound before
+    // any of them starts, so a port we cannot have stops the server instead of leaving
+    // workers serving nothing.
+    int worker_count = WORKER_COUNT > 0 ? WORKER_COUNT : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<int> worker_sockets;
+    for (int i = 0; i < worker_count; i++) {
+        int sd = open_worker_socket();
+        if (sd < 0) {
+            for (int opened : worker_sockets) {
+                close(opened);
+            }
+            log_stop();
+            return 1;
+        }
+        worker_sockets.push_back(sd);
+    }
+
+    int shutdown_fd = eventfd(0, EFD_NONBLOCK);
+    packet_cache_start();
+
+    std::vector<worker_stats> stats(worker_count);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < worker_count; i++) {
+        workers.emplace_back(run_worker, i, worker_sockets[i], std::ref(stats[i]), shutdown_fd);
+    }
+
+    // Serve live stats to anything that connects to the stats socket
+    stats_socket stats_listener;
+    if (!STATS_SOCKET_PATH.empty()) {
+        if (stats_socket_start(stats_listener, STATS_SOCKET_PATH, [&stats]() { return server_stats_json(stats); })) {
+            LOG_INFO("[Info] Serving live stats on " << STATS_SOCKET_PATH);
+        } else {
+            LOG_ERROR("[Error] Could not open stats socket " << STATS_SOCKET_PATH);
+        }
+    }
+
+    LOG_INFO("Ready with " << worker_count << " workers");
+
+    // Report per-worker stats until we are asked to shut down
+    std::vector<uint64_t> last_packets_sent(worker_count, 0);
+    struct timespec stats_interval = { STATS_INTERVAL_SEC, 0 };
+
+    while (sigtimedwait(&shutdown_signals, NULL, &stats_interval) < 0) {
+
+        // Stay quiet while the server is idle
+        bool active = false;
+        for (int i = 0; i < worker_count; i++) {
+            active |= stats[i].packets_sent.load(std::memory_order_relaxed) != last_packets_sent[i];
+        }
+
+        if (active) {
+            report_worker_stats(stats, last_packets_sent, STATS_INTERVAL_SEC);
+        }
+    }
+
+    // Wake every worker's event loop so it can exit, then report the totals
+    uint64_t wake = 1;
+    write(shutdown_fd, &wake, sizeof(wake));
+
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+
+    packet_cache_stop();
+    stats_socket_stop(stats_listener);
+
+    LOG_INFO("Shutting down");
+    std::fill(last_packets_sent.begin(), last_packets_sent.end(), 0);
+    report_worker_stats(stats, last_packets_sent, 0);
+
+    LOG_INFO("[Stats] Packet cache: " << file_cache.hits.load(std::memory_order_relaxed) << " hits, "
+             << file_cache.misses.load(std::memory_order_relaxed) << " misses, "
+             << file_cache.evictions.load(std::memory_order_relaxed) << " evictions");
+
+    close(shutdown_fd);
+    log_stop();
+
+    return 0;
+}
+
+
+// parse_arguments
+//
+//  Read the impairment settings and tunables from the command line, returning false after
+//  printing the usage if they do not make sense
+//
+bool parse_arguments(int argc, char **argv) {
+    struct option options[] = {
+        { "loss", required_argument, NULL, 'l' },
+        { "damage", required_argument, NULL, 'd' },
+        { "delay", required_argument, NULL, 'y' },
+        { "delay-time", required_argument, NULL, 't' },
+        { "reorder", required_argument, NULL, 'r' },
+        { "reorder-time", required_argument, NULL, 'R' },
+        { "duplicate", required_argument, NULL, 'u' },
+        { "burst-enter", required_argument, NULL, 'b' },
+        { "burst-exit", required_argument, NULL, 'B' },
+        { "burst-loss", required_argument, NULL, 'L' },
+        { "seed", required_argument, NULL, 'S' },
+        { "workers", required_argument, NULL, 'w' },
+        { "cache-size", required_argument, NULL, 'c' },
+        { "batch-size", required_argument, NULL, 'i' },
+        { "congestion", required_argument, NULL, 'C' },
+        { "log-level", required_argument, NULL, 'v' },
+        { "stats-socket", required_argument, NULL, 's' },
+        { "no-compression", no_argument, NULL, 'n' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    impairment_settings &config = impairment_config;
+
+    int option;
+    while ((option = getopt_long(argc, argv, "l:d:y:t:r:R:u:b:B:L:S:w:c:i:C:v:s:nh", options, NULL)) != -1) {
+        char *end = NULL;
+
+        switch (option) {
+            case 'l':
+                config.loss_chance = strtod(optarg, &end);
+                break;
+            case 'd':
+                config.damage_chance = strtod(optarg, &end);
+                break;
+            case 'y':
+                config.delay_chance = strtod(optarg, &end);
+                break;
+            case 't':
+                config.delay_us = strtoll(optarg, &end, 10);
+                break;
+            case 'r':
+                config.reorder_chance = strtod(optarg, &end);
+                break;
+            case 'R':
+                config.reorder_us = strtoll(optarg, &end, 10);
+                break;
+            case 'u':
+                config.duplicate_chance = strtod(optarg, &end);
+                break;
+            case 'b':
+                config.burst_enter_chance = strtod(optarg, &end);
+                break;
+            case 'B':
+                config.burst_exit_chance = strtod(optarg, &end);
+                break;
+            case 'L':
+                config.burst_loss_chance = strtod(optarg, &end);
+                break;
+            case 'S':
+                config.seed = strtoull(optarg, &end, 10);
+                break;
+            case 'w':
+                WORKER_COUNT = strtol(optarg, &end, 10);
+                break;
+            case 'c':
+                PACKET_CACHE_BYTES = strtoull(optarg, &end, 10) * 1024 * 1024;
+                break;
+            case 'i':
+                BATCH_SIZE = strtol(optarg, &end, 10);
+                break;
+            case 'C':
+                if (std::find(CONGESTION_CONTROLS.begin(), CONGESTION_CONTROLS.end(), optarg) == CONGESTION_CONTROLS.end()) {
+                    std::cerr << "Unknown congestion control '" << optarg << "'" << std::endl;
+                    print_usage(argv[0]);
+                    return false;
+                }
+                CONGESTION_CONTROL = optarg;
+                break;
+            case 'v':
+                LOG_LEVEL = log_level_from_name(optarg);
+                if (LOG_LEVEL < 0) {
+                    std::cerr << "Unknown log level '" << optarg << "'" << std::endl;
+                    print_usage(argv[0]);
+                    return false;
+                }
+                break;
+            case 's':
+                STATS_SOCKET_PATH = optarg;
+                break;
+            case 'n':
+                BLOCK_COMPRESSION = false;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+            default:
+                print_usage(argv[0]);
+                return false;
+        }
+
+        if (end != NULL && (end == optarg || *end != '\0')) {
+            std::cerr << "Expected a number for -" << (char)option << ", got '" << optarg << "'" << std::endl;
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+
+    if (optind < argc) {
+        std::cerr << "Unexpected argument '" << argv[optind] << "'" << std::endl;
+        print_usage(argv[0]);
+        return false;
+    }
+
+    // Impairment chances are probabilities
+    for (double chance : { config.loss_chance, config.damage_chance, config.delay_chance, config.reorder_chance,
+                           config.duplicate_chance, config.burst_enter_chance, config.burst_exit_chance, config.burst_loss_chance }) {
+        if (chance < 0 || chance > 1) {
+            std::cerr << "Impairment chances must be between 0 and 1" << std::endl;
+            return false;
+        }
+    }
+
+    if (config.delay_us < 0 || config.reorder_us < 0 || WORKER_COUNT < 0) {
+        std::cerr << "Delay times and worker count cannot be negative" << std::endl;
+        return false;
+    }
+
+    if (BATCH_SIZE < 1 || BATCH_SIZE > MAX_BATCH_SIZE) {
+        std::cerr << "Batch size must be 1 to " << MAX_BATCH_SIZE << " datagrams" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+
+// print_usage
+//
+//  Describe the command line options
+//
+void print_usage(const char *program) {
+    impairment_settings defaults;
+
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  -l, --loss CHANCE          chance a packet is dropped (0-1, default 0)\n"
+              << "  -d, --damage CHANCE        chance a packet is damaged (0-1, default 0)\n"
+              << "  -y, --delay CHANCE         chance a packet is delayed (0-1, default 0)\n"
+              << "  -t, --delay-time US        how long delayed packets are held (default 0)\n"
+              << "  -r, --reorder CHANCE       chance a packet is held back so later ones overtake it (0-1, default 0)\n"
+              << "  -R, --reorder-time US      longest a reordered packet is held (default " << defaults.reorder_us << ")\n"
+              << "  -u, --duplicate CHANCE     chance a packet is sent twice (0-1, default 0)\n"
+              << "  -b, --burst-enter CHANCE   chance per packet of a loss burst starting (0-1, default 0)\n"
+              << "  -B, --burst-exit CHANCE    chance per packet of a loss burst ending (0-1, default " << defaults.burst_exit_chance << ")\n"
+              << "  -L, --burst-loss CHANCE    chance a packet is dropped during a burst (0-1, default " << defaults.burst_loss_chance << ")\n"
+              << "  -S, --seed N               seed for every impairment decision (default " << defaults.seed << ")\n"
+              << "  -w, --workers N            worker threads, 0 for one per core (default " << WORKER_COUNT << ")\n"
+              << "  -c, --cache-size MB        memory for cached packetized files, 0 to disable (default " << PACKET_CACHE_BYTES / (1024 * 1024) << ")\n"
+              << "  -i, --batch-size N         datagrams moved per sendmmsg or recvmmsg call (default " << BATCH_SIZE << ")\n"
+              << "  -C, --congestion NAME      congestion control for every transfer (default " << CONGESTION_CONTROL << ")\n"
+              << "  -v, --log-level LEVEL      trace, debug, info, error or off (default info)\n"
+              << "  -s, --stats-socket PATH    live stats socket, empty to disable (default " << STATS_SOCKET_PATH << ")\n"
+              << "  -n, --no-compression       refuse clients asking for compressed transfers\n"
+              << "  -h, --help                 show this help" << std::endl;
+}
+
+
+// empty_buffer
+//
+//  Set all cells of a char buffer to NUL character
+//
+void empty_buffer(char buffer[], int size) {
+    for (int i = 0; i < size; i++) {
+        buffer[i] = '\0';
+    }
+}
+
+
+// generate_packet_num
+// 
+//  Given a uint32_t packet number, return the value in a provided char[4] buffer
+//
+void generate_packet_num(uint32_t packet_num, char packet_num_buffer[]) {
+    LOG_TRACE("\tGenerated Packet Number: " << packet_num);
+    memcpy(packet_num_buffer, &packet_num, sizeof(packet_num));
+}
+
+
+// generate_checksum
+// 
+//  Given a packet number and its payload, generate a CRC32C covering the number, the payload
+//  length and the payload, and return the value in a provided char[4] buffer. Covering the
+//  header fields means a damaged header is caught too, and the payload may hold any bytes
+//  including NUL.
+//
+void generate_checksum(uint32_t packet_num, const char data_buffer[], int length, char checksum_buffer[]) {
+    uint16_t payload_length = length;
+    uint32_t checksum = crc32c(0, (const char *)&packet_num, sizeof(packet_num));
+    checksum = crc32c(checksum, (const char *)&payload_length, sizeof(payload_length));
+    checksum = crc32c(checksum, data_buffer, length);
+    LOG_TRACE("\tGenerated Checksum: " << checksum);
+    memcpy(checksum_buffer, &checksum, sizeof(checksum));
+}
+
+// buffToUint32
+//
+//  Convert a char[4] buffer to an uint32_t
+//
+uint32_t buffToUint32(char* buffer)
+{
+    int a;
+    memcpy(&a, buffer, sizeof( int ) );
+    return a;
+}
+
+// parse_request_options
+//
+//  Parse the NUL separated key=value options that follow the filename in a GET request
+//
+std::map<std::string, std::string> parse_request_options(char buffer[], int size) {
+    std::map<std::string, std::string> options;
+    int position = 0;
+
+    while (position < size && buffer[position] != '\0') {
+        std::string option(buffer + position, strnlen(buffer + position, size - position));
+        position += option.length() + 1;
+
+        size_t separator = option.find('=');
+        if (separator != std::string::npos) {
+            options[option.substr(0, separator)] = option.substr(separator + 1);
+        }
+    }
+
+    return options;
+}
+
+
+// append_option
+//
+//  Write a NUL terminated key=value option into a response at the given position, returning
+//  the position just past it
+//
+int append_option(char packet[], int position, const std::string &option) {
+    if (position + (int)option.length() + 1 >= SEGMENT_SIZE) {
+        return position;
+    }
+
+    std::memcpy(packet + position, option.c_str(), option.length() + 1);
+    return position + option.length() + 1;
+}
+
+
+// requested_range
+//
+//  Find the bytes a request asks for, from either range=FIRST-LAST or start=SEGMENT, as the
+//  first byte and the byte past the last. Ranges leaving out LAST run to the end of the file.
+//  Returns false if it asks for the whole file or the range makes no sense.
+//
+bool requested_range(std::map<std::string, std::string> &request_options, int data_size, uint64_t &first_byte, uint64_t &end_byte) {
+    first_byte = 0;
+    end_byte = UINT64_MAX;
+    char *end = NULL;
+
+    if (!request_options["range"].empty()) {
+        const char *range = request_options["range"].c_str();
+        uint64_t first = strtoull(range, &end, 10);
+        if (end == range || *end != '-') {
+            return false;
+        }
+
+        const char *last = end + 1;
+        if (*last != '\0') {
+            uint64_t last_byte = strtoull(last, &end, 10);
+            if (*end != '\0' || last_byte < first) {
+                return false;
+            }
+            end_byte = last_byte + 1;
+        }
+
+        first_byte = first;
+        return true;
+    }
+
+    if (!request_options["start"].empty()) {
+        uint64_t segment = strtoull(request_options["start"].c_str(), &end, 10);
+        if (*end != '\0') {
+            return false;
+        }
+
+        first_byte = segment * data_size;
+        return true;
+    }
+
+    return false;
+}
+
+
+// file_etag
+//
+//  Tag naming one version of a file, which changes whenever the file is replaced or rewritten
+//
+std::string file_etag(ino_t inode, off_t size, const struct timespec &modified) {
+    char etag[64];
+    snprintf(etag, sizeof(etag), "%llx-%llx-%llx", (unsigned long long)inode, (unsigned long long)size,
+             (unsigned long long)modified.tv_sec * 1000000000ULL + modified.tv_nsec);
+    return etag;
+}
+
+
+// sequence_before
+//
+//  Compare two 32-bit packet numbers, staying correct when the numbers wrap around
+//
+bool sequence_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+
+// window_ring_size
+//
+//  Round a window size up to a power of two so packet_number % size stays continuous when
+//  packet numbers wrap around
+//
+int window_ring_size(int window_size) {
+    int size = 1;
+    while (size < window_size) {
+        size <<= 1;
+    }
+    return size;
+}
+
+
+// init_rtt_estimator
+//
+//  Start an estimator with no samples and the default retransmission timeout
+//
+void init_rtt_estimator(rtt_estimator &rtt) {
+    rtt.srtt_us = 0;
+    rtt.rttvar_us = 0;
+    rtt.rto_us = RETRANSMIT_TIMEOUT_US;
+    rtt.ack_delay_us = 0;
+    rtt.backoff = 0;
+    rtt.has_sample = false;
+}
+
+
+// rtt_sample
+//
+//  Fold a measured round trip time into the estimator and recompute the retransmission timeout
+//
+void rtt_sample(rtt_estimator &rtt, double sample_us) {
+    if (!rtt.has_sample) {
+        rtt.srtt_us = sample_us;
+        rtt.rttvar_us = sample_us / 2;
+        rtt.has_sample = true;
+    } else {
+        // Jacobson/Karels gains of 1/4 for the variation and 1/8 for the mean
+        rtt.rttvar_us = 0.75 * rtt.rttvar_us + 0.25 * std::fabs(rtt.srtt_us - sample_us);
+        rtt.srtt_us = 0.875 * rtt.srtt_us + 0.125 * sample_us;
+    }
+
+    rtt.rto_us = rtt.srtt_us + 4 * rtt.rttvar_us;
+    rtt.rto_us = std::max((double)MIN_RETRANSMIT_TIMEOUT_US, std::min((double)MAX_RETRANSMIT_TIMEOUT_US, rtt.rto_us));
+}
+
+
+// rtt_backoff
+//
+//  Double the retransmission timeout after it expires
+//
+void rtt_backoff(rtt_estimator &rtt) {
+    if (rtt.rto_us * (1 << rtt.backoff) < MAX_RETRANSMIT_TIMEOUT_US) {
+        rtt.backoff++;
+    }
+}
+
+
+// rtt_reset_backoff
+//
+//  Drop back to the estimated timeout once the client acknowledges new data
+//
+void rtt_reset_backoff(rtt_estimator &rtt) {
+    rtt.backoff = 0;
+}
+
+
+// retransmit_timeout
+//
+//  Get the estimator's current retransmission timeout, with time for a coalesced ACK to be
+//  held back on top
+//
+std::chrono::microseconds retransmit_timeout(const rtt_estimator &rtt) {
+    return std::chrono::microseconds((int64_t)std::min((double)MAX_RETRANSMIT_TIMEOUT_US, rtt.rto_us * (1 << rtt.backoff) + rtt.ack_delay_us));
+}
+
+
+// make_congestion_control
+//
+//  Create the named congestion controller for a transfer, returning NULL for names we do
+//  not know
+//
+std::unique_ptr<congestion_control> make_congestion_control(const std::string &name, int max_window) {
+    if (name == "reno") {
+        return std::unique_ptr<congestion_control>(new reno_control(max_window));
+    }
+
+    LOG_ERROR("[Error] Unknown congestion control '" << name << "'");
+    return NULL;
+}
+
+
+// reno_control
+//
+//  Start in slow start with the initial window and no threshold yet
+//
+reno_control::reno_control(int max_window) {
+    this->max_window = max_window;
+    congestion_window = std::min(INITIAL_CONGESTION_WINDOW, max_window);
+    slow_start_threshold = max_window;
+}
+
+
+const char *reno_control::name() const {
+    return "reno";
+}
+
+
+// reno_control::on_ack
+//
+//  Grow by one packet per packet acknowledged in slow start, and by one packet per window
+//  once past the threshold. There is no point growing past the client's window.
+//
+void reno_control::on_ack(uint32_t acked_count, const rtt_estimator &) {
+    if (congestion_window < slow_start_threshold) {
+        congestion_window += acked_count;
+    } else {
+        congestion_window += acked_count / congestion_window;
+    }
+    congestion_window = std::min(congestion_window, (double)max_window);
+}
+
+
+// reno_control::on_loss
+//
+//  Halve the window when a loss is reported and carry on from there
+//
+void reno_control::on_loss() {
+    slow_start_threshold = std::max(congestion_window / 2, 2.0);
+    congestion_window = slow_start_threshold;
+}
+
+
+// reno_control::on_timeout
+//
+//  A timeout means the ACK clock stopped, so remember half the window and slow start again
+//  from a single packet
+//
+void reno_control::on_timeout() {
+    slow_start_threshold = std::max(congestion_window / 2, 2.0);
+    congestion_window = 1;
+}
+
+
+double reno_control::window() const {
+    return congestion_window;
+}
+
+
+// reno_control::pacing_interval_us
+//
+//  Send a window per smoothed RTT, twice as fast in slow start so the window can still double
+//  each round trip. Until the RTT is known packets are not paced at all.
+//
+double reno_control::pacing_interval_us(const rtt_estimator &rtt) const {
+    if (!rtt.has_sample) {
+        return 0;
+    }
+
+    double gain = congestion_window < slow_start_threshold ? 2.0 : 1.25;
+    return rtt.srtt_us / (congestion_window * gain);
+}
+
+
+// init_packet_ring
+//
+//  Prepare an empty ring with one packet slot per window position for the given file, cut
+//  into payloads of data_size bytes, compressing every payload if asked to. Slots only get a
+//  data buffer once the file has to be read or compressed into one, so mapped files never
+//  pay for them.
+//
+void init_packet_ring(packet_ring &ring, std::ifstream &file, int window_size, int data_size, bool compressed) {
+    ring.file = &file;
+    ring.cached_file.reset();
+    ring.mapped_file = NULL;
+    ring.mapped_size = 0;
+    ring.mapping = NULL;
+    ring.encoder.reset();
+    ring.delta.clear();
+    ring.delta_sent = 0;
+    ring.delta_length = 0;
+    ring.data_size = data_size;
+    ring.compressed = compressed;
+    ring.payload_size = data_size + (compressed ? BLOCK_METHOD_SIZE : 0);
+    ring.probe = compression_probe();
+    ring.batch = false;
+    ring.batch_files.clear();
+    ring.batch_position = 0;
+    ring.packets_read = 0;
+    ring.end_packet = UINT32_MAX;
+    ring.finished = false;
+
+    ring.slots.resize(window_ring_size(window_size));
+    for (packet_slot &slot : ring.slots) {
+        slot.header_buffer.assign(HEADER_SIZE, '\0');
+        slot.header = &slot.header_buffer[0];
+        slot.payload = NULL;
+        slot.payload_length = 0;
+        slot.raw_length = 0;
+    }
+}
+
+
+// map_packet_ring
+//
+//  Memory map the file so packets are sent straight from the mapping, returning false if the
+//  file cannot be mapped and must be read instead
+//
+bool map_packet_ring(packet_ring &ring, const std::string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode) || file_stat.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    void *mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    madvise(mapping, file_stat.st_size, MADV_SEQUENTIAL);
+
+    ring.mapped_file = (const char *)mapping;
+    ring.mapped_size = file_stat.st_size;
+    worker_mappings.push_back({ ring.mapped_file, ring.mapped_size, 0 });
+    ring.mapping = &worker_mappings.back();
+    return true;
+}
+
+
+// handle_mapping_fault
+//
+//  SIGBUS handler. A fault inside one of the worker's mapped files means the file shrank, so
+//  the missing page is replaced with zeros and the mapping marked truncated. Any other fault
+//  kills the server as it always would have.
+//
+void handle_mapping_fault(int signal_number, siginfo_t *info, void *) {
+    const char *address = (const char *)info->si_addr;
+
+    for (file_mapping &mapping : worker_mappings) {
+        if (address < mapping.start || address >= mapping.start + mapping.size) {
+            continue;
+        }
+
+        // Returning retries the read, which now finds the zero page
+        void *page = (void *)((uintptr_t)address & ~(uintptr_t)(mapping_page_size - 1));
+        if (mmap(page, mapping_page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+            mapping.truncated = 1;
+            return;
+        }
+        break;
+    }
+
+    // Retrying the read now faults with the default action
+    signal(signal_number, SIG_DFL);
+}
+
+
+// packet_ring_truncated
+//
+//  Check whether the file being sent shrank under its mapping, so packets past its new end
+//  would carry zeros instead of the file
+//
+bool packet_ring_truncated(const packet_ring &ring) {
+    return ring.mapping != NULL && ring.mapping->truncated;
+}
+
+
+// packet_ring_waiting
+//
+//  Check whether the next packet is not ready yet only because the delta it comes from is
+//  still being written
+//
+bool packet_ring_waiting(const packet_ring &ring) {
+    return ring.encoder != NULL && !ring.encoder->finished && !ring.finished;
+}
+
+
+// cache_packet_ring
+//
+//  Serve the file from the packet cache. Returns false if it is not cached yet or cannot be
+//  cached, and must be read or mapped instead.
+//
+bool cache_packet_ring(packet_ring &ring, const std::string &filename) {
+    ring.cached_file = acquire_packetized_file(filename, ring.data_size, ring.compressed);
+    return ring.cached_file != NULL;
+}
+
+
+// delta_packet_ring
+//
+//  Serve the delta turning the client's copy of the file, known by its block signatures,
+//  into ours instead of the file itself. Returns false if the file cannot be read for it.
+//  The file stays mapped for the whole transfer, the delta being written from it a step at a
+//  time as packets need more of it.
+//
+bool delta_packet_ring(packet_ring &ring, const std::string &filename, int block_size, std::vector<delta_signature> signatures) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) {
+        close(fd);
+        return false;
+    }
+
+    void *mapping = NULL;
+    if (file_stat.st_size > 0) {
+        mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    // An empty file has no mapping, its delta is only the end record
+    if (mapping != NULL) {
+        madvise(mapping, file_stat.st_size, MADV_SEQUENTIAL);
+        ring.mapped_file = (const char *)mapping;
+        ring.mapped_size = file_stat.st_size;
+        worker_mappings.push_back({ ring.mapped_file, ring.mapped_size, 0 });
+        ring.mapping = &worker_mappings.back();
+    }
+
+    ring.encoder.reset(new delta_encoder());
+    delta_encoder_init(*ring.encoder, ring.mapped_file, file_stat.st_size, block_size, std::move(signatures));
+    return true;
+}
+
+
+// seek_packet_ring
+//
+//  Serve only the packets from first_packet up to but not including end_packet. Mapped and
+//  cached files just start counting from the first packet, read files seek to it.
+//
+void seek_packet_ring(packet_ring &ring, uint32_t first_packet, uint64_t end_packet) {
+    ring.packets_read = first_packet;
+    ring.end_packet = end_packet;
+
+    if (ring.cached_file == NULL && ring.mapped_file == NULL && first_packet > 0) {
+        ring.file->seekg((std::streamoff)first_packet * ring.data_size);
+    }
+}
+
+
+// packet_cache_start
+//
+//  Start the thread packetizing the files the packet cache misses, unless the cache is off
+//
+void packet_cache_start() {
+    if (PACKET_CACHE_BYTES == 0) {
+        return;
+    }
+
+    file_cache.stopping = false;
+    file_cache.packetizer = std::thread([]() {
+        std::unique_lock<std::mutex> lock(file_cache.mutex);
+
+        while (true) {
+            file_cache.job_ready.wait(lock, []() { return file_cache.stopping || !file_cache.jobs.empty(); });
+            if (file_cache.stopping) {
+                break;
+            }
+
+            packet_cache_job job = std::move(file_cache.jobs.front());
+            file_cache.jobs.pop_front();
+
+            // Packetize without holding the lock so workers keep finding cached files
+            lock.unlock();
+            std::shared_ptr<packetized_file> packetized = packetize_file(job.path, job.data_size, job.compressed, job.file_stat);
+            lock.lock();
+
+            if (packetized != NULL) {
+                cache_packetized_file(job.key, packetized);
+            }
+            file_cache.queued_keys.erase(job.key);
+        }
+    });
+}
+
+
+// packet_cache_stop
+//
+//  Finish the file being packetized, drop the rest of the queue and stop the cache thread
+//
+void packet_cache_stop() {
+    if (!file_cache.packetizer.joinable()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(file_cache.mutex);
+        file_cache.stopping = true;
+    }
+    file_cache.job_ready.notify_one();
+    file_cache.packetizer.join();
+}
+
+
+// acquire_packetized_file
+//
+//  Find the file in the packet cache. Returns NULL on a miss, or when the file changed on
+//  disk since it was cached, after queueing it for the cache thread, and for files that
+//  cannot be cached. Packetizing a big file, let alone compressing it, takes far longer than
+//  a first packet should, so the transfer that missed is served from disk meanwhile.
+//
+std::shared_ptr<const packetized_file> acquire_packetized_file(const std::string &filename, int data_size, bool compressed) {
+    if (PACKET_CACHE_BYTES == 0) {
+        return NULL;
+    }
+
+    struct stat file_stat;
+    if (stat(filename.c_str(), &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) {
+        return NULL;
+    }
+
+    std::string key = packet_cache_key(filename, data_size, compressed);
+
+    {
+        std::lock_guard<std::mutex> lock(file_cache.mutex);
+        auto found = file_cache.index.find(key);
+
+        if (found != file_cache.index.end()) {
+            std::shared_ptr<const packetized_file> cached = *found->second;
+
+            // A file replaced or rewritten since it was cached has to be read again
+            if (cached->device == file_stat.st_dev && cached->inode == file_stat.st_ino && cached->size == file_stat.st_size &&
+                cached->modified.tv_sec == file_stat.st_mtim.tv_sec && cached->modified.tv_nsec == file_stat.st_mtim.tv_nsec) {
+                file_cache.entries.splice(file_cache.entries.begin(), file_cache.entries, found->second);
+                file_cache.hits.fetch_add(1, std::memory_order_relaxed);
+                return cached;
+            }
+
+            file_cache.used_bytes -= packetized_file_bytes(*cached);
+            file_cache.entries.erase(found->second);
+            file_cache.index.erase(found);
+        }
+    }
+
+    file_cache.misses.fetch_add(1, std::memory_order_relaxed);
+
+    // Files that could never fit are served from disk every time
+    size_t packet_count = (file_stat.st_size + data_size - 1) / data_size;
+    if ((size_t)file_stat.st_size + packet_count * HEADER_SIZE > PACKET_CACHE_BYTES) {
+        return NULL;
+    }
+
+    std::lock_guard<std::mutex> lock(file_cache.mutex);
+    if (file_cache.packetizer.joinable() && file_cache.queued_keys.insert(key).second) {
+        file_cache.jobs.push_back({ key, filename, data_size, compressed, file_stat });
+        file_cache.job_ready.notify_one();
+    }
+
+    return NULL;
+}
+
+
+// cache_packetized_file
+//
+//  Put a freshly packetized file in the packet cache under key, evicting the least recently
+//  used files to make room. Called with the cache's lock held.
+//
+void cache_packetized_file(const std::string &key, std::shared_ptr<const packetized_file> packetized) {
+    size_t bytes = packetized_file_bytes(*packetized);
+
+    auto found = file_cache.index.find(key);
+    if (found != file_cache.index.end()) {
+        file_cache.used_bytes -= packetized_file_bytes(**found->second);
+        file_cache.entries.erase(found->second);
+        file_cache.index.erase(found);
+    }
+
+    // Make room by evicting the least recently used files
+    while (!file_cache.entries.empty() && file_cache.used_bytes + bytes > PACKET_CACHE_BYTES) {
+        const packetized_file &evicted = *file_cache.entries.back();
+        file_cache.used_bytes -= packetized_file_bytes(evicted);
+        file_cache.index.erase(packet_cache_key(evicted.path, evicted.data_size, evicted.compressed));
+        file_cache.entries.pop_back();
+        file_cache.evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    file_cache.entries.push_front(packetized);
+    file_cache.index[key] = file_cache.entries.begin();
+    file_cache.used_bytes += bytes;
+}
+
+
+// packet_cache_key
+//
+//  Key of a packetized file in the packet cache. The same file cut into payloads of another
+//  size or compressed is a different entry.
+//
+std::string packet_cache_key(const std::string &filename, int data_size, bool compressed) {
+    return filename + '\0' + std::to_string(data_size) + (compressed ? "\0lz" : "");
+}
+
+
+// packetize_file
+//
+//  Read a whole regular file and build the header of every packet it is cut into. Compressed
+//  payloads replace the file's data, packed back to back.
+//
+std::shared_ptr<packetized_file> packetize_file(const std::string &filename, int data_size, bool compressed, const struct stat &file_stat) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    std::shared_ptr<packetized_file> packetized = std::make_shared<packetized_file>();
+    packetized->path = filename;
+    packetized->data_size = data_size;
+    packetized->compressed = compressed;
+    packetized->device = file_stat.st_dev;
+    packetized->inode = file_stat.st_ino;
+    packetized->modified = file_stat.st_mtim;
+    packetized->size = file_stat.st_size;
+    packetized->data.resize(file_stat.st_size);
+
+    size_t read_bytes = 0;
+    while (read_bytes < packetized->data.size()) {
+        ssize_t result = read(fd, &packetized->data[read_bytes], packetized->data.size() - read_bytes);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            break;
+        }
+        read_bytes += result;
+    }
+    close(fd);
+
+    // The file shrank while we read it, leave it to the next request
+    if (read_bytes != packetized->data.size()) {
+        return NULL;
+    }
+
+    packetized->packet_count = (packetized->data.size() + data_size - 1) / data_size;
+    packetized->headers.resize((size_t)packetized->packet_count * HEADER_SIZE);
+
+    if (compressed) {
+        std::vector<char> packed(packetized->packet_count * (size_t)(data_size + BLOCK_METHOD_SIZE));
+        compression_probe probe = compression_probe();
+        packetized->offsets.assign(1, 0);
+
+        for (uint32_t i = 0; i < packetized->packet_count; i++) {
+            size_t offset = (size_t)i * data_size;
+            int raw_length = std::min((size_t)data_size, packetized->data.size() - offset);
+            int payload_length = pack_payload(probe, packetized->data.data() + offset, raw_length, &packed[packetized->offsets.back()]);
+            packetized->offsets.push_back(packetized->offsets.back() + payload_length);
+        }
+
+        packed.resize(packetized->offsets.back());
+        packed.shrink_to_fit();
+        packetized->data.swap(packed);
+    }
+
+    for (uint32_t i = 0; i < packetized->packet_count; i++) {
+        size_t offset = compressed ? packetized->offsets[i] : (size_t)i * data_size;
+        size_t payload_length = compressed ? packetized->offsets[i + 1] - offset : std::min((size_t)data_size, packetized->data.size() - offset);
+        build_packet_header(i, packetized->data.data() + offset, payload_length, &packetized->headers[(size_t)i * HEADER_SIZE]);
+    }
+
+    LOG_INFO("[Info] Cached " << filename << " as " << packetized->packet_count << " packets of " << data_size << " bytes"
+             << (compressed ? ", compressed to " + std::to_string(packetized->data.size()) + " bytes" : ""));
+    return packetized;
+}
+
+
+// packetized_file_bytes
+//
+//  Memory a packetized file takes up, counted against PACKET_CACHE_BYTES
+//
+size_t packetized_file_bytes(const packetized_file &file) {
+    return sizeof(file) + file.path.size() + file.data.size() + file.headers.size() + file.offsets.size() * sizeof(size_t);
+}
+
+
+// pack_payload
+//
+//  Write a block of the file as a compressed transfer's payload, compressed unless that
+//  would not make it smaller or the transfer's probe gave up on compressing. Returns the
+//  payload length. A transfer stops trying once its first packets show the file is not
+//  worth it, which keeps the cost of serving incompressible files down to a copy.
+//
+int pack_payload(compression_probe &probe, const char raw[], int raw_length, char packed[]) {
+    int compressed_length = -1;
+    if (!probe.skipped) {
+        compressed_length = lz_compress(raw, raw_length, packed + BLOCK_METHOD_SIZE, raw_length - 1);
+
+        probe.packets++;
+        probe.raw_bytes += raw_length;
+        probe.packed_bytes += compressed_length < 0 ? raw_length : compressed_length;
+        if (probe.packets == (uint32_t)COMPRESSION_PROBE_PACKETS && probe.packed_bytes > probe.raw_bytes * (1 - COMPRESSION_MIN_SAVING)) {
+            probe.skipped = true;
+            LOG_DEBUG("[Info] Only saved " << probe.raw_bytes - probe.packed_bytes << " of " << probe.raw_bytes
+                      << " bytes compressing, sending the rest stored");
+        }
+    }
+
+    if (compressed_length < 0) {
+        packed[0] = BLOCK_STORED;
+        std::memcpy(packed + BLOCK_METHOD_SIZE, raw, raw_length);
+        return BLOCK_METHOD_SIZE + raw_length;
+    }
+
+    packed[0] = BLOCK_COMPRESSED;
+    return BLOCK_METHOD_SIZE + compressed_length;
+}
+
+
+// build_packet_header
+//
+//  Write the header for a packet carrying the given payload
+//
+void build_packet_header(uint32_t packet_num, const char payload[], int payload_length, char header[]) {
+    char checksum_buffer[CHECKSUM_SIZE];
+    char packet_count_buffer[PACKET_COUNT_SIZE];
+
+    // Generate our checksum over the packet number, payload length and payload
+    generate_checksum(packet_num, payload, payload_length, checksum_buffer);
+    generate_packet_num(packet_num, packet_count_buffer);
+    uint16_t length = payload_length;
+
+    std::memcpy(header, &TERM_OKAY, TERMINATOR_BYTE);
+    std::memcpy(header+TERMINATOR_BYTE, &checksum_buffer, CHECKSUM_SIZE);
+    std::memcpy(header+TERMINATOR_BYTE+CHECKSUM_SIZE, &packet_count_buffer, PACKET_COUNT_SIZE);
+    std::memcpy(header+TERMINATOR_BYTE+CHECKSUM_SIZE+PACKET_COUNT_SIZE, &length, PAYLOAD_LENGTH_SIZE);
+}
+
+
+// release_packet_ring
+//
+//  Unmap the file, let go of the cached file or delta, or close the batch's open file once
+//  the transfer is finished
+//
+void release_packet_ring(packet_ring &ring) {
+    ring.cached_file.reset();
+
+    for (batch_file &file : ring.batch_files) {
+        if (file.fd >= 0) {
+            close(file.fd);
+            file.fd = -1;
+        }
+    }
+
+    if (ring.mapping != NULL) {
+        munmap((void *)ring.mapped_file, ring.mapped_size);
+        worker_mappings.remove_if([&ring](const file_mapping &mapping) { return &mapping == ring.mapping; });
+    }
+    ring.mapped_file = NULL;
+    ring.mapped_size = 0;
+    ring.mapping = NULL;
+    ring.encoder.reset();
+    std::vector<char>().swap(ring.delta);
+    ring.delta_sent = 0;
+}
+
+
+// packet_available
+//
+//  Read the file ahead until the given packet is in the ring, returning false once the
+//  packet is past the end of the file, or while the delta it comes from is still being
+//  written
+//
+bool packet_available(packet_ring &ring, uint32_t packet_index) {
+    if (ring.batch) {
+        return batch_packet_available(ring, packet_index);
+    }
+
+    // Cached packets are ready to go, the slots only need to point at them
+    if (ring.cached_file != NULL) {
+        const packetized_file &cached = *ring.cached_file;
+
+        while (!sequence_before(packet_index, ring.packets_read) && ring.packets_read < std::min<uint64_t>(cached.packet_count, ring.end_packet)) {
+            packet_slot &slot = ring_packet(ring, ring.packets_read);
+            size_t offset = (size_t)ring.packets_read * cached.data_size;
+
+            slot.header = &cached.headers[ring.packets_read * HEADER_SIZE];
+            slot.raw_length = std::min((size_t)cached.data_size, (size_t)cached.size - offset);
+            if (cached.compressed) {
+                slot.payload = cached.data.data() + cached.offsets[ring.packets_read];
+                slot.payload_length = cached.offsets[ring.packets_read + 1] - cached.offsets[ring.packets_read];
+            } else {
+                slot.payload = cached.data.data() + offset;
+                slot.payload_length = slot.raw_length;
+            }
+            ring.packets_read++;
+        }
+
+        return sequence_before(packet_index, ring.packets_read);
+    }
+
+    bool stepped = false;
+    while (!sequence_before(packet_index, ring.packets_read) && !ring.finished) {
+        if (ring.packets_read == ring.end_packet) {
+            ring.finished = true;
+            break;
+        }
+
+        // Overwrite a slot that has already left the window
+        packet_slot &slot = ring_packet(ring, ring.packets_read);
+
+        if (ring.encoder != NULL) {
+            // Write one more step of the delta at most per call when a packet's worth is not
+            // ready yet, coming back for the rest once the other sessions had their turn
+            delta_encoder &encoder = *ring.encoder;
+            if (ring.delta.size() - ring.delta_sent < (size_t)ring.data_size && !encoder.finished) {
+                if (stepped) {
+                    break;
+                }
+                size_t written = ring.delta.size();
+                delta_encode_step(encoder, ring.delta, DELTA_ENCODE_STEP);
+                ring.delta_length += ring.delta.size() - written;
+                stepped = true;
+                continue;
+            }
+
+            // Copy the packet out so the delta only ever holds what is not sent yet
+            size_t length = std::min((size_t)ring.data_size, ring.delta.size() - ring.delta_sent);
+            if (length == 0) {
+                ring.finished = true;
+                break;
+            }
+
+            slot.data.resize(ring.data_size);
+            std::memcpy(&slot.data[0], &ring.delta[ring.delta_sent], length);
+            ring.delta_sent += length;
+            if (ring.delta_sent == ring.delta.size()) {
+                ring.delta.clear();
+                ring.delta_sent = 0;
+            } else if (ring.delta_sent >= (size_t)DELTA_ENCODE_STEP) {
+                ring.delta.erase(ring.delta.begin(), ring.delta.begin() + ring.delta_sent);
+                ring.delta_sent = 0;
+            }
+
+            slot.payload = &slot.data[0];
+            slot.payload_length = length;
+        } else if (ring.mapped_file != NULL) {
+            // Point the payload straight into the mapping
+            size_t offset = ring.packets_read * ring.data_size;
+            if (offset >= ring.mapped_size) {
+                ring.finished = true;
+                break;
+            }
+
+            slot.payload = ring.mapped_file + offset;
+            slot.payload_length = std::min((size_t)ring.data_size, ring.mapped_size - offset);
+        } else {
+            // Read the payload into the slot's own buffer
+            slot.data.resize(ring.data_size);
+            ring.file->read(&slot.data[0], ring.data_size);
+            if (ring.file->gcount() == 0) {
+                ring.finished = true;
+                break;
+            }
+
+            slot.payload = &slot.data[0];
+            slot.payload_length = ring.file->gcount();
+        }
+
+        slot.raw_length = slot.payload_length;
+        if (slot.raw_length < ring.data_size) {
+            ring.finished = true;
+        }
+
+        if (ring.compressed) {
+            slot.packed.resize(ring.payload_size);
+            slot.payload_length = pack_payload(ring.probe, slot.payload, slot.raw_length, &slot.packed[0]);
+            slot.payload = &slot.packed[0];
+        }
+
+        LOG_TRACE("[Info] Generating packets...");
+
+        build_packet_header(ring.packets_read, slot.payload, slot.payload_length, &slot.header_buffer[0]);
+        slot.header = &slot.header_buffer[0];
+
+        // Zeros standing in for a file that shrank must never go out
+        if (packet_ring_truncated(ring)) {
+            ring.finished = true;
+            break;
+        }
+
+        ring.packets_read++;
+    }
+
+    return sequence_before(packet_index, ring.packets_read);
+}
+
+
+// batch_packet_ring
+//
+//  Serve the files of a batch manifest one after another instead of a single file, returning
+//  the total size of the ones that exist. Every payload carries a block method, whether or
+//  not it is compressed, so frames can be told apart from file data even when parity
+//  rebuilds them.
+//
+uint64_t batch_packet_ring(packet_ring &ring, const std::vector<std::string> &manifest) {
+    ring.batch = true;
+    ring.batch_position = 0;
+    ring.payload_size = ring.data_size + BLOCK_METHOD_SIZE;
+
+    uint64_t total_size = 0;
+    for (const std::string &path : manifest) {
+        ring.batch_files.push_back({ path, -1, 0, "", 0, 0, false });
+
+        struct stat file_stat;
+        if (stat(path.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+            total_size += file_stat.st_size;
+        }
+    }
+
+    return total_size;
+}
+
+
+// open_batch_file
+//
+//  Open the next file of a batch as its frame goes out, working out how many packets follow.
+//  Files that cannot be read go out as a frame saying so, with no packets. Each file makes
+//  its own decision on whether compressing it is worth it.
+//
+void open_batch_file(packet_ring &ring, batch_file &file) {
+    file.fd = open(file.path.c_str(), O_RDONLY);
+
+    struct stat file_stat;
+    if (file.fd >= 0 && (fstat(file.fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode))) {
+        close(file.fd);
+        file.fd = -1;
+    }
+
+    if (file.fd < 0) {
+        LOG_ERROR("[Error] Received batch request for file " << file.path << " that does not exist");
+        return;
+    }
+
+    file.size = file_stat.st_size;
+    file.etag = file_etag(file_stat.st_ino, file_stat.st_size, file_stat.st_mtim);
+    file.packet_count = (file.size + ring.data_size - 1) / ring.data_size;
+
+    ring.probe = compression_probe();
+    ring.probe.skipped = !ring.compressed;
+
+    LOG_DEBUG("[Info] Sending " << file.path << " as packets " << file.frame_packet + 1 << " to " << file.frame_packet + file.packet_count);
+}
+
+
+// build_batch_frame
+//
+//  Write the frame packet announcing a file of a batch: a BLOCK_FRAME method followed by the
+//  file's index in the manifest, whether it exists, its size and its etag as NUL separated
+//  key=value options. Returns the payload length.
+//
+int build_batch_frame(const batch_file &file, size_t index, char payload[], int payload_size) {
+    std::string frame(1, BLOCK_FRAME);
+    frame += "file=" + std::to_string(index) + '\0';
+    frame += std::string("status=") + (file.fd >= 0 ? "ok" : "missing") + '\0';
+    if (file.fd >= 0) {
+        frame += "size=" + std::to_string(file.size) + '\0';
+        frame += "etag=" + file.etag + '\0';
+    }
+
+    int length = std::min((int)frame.size(), payload_size);
+    std::memcpy(payload, frame.data(), length);
+    return length;
+}
+
+
+// batch_packet_available
+//
+//  Read a batch ahead until the given packet is in the ring, returning false once the packet
+//  is past the last file. Each file is opened as its frame is built and closed as soon as
+//  its last packet is read, so a batch only ever holds one file open.
+//
+bool batch_packet_available(packet_ring &ring, uint32_t packet_index) {
+    while (!sequence_before(packet_index, ring.packets_read) && ring.batch_position < ring.batch_files.size()) {
+        batch_file &file = ring.batch_files[ring.batch_position];
+        packet_slot &slot = ring_packet(ring, ring.packets_read);
+        slot.packed.resize(ring.payload_size);
+
+        if (ring.packets_read == file.frame_packet) {
+            open_batch_file(ring, file);
+            slot.payload_length = build_batch_frame(file, ring.batch_position, &slot.packed[0], ring.payload_size);
+            slot.raw_length = 0;
+        } else {
+            uint64_t offset = (uint64_t)(ring.packets_read - file.frame_packet - 1) * ring.data_size;
+            slot.raw_length = std::min<uint64_t>(ring.data_size, file.size - offset);
+            slot.data.resize(ring.data_size);
+
+            // A file that shrank since its frame went out is never padded out, the client is
+            // told it failed instead
+            if (!file.aborted) {
+                ssize_t read_bytes = pread(file.fd, &slot.data[0], slot.raw_length, offset);
+                if (read_bytes < 0) {
+                    LOG_ERROR("[Error] Could not read " << file.path << ": " << strerror(errno) << ", aborting it");
+                    file.aborted = true;
+                } else if (read_bytes != slot.raw_length) {
+                    LOG_ERROR("[Error] " << file.path << " shrank while it was being sent, aborting it");
+                    file.aborted = true;
+                }
+            }
+
+            if (file.aborted) {
+                slot.raw_length = 0;
+                slot.packed[0] = BLOCK_ABORTED;
+                slot.payload_length = BLOCK_METHOD_SIZE;
+            } else {
+                slot.payload_length = pack_payload(ring.probe, &slot.data[0], slot.raw_length, &slot.packed[0]);
+            }
+        }
+
+        slot.payload = &slot.packed[0];
+        build_packet_header(ring.packets_read, slot.payload, slot.payload_length, &slot.header_buffer[0]);
+        slot.header = &slot.header_buffer[0];
+        ring.packets_read++;
+
+        // Move on to the next file once this one is read
+        if (ring.packets_read == file.frame_packet + 1 + file.packet_count) {
+            if (file.fd >= 0) {
+                close(file.fd);
+                file.fd = -1;
+            }
+            ring.batch_position++;
+            if (ring.batch_position < ring.batch_files.size()) {
+                ring.batch_files[ring.batch_position].frame_packet = ring.packets_read;
+            }
+        }
+    }
+
+    return sequence_before(packet_index, ring.packets_read);
+}
+
+
+// ring_packet
+//
+//  Get the stored packet for a packet index that is inside the current window
+//
+packet_slot &ring_packet(packet_ring &ring, uint32_t packet_index) {
+    return ring.slots[packet_index % ring.slots.size()];
+}
+
+
+// init_datagram_batch
+//
+//  Allocate buffers of buffer_size bytes and message headers for a batch of up to BATCH_SIZE
+//  datagrams
+//
+void init_datagram_batch(datagram_batch &batch, worker_stats *stats, int buffer_size) {
+    batch.buffers.assign(BATCH_SIZE, std::vector<char>(buffer_size));
+    batch.iovecs.assign(BATCH_SIZE * 2, iovec());
+    batch.messages.assign(BATCH_SIZE, mmsghdr());
+    batch.addresses.assign(BATCH_SIZE, sockaddr_in());
+    batch.stats = stats;
+    batch.impairment = NULL;
+    batch.buffer_size = buffer_size;
+    batch.count = 0;
+    batch.position = 0;
+
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        batch.messages[i].msg_hdr.msg_iov = &batch.iovecs[i * 2];
+    }
+}
+
+
+// flush_datagram_batch
+//
+//  Send every datagram queued in the batch with as few sendmmsg calls as possible
+//
+void flush_datagram_batch(int sd, datagram_batch &batch) {
+    int sent = 0;
+
+    while (sent < batch.count) {
+        int result = sendmmsg(sd, &batch.messages[sent], batch.count - sent, 0);
+        if (result <= 0) {
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("[Error] Failed to send " << batch.count - sent << " packets");
+            break;
+        }
+
+        if (batch.stats != NULL) {
+            uint64_t bytes = 0;
+            for (int i = sent; i < sent + result; i++) {
+                bytes += batch.messages[i].msg_len;
+            }
+            batch.stats->packets_sent.fetch_add(result, std::memory_order_relaxed);
+            batch.stats->bytes_sent.fetch_add(bytes, std::memory_order_relaxed);
+        }
+
+        sent += result;
+    }
+
+    batch.count = 0;
+}
+
+
+// next_datagram
+//
+//  Hand out the next datagram from the batch and the address it came from, refilling the
+//  batch with a single non-blocking recvmmsg when it runs dry. Returns NULL once the socket
+//  has nothing left.
+//
+char *next_datagram(int sd, datagram_batch &batch, int &length, struct sockaddr_in *&from) {
+    if (batch.position >= batch.count) {
+        for (int i = 0; i < BATCH_SIZE; i++) {
+            batch.iovecs[i * 2].iov_base = &batch.buffers[i][0];
+            batch.iovecs[i * 2].iov_len = batch.buffer_size;
+            batch.messages[i].msg_hdr.msg_iovlen = 1;
+            batch.messages[i].msg_hdr.msg_name = &batch.addresses[i];
+            batch.messages[i].msg_hdr.msg_namelen = sizeof(batch.addresses[i]);
+        }
+
+        batch.position = 0;
+        batch.count = recvmmsg(sd, &batch.messages[0], BATCH_SIZE, MSG_DONTWAIT, NULL);
+
+        if (batch.count <= 0) {
+            batch.count = 0;
+            return NULL;
+        }
+    }
+
+    int index = batch.position++;
+    length = batch.messages[index].msg_len;
+    from = &batch.addresses[index];
+
+    // Requests carry a NUL terminated filename, make sure a short datagram is terminated too
+    if (length < batch.buffer_size) {
+        empty_buffer(&batch.buffers[index][length], batch.buffer_size - length);
+    }
+
+    return &batch.buffers[index][0];
+}
+
+
+// queue_packet
+//
+//  Queue a stored packet, gathering the header and payload so the payload is never copied
+//
+void queue_packet(int sd, datagram_batch &batch, packet_slot &slot, struct sockaddr_in &to) {
+    struct iovec *packet_iov = &batch.iovecs[batch.count * 2];
+    struct msghdr &packet_msg = batch.messages[batch.count].msg_hdr;
+
+    packet_iov[0].iov_base = (void *)slot.header;
+    packet_iov[0].iov_len = HEADER_SIZE;
+    packet_iov[1].iov_base = (void *)slot.payload;
+    packet_iov[1].iov_len = slot.payload_length;
+    packet_msg.msg_iovlen = 2;
+    packet_msg.msg_name = &to;
+    packet_msg.msg_namelen = sizeof(to);
+    batch.count++;
+
+    if (batch.count == BATCH_SIZE) {
+        flush_datagram_batch(sd, batch);
+    }
+}
+
+
+// queue_datagram
+//
+//  Queue a copy of a datagram, for ones the impairment layer changed or held back
+//
+void queue_datagram(int sd, datagram_batch &batch, const char data[], int length, const struct sockaddr_in &to) {
+    struct iovec *packet_iov = &batch.iovecs[batch.count * 2];
+    struct msghdr &packet_msg = batch.messages[batch.count].msg_hdr;
+
+    std::memcpy(&batch.buffers[batch.count][0], data, length);
+    batch.addresses[batch.count] = to;
+    packet_iov[0].iov_base = &batch.buffers[batch.count][0];
+    packet_iov[0].iov_len = length;
+    packet_msg.msg_iovlen = 1;
+    packet_msg.msg_name = &batch.addresses[batch.count];
+    packet_msg.msg_namelen = sizeof(to);
+    batch.count++;
+
+    if (batch.count == BATCH_SIZE) {
+        flush_datagram_batch(sd, batch);
+    }
+}
+
+
+// transmit_packet
+//
+//  Run one of the session's stored packets through the impairment layer and queue whatever
+//  survives for the client
+//
+void transmit_packet(int sd, datagram_batch &batch, transfer_session &session, uint32_t packet_index) {
+    transmit_slot(sd, batch, session, ring_packet(session.ring, packet_index), "packet", packet_index);
+}
+
+
+// transmit_slot
+//
+//  Run a packet through the impairment layer and queue whatever survives for the client,
+//  naming it in log lines by kind and number
+//
+void transmit_slot(int sd, datagram_batch &batch, transfer_session &session, packet_slot &slot, const char *kind, uint32_t number) {
+    transfer_metrics &metrics = *session.metrics;
+    int packet_length = HEADER_SIZE + slot.payload_length;
+
+    // Without impairment the packet goes straight out
+    if (batch.impairment == NULL || !batch.impairment->enabled) {
+        mark_first_byte(metrics);
+        metric_add(metrics.bytes_sent, packet_length);
+        metric_add(metrics.segments_sent, 1);
+        queue_packet(sd, batch, slot, session.client);
+        LOG_TRACE("[Info] Successfully sent " << kind << " " << number);
+        return;
+    }
+
+    impairment_engine &impairment = *batch.impairment;
+    impairment_verdict verdict = impair_datagram(impairment);
+
+    if (verdict.drop) {
+        LOG_DEBUG("[Gremlin] Dropped " << kind << " " << number << (verdict.burst ? " in a loss burst" : ""));
+        metric_add(metrics.gremlin_drops, 1);
+        return;
+    }
+
+    mark_first_byte(metrics);
+    metric_add(metrics.bytes_sent, packet_length);
+    metric_add(metrics.segments_sent, 1);
+
+    // A duplicate goes out untouched straight away, as if the link repeated the datagram
+    if (verdict.duplicate) {
+        LOG_DEBUG("[Gremlin] Duplicated " << kind << " " << number);
+        metric_add(metrics.gremlin_duplicates, 1);
+        queue_packet(sd, batch, slot, session.client);
+    }
+
+    if (verdict.damaged_bytes > 0) {
+        LOG_DEBUG("[Gremlin] Damaged " << verdict.damaged_bytes << " bytes of " << kind << " " << number);
+        metric_add(metrics.gremlin_corruptions, 1);
+    }
+
+    if (verdict.hold_us > 0) {
+        // Held packets go out later from the timer wheel, everything behind them keeps moving
+        LOG_DEBUG("[Gremlin] " << (verdict.delayed ? "Delayed" : "Reordered") << " " << kind << " " << number
+                  << " by " << verdict.hold_us << " us");
+        metric_add(verdict.delayed ? metrics.gremlin_delays : metrics.gremlin_reorders, 1);
+
+        char *held = hold_datagram(impairment, slot.header, HEADER_SIZE, slot.payload, slot.payload_length, session.client, verdict.hold_us);
+        damage_datagram(impairment, held, packet_length, verdict.damaged_bytes);
+    } else if (verdict.damaged_bytes > 0) {
+        // Damage has to be done on a private copy so the stored packet stays intact
+        impairment.scratch.resize(packet_length);
+        std::memcpy(&impairment.scratch[0], slot.header, HEADER_SIZE);
+        std::memcpy(&impairment.scratch[HEADER_SIZE], slot.payload, slot.payload_length);
+        damage_datagram(impairment, &impairment.scratch[0], packet_length, verdict.damaged_bytes);
+        queue_datagram(sd, batch, &impairment.scratch[0], packet_length, session.client);
+    } else {
+        queue_packet(sd, batch, slot, session.client);
+    }
+
+    LOG_TRACE("[Info] Successfully sent " << kind << " " << number);
+}
+
+
+// release_held_datagrams
+//
+//  Queue every datagram the impairment layer held back that is now due
+//
+void release_held_datagrams(int sd, datagram_batch &batch) {
+    if (batch.impairment == NULL || batch.impairment->held_count == 0) {
+        return;
+    }
+
+    release_datagrams(*batch.impairment, [&](const char data[], int length, const struct sockaddr_in &to) {
+        queue_datagram(sd, batch, data, length, to);
+    });
+}
+
+
+// probe_path_mtu
+//
+//  Ask the kernel for the path MTU towards an address, returning 0 if it does not know.
+//  Connecting a throwaway socket with fragmentation disabled gives us the route's MTU, or
+//  the smaller one learned from ICMP if the path has reported one.
+//
+int probe_path_mtu(const struct sockaddr_in &peer) {
+    int probe_sd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (probe_sd < 0) {
+        return 0;
+    }
+
+    int path_mtu = 0;
+    int discover = IP_PMTUDISC_DO;
+    socklen_t mtu_length = sizeof(path_mtu);
+
+    setsockopt(probe_sd, IPPROTO_IP, IP_MTU_DISCOVER, &discover, sizeof(discover));
+    if (connect(probe_sd, (const struct sockaddr *)&peer, sizeof(peer)) < 0 ||
+        getsockopt(probe_sd, IPPROTO_IP, IP_MTU, &path_mtu, &mtu_length) < 0) {
+        path_mtu = 0;
+    }
+
+    close(probe_sd);
+    return path_mtu;
+}
+
+
+// open_worker_socket
+//
+//  Create a non-blocking UDP socket bound to SERV_PORT with SO_REUSEPORT, so every worker
+//  gets its own socket and the kernel spreads clients across them. Returns -1 if it cannot.
+//
+int open_worker_socket() {
+    int sd;
+    struct sockaddr_in server;
+
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(INADDR_ANY);
+    server.sin_port = htons(SERV_PORT);
+
+    sd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sd < 0) {
+        LOG_ERROR("[Error] Could not create a socket: " << strerror(errno));
+        return -1;
+    }
+
+    // Without SO_REUSEPORT only the first worker could bind the port
+    int reuse_port = 1;
+    if (setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &reuse_port, sizeof(reuse_port)) < 0) {
+        LOG_ERROR("[Error] Could not share port " << SERV_PORT << " between workers: " << strerror(errno));
+        close(sd);
+        return -1;
+    }
+
+    // Bind the server to the socket
+    if (bind(sd, (struct sockaddr *)&server, sizeof(server)) < 0) {
+        LOG_ERROR("[Error] Could not bind to port " << SERV_PORT << ": " << strerror(errno));
+        close(sd);
+        return -1;
+    }
+
+    return sd;
+}
+
+
+// run_worker
+//
+//  Event loop for one worker, serving every client the kernel hashes to its socket sd until
+//  the shutdown eventfd fires, then closing the socket
+//
+void run_worker(int worker_id, int sd, worker_stats &stats, int shutdown_fd) {
+
+    // Wake up whenever a datagram arrives, the next session timer expires, or we are shut down
+    int epoll_fd = epoll_create1(0);
+    struct epoll_event socket_event;
+    socket_event.events = EPOLLIN;
+    socket_event.data.fd = sd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sd, &socket_event);
+
+    struct epoll_event shutdown_event;
+    shutdown_event.events = EPOLLIN;
+    shutdown_event.data.fd = shutdown_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, shutdown_fd, &shutdown_event);
+
+    // Every transfer in progress, and every upload for a request still arriving, keyed by
+    // its client's address
+    std::map<uint64_t, std::unique_ptr<transfer_session>> sessions;
+    std::map<uint64_t, pending_upload> uploads;
+
+    // Datagrams come in and packets go out a batch at a time for all sessions together
+    datagram_batch receive_batch;
+    datagram_batch packet_batch;
+    init_datagram_batch(receive_batch, &stats, SEGMENT_SIZE);
+    init_datagram_batch(packet_batch, &stats, MAX_SEGMENT_SIZE);
+
+    // Outgoing packets pass through this worker's own impairment engine
+    impairment_engine impairment;
+    init_impairment(impairment, impairment_config, worker_id);
+    packet_batch.impairment = &impairment;
+
+    // Poll for requests and responses from the clients until we are shut down
+    while (true) {
+
+        // Sleep until a datagram arrives or the earliest session timer expires. Adaptive
+        // timeouts can be well under a millisecond, so wait with nanosecond resolution.
+        int64_t wait_ns = -1;
+        auto now = std::chrono::steady_clock::now();
+        for (auto &entry : sessions) {
+            int64_t remaining = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(entry.second->next_deadline - now).count());
+            if (wait_ns < 0 || remaining < wait_ns) {
+                wait_ns = remaining;
+            }
+        }
+
+        // Also wake when the next held datagram is due
+        if (impairment.held_count > 0) {
+            int64_t remaining = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(next_release_time(impairment) - now).count());
+            if (wait_ns < 0 || remaining < wait_ns) {
+                wait_ns = remaining;
+            }
+        }
+
+        struct timespec wait_time;
+        wait_time.tv_sec = wait_ns / 1000000000;
+        wait_time.tv_nsec = wait_ns % 1000000000;
+
+        struct epoll_event ready_events[2];
+        int ready_count = epoll_pwait2(epoll_fd, ready_events, 2, wait_ns < 0 ? NULL : &wait_time, NULL);
+
+        bool shutting_down = false;
+        for (int i = 0; i < ready_count; i++) {
+            shutting_down |= ready_events[i].data.fd == shutdown_fd;
+        }
+
+        if (shutting_down) {
+            break;
+        }
+
+        // Demultiplex every waiting datagram to the session for its client's address
+        char *message_buffer;
+        int n;
+        struct sockaddr_in *sender;
+
+        while ((message_buffer = next_datagram(sd, receive_batch, n, sender)) != NULL) {
+            stats.datagrams_received.fetch_add(1, std::memory_order_relaxed);
+
+            // Pull the instruction out of the message buffer into the instruction buffer
+            char instruction_buffer[4];
+            std::copy(message_buffer, message_buffer+4, instruction_buffer);
+            instruction_buffer[3] = '\0';
+
+            auto existing = sessions.find(session_key(*sender));
+
+            // Check if the instruction is a GET request
+            if (n > 4 && strcmp(instruction_buffer, GET_INSTR) == 0) {
+
+                // A new request from the same client replaces its old transfer
+                if (existing != sessions.end()) {
+                    flush_datagram_batch(sd, packet_batch);
+                    publish_transfer_metrics(*existing->second, "replaced");
+                    release_packet_ring(existing->second->ring);
+                    sessions.erase(existing);
+                }
+
+                // Whatever the client uploaded ahead of the request goes with it
+                pending_upload upload = {};
+                auto uploaded = uploads.find(session_key(*sender));
+                if (uploaded != uploads.end()) {
+                    upload = std::move(uploaded->second);
+                    uploads.erase(uploaded);
+                }
+
+                std::unique_ptr<transfer_session> session = start_session(sd, message_buffer, n, *sender, stats, upload);
+                if (session) {
+                    stats.sessions_started.fetch_add(1, std::memory_order_relaxed);
+                    sessions[session_key(*sender)] = std::move(session);
+                }
+
+            } else if (n > 4 && (strcmp(instruction_buffer, BAT_INSTR) == 0 || strcmp(instruction_buffer, SIG_INSTR) == 0)) {
+
+                // Part of the manifest of a batch, or of the block signatures for a delta, the
+                // client is about to ask for
+                store_upload_part(uploads[session_key(*sender)], message_buffer, n);
+
+            } else if (n == RESPONSE_SIZE && existing != sessions.end()) {
+
+                // ACK or NAK for a transfer in progress
+                handle_response(sd, packet_batch, *existing->second, message_buffer);
+            }
+        }
+
+        // Let every session put new packets on the wire and handle its expired timers
+        for (auto &entry : sessions) {
+            service_session(sd, packet_batch, *entry.second);
+        }
+
+        release_held_datagrams(sd, packet_batch);
+        flush_datagram_batch(sd, packet_batch);
+
+        // Finish completed transfers and drop sessions whose client went away
+        now = std::chrono::steady_clock::now();
+        for (auto entry = sessions.begin(); entry != sessions.end(); ) {
+            transfer_session &session = *entry->second;
+            bool finished = session_finished(session);
+
+            if (packet_ring_truncated(session.ring)) {
+                LOG_ERROR("[Error] " << session.filename << " shrank while it was being sent, abandoning transfer");
+                publish_transfer_metrics(session, "failed");
+                release_packet_ring(session.ring);
+                stats.sessions_abandoned.fetch_add(1, std::memory_order_relaxed);
+                entry = sessions.erase(entry);
+            } else if (finished) {
+                finish_session(sd, session);
+                stats.sessions_finished.fetch_add(1, std::memory_order_relaxed);
+                entry = sessions.erase(entry);
+            } else if (now - session.last_response_time > std::chrono::microseconds(SESSION_IDLE_TIMEOUT_US)) {
+                LOG_ERROR("[Error] Client for " << session.filename << " stopped responding, abandoning transfer");
+                publish_transfer_metrics(session, "abandoned");
+                release_packet_ring(session.ring);
+                stats.sessions_abandoned.fetch_add(1, std::memory_order_relaxed);
+                entry = sessions.erase(entry);
+            } else {
+                ++entry;
+            }
+        }
+
+        // Forget uploads whose GET never came
+        for (auto entry = uploads.begin(); entry != uploads.end(); ) {
+            if (now - entry->second.updated > std::chrono::microseconds(SESSION_IDLE_TIMEOUT_US)) {
+                entry = uploads.erase(entry);
+            } else {
+                ++entry;
+            }
+        }
+    }
+
+    // Transfers still running when we shut down never finish
+    for (auto &entry : sessions) {
+        publish_transfer_metrics(*entry.second, "interrupted");
+        release_packet_ring(entry.second->ring);
+    }
+
+    close(epoll_fd);
+    close(sd);
+}
+
+
+// report_worker_stats
+//
+//  Print each worker's counters, with rates over the interval since the previous report
+//
+void report_worker_stats(std::vector<worker_stats> &stats, std::vector<uint64_t> &last_packets_sent, double interval_sec) {
+    for (size_t i = 0; i < stats.size(); i++) {
+        uint64_t packets_sent = stats[i].packets_sent.load(std::memory_order_relaxed);
+
+        uint64_t packet_rate = interval_sec > 0 ? (packets_sent - last_packets_sent[i]) / interval_sec : 0;
+
+        LOG_INFO("[Stats] Worker " << i << ": "
+                 << stats[i].sessions_started.load(std::memory_order_relaxed) << " sessions started, "
+                 << stats[i].sessions_finished.load(std::memory_order_relaxed) << " finished, "
+                 << stats[i].sessions_abandoned.load(std::memory_order_relaxed) << " abandoned, "
+                 << stats[i].datagrams_received.load(std::memory_order_relaxed) << " datagrams received, "
+                 << packets_sent << " packets sent"
+                 << " (" << stats[i].bytes_sent.load(std::memory_order_relaxed) << " bytes, "
+                 << stats[i].retransmissions.load(std::memory_order_relaxed) << " retransmissions)"
+                 << (interval_sec > 0 ? ", " : "") << (interval_sec > 0 ? std::to_string(packet_rate) + " packets/s" : ""));
+
+        last_packets_sent[i] = packets_sent;
+    }
+}
+
+
+// server_stats_json
+//
+//  Every worker's counters, the packet cache's and the metrics of every transfer in progress,
+//  as one JSON object
+//
+std::string server_stats_json(std::vector<worker_stats> &stats) {
+    std::string json = "{\"workers\":[";
+
+    for (size_t i = 0; i < stats.size(); i++) {
+        json += (i > 0 ? ",{" : "{");
+        json += "\"sessions_started\":" + std::to_string(stats[i].sessions_started.load(std::memory_order_relaxed));
+        json += ",\"sessions_finished\":" + std::to_string(stats[i].sessions_finished.load(std::memory_order_relaxed));
+        json += ",\"sessions_abandoned\":" + std::to_string(stats[i].sessions_abandoned.load(std::memory_order_relaxed));
+        json += ",\"datagrams_received\":" + std::to_string(stats[i].datagrams_received.load(std::memory_order_relaxed));
+        json += ",\"packets_sent\":" + std::to_string(stats[i].packets_sent.load(std::memory_order_relaxed));
+        json += ",\"bytes_sent\":" + std::to_string(stats[i].bytes_sent.load(std::memory_order_relaxed));
+        json += ",\"retransmissions\":" + std::to_string(stats[i].retransmissions.load(std::memory_order_relaxed)) + "}";
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(file_cache.mutex);
+        json += "],\"cache\":{\"files\":" + std::to_string(file_cache.entries.size());
+        json += ",\"bytes\":" + std::to_string(file_cache.used_bytes);
+    }
+    json += ",\"hits\":" + std::to_string(file_cache.hits.load(std::memory_order_relaxed));
+    json += ",\"misses\":" + std::to_string(file_cache.misses.load(std::memory_order_relaxed));
+    json += ",\"evictions\":" + std::to_string(file_cache.evictions.load(std::memory_order_relaxed));
+
+    json += "},\"transfers\":[";
+
+    std::lock_guard<std::mutex> lock(live_transfers_mutex);
+    bool first = true;
+    for (const std::shared_ptr<transfer_metrics> &metrics : live_transfers) {
+        json += (first ? "" : ",") + transfer_metrics_json(*metrics, "active");
+        first = false;
+    }
+
+    return json + "]}";
+}
+
+
+// session_key
+//
+//  Identify a session by its client's IPv4 address and port
+//
+uint64_t session_key(const struct sockaddr_in &client) {
+    return ((uint64_t)ntohl(client.sin_addr.s_addr) << 16) | ntohs(client.sin_port);
+}
+
+
+// store_upload_part
+//
+//  Keep one part of what a client uploads ahead of its GET until the GET arrives. A part
+//  holds its number and the number of parts as 32-bit numbers after the instruction, then
+//  its share of the upload. A part of another instruction, or saying the upload has a
+//  different number of parts, starts a new upload.
+//
+void store_upload_part(pending_upload &upload, char message_buffer[], int n) {
+    int contents_start = 4 + 2 * PACKET_COUNT_SIZE;
+    if (n < contents_start) {
+        return;
+    }
+
+    std::string instruction(message_buffer, INSTRUCTION_SIZE);
+    uint32_t part = buffToUint32(message_buffer + 4);
+    uint32_t part_count = buffToUint32(message_buffer + 4 + PACKET_COUNT_SIZE);
+    if (part_count == 0 || part_count > (uint32_t)MAX_UPLOAD_PARTS || part >= part_count) {
+        return;
+    }
+
+    if (upload.instruction != instruction || upload.parts.size() != part_count) {
+        upload.instruction = instruction;
+        upload.parts.assign(part_count, std::string());
+        upload.received.assign(part_count, false);
+        upload.received_count = 0;
+    }
+    upload.updated = std::chrono::steady_clock::now();
+
+    if (upload.received[part]) {
+        return;
+    }
+
+    upload.parts[part].assign(message_buffer + contents_start, n - contents_start);
+    upload.received[part] = true;
+    upload.received_count++;
+}
+
+
+// upload_contents
+//
+//  Put together what the client uploaded for its GET, returning false unless it is what the
+//  instruction names and every part of it arrived
+//
+bool upload_contents(const pending_upload &upload, const char instruction[], std::string &contents) {
+    if (upload.instruction != instruction || upload.parts.empty() || upload.received_count != upload.parts.size()) {
+        return false;
+    }
+
+    contents.clear();
+    for (const std::string &part : upload.parts) {
+        contents += part;
+    }
+    return true;
+}
+
+
+// parse_manifest
+//
+//  Split an uploaded batch manifest into its NUL terminated paths. Parts may end in padding
+//  NULs, which are not paths.
+//
+std::vector<std::string> parse_manifest(const std::string &contents) {
+    std::vector<std::string> paths;
+    size_t position = 0;
+
+    while (position < contents.size()) {
+        size_t end = contents.find('\0', position);
+        if (end == std::string::npos) {
+            end = contents.size();
+        }
+        if (end > position) {
+            paths.push_back(contents.substr(position, end - position));
+        }
+        position = end + 1;
+    }
+
+    return paths;
+}
+
+
+// parse_signatures
+//
+//  Read the block signatures of an uploaded delta request, each a 32-bit rolling checksum
+//  followed by a 64-bit strong hash
+//
+std::vector<delta_signature> parse_signatures(const std::string &contents) {
+    std::vector<delta_signature> signatures(contents.size() / DELTA_SIGNATURE_SIZE);
+
+    for (size_t i = 0; i < signatures.size(); i++) {
+        const char *signature = contents.data() + i * DELTA_SIGNATURE_SIZE;
+        memcpy(&signatures[i].rolling, signature, sizeof(signatures[i].rolling));
+        memcpy(&signatures[i].strong, signature + sizeof(signatures[i].rolling), sizeof(signatures[i].strong));
+    }
+
+    return signatures;
+}
+
+
+// start_session
+//
+//  Answer a GET request, returning a new session for the client if the file exists or NULL
+//  after NAKing the request if it does not. Batch requests send the files of the manifest
+//  the client uploaded before, delta requests the delta from the block signatures it
+//  uploaded.
+//
+std::unique_ptr<transfer_session> start_session(int sd, char message_buffer[], int n, struct sockaddr_in &client, worker_stats &stats,
+                                                const pending_upload &upload) {
+    auto request_time = std::chrono::steady_clock::now();
+
+    // Copy the file name from the request to the filename char buffer
+    char filename_buffer[SEGMENT_SIZE - INSTRUCTION_SIZE];
+    std::copy(message_buffer+4, message_buffer+SEGMENT_SIZE, filename_buffer);
+
+    // Cast the buffer to a std::string
+    std::string target_filename = std::string(filename_buffer);
+
+    // Any transfer options follow the filename's NUL terminator
+    int options_start = 4 + target_filename.length() + 1;
+    std::map<std::string, std::string> request_options;
+    if (n > options_start) {
+        request_options = parse_request_options(message_buffer + options_start, n - options_start);
+    }
+
+    // Batch requests name no file, only how many the manifest holds
+    bool batch = !request_options["batch"].empty();
+    if (batch) {
+        target_filename = "batch of " + request_options["batch"] + " files";
+    }
+
+    std::unique_ptr<transfer_session> session(new transfer_session());
+    session->client = client;
+    session->stats = &stats;
+    session->filename = target_filename;
+    session->selective_repeat = request_options["mode"] == "sr";
+
+    // Use the largest window both sides can handle
+    session->window_size = MAX_WINDOW_SIZE;
+    if (!request_options["win"].empty()) {
+        session->window_size = std::max(1, std::min(MAX_WINDOW_SIZE, std::atoi(request_options["win"].c_str())));
+    }
+
+    // Let the client answer several packets with one cumulative ACK if it asked to, holding
+    // one back for no longer than it said
+    session->ack_every = std::max(1, std::min(std::min(MAX_ACK_EVERY, session->window_size), std::atoi(request_options["ack_every"].c_str())));
+    int ack_delay_us = std::max(0, std::min(MAX_ACK_DELAY_US, std::atoi(request_options["ack_delay"].c_str())));
+
+    // Use the biggest segment the client asked for that we allow and the path can carry
+    // without fragmenting, but never less than the segment size every host accepts
+    session->segment_size = SEGMENT_SIZE;
+    if (!request_options["seg"].empty()) {
+        int segment_limit = MAX_SEGMENT_SIZE;
+        int path_mtu = PMTU_DISCOVERY ? probe_path_mtu(client) : 0;
+        if (path_mtu > 0) {
+            segment_limit = std::min(segment_limit, path_mtu - IP_UDP_HEADER_SIZE);
+        }
+        session->segment_size = std::max(SEGMENT_SIZE, std::min(segment_limit, std::atoi(request_options["seg"].c_str())));
+    }
+
+    // Clients speaking an older revision would misread our 32-bit packet numbers
+    if (std::atoi(request_options["ver"].c_str()) != PROTOCOL_VERSION) {
+        LOG_ERROR("[Error] Received request using unsupported protocol version '" << request_options["ver"] << "'");
+        sendto(sd, NAK_INSTR, 4, 0, (struct sockaddr*)&client, sizeof(client));
+        return NULL;
+    }
+
+    session->congestion = make_congestion_control(CONGESTION_CONTROL, session->window_size);
+    if (session->congestion == NULL) {
+        sendto(sd, NAK_INSTR, 4, 0, (struct sockaddr*)&client, sizeof(client));
+        return NULL;
+    }
+
+    // Every part of a batch's manifest has to be in, or packets lost on the way would leave
+    // the batch short of files
+    std::string upload_data;
+    std::vector<std::string> manifest;
+    if (batch && upload_contents(upload, BAT_INSTR, upload_data)) {
+        manifest = parse_manifest(upload_data);
+    }
+    if (batch && (manifest.empty() || request_options["batch"] != std::to_string(manifest.size()))) {
+        LOG_ERROR("[Error] Received request for a " << target_filename << " without all of its manifest");
+        sendto(sd, NAK_INSTR, 4, 0, (struct sockaddr*)&client, sizeof(client));
+        return NULL;
+    }
+
+    // A delta needs the signature of every block of the client's copy, without them the
+    // client gets all of the file
+    int delta_block = std::atoi(request_options["delta"].c_str());
+    std::vector<delta_signature> signatures;
+    bool delta = !batch && !request_options["delta"].empty();
+    if (delta) {
+        uint64_t signatures_size = strtoull(request_options["delta_blocks"].c_str(), NULL, 10) * DELTA_SIGNATURE_SIZE;
+        if (delta_block >= MIN_DELTA_BLOCK && delta_block <= MAX_DELTA_BLOCK && upload_contents(upload, SIG_INSTR, upload_data) &&
+            upload_data.size() == signatures_size) {
+            signatures = parse_signatures(upload_data);
+        } else {
+            LOG_ERROR("[Error] Received delta request for " << target_filename << " without all of its block signatures, sending all of it");
+            delta = false;
+        }
+    }
+
+    // Packets of a transfer with forward error correction leave room in the segment for
+    // parity packets to code their payload length, and compressed or batch ones for the
+    // block method
+    int fec_scheme = fec_scheme_from_name(request_options["fec"]);
+    bool compressed = BLOCK_COMPRESSION && request_options["comp"] == "lz";
+    int data_size = session->segment_size - HEADER_SIZE - (fec_scheme != FEC_NONE ? FEC_OVERHEAD : 0) - (compressed || batch ? BLOCK_METHOD_SIZE : 0);
+
+    // Serve the file from the packet cache when it can be, which needs no file I/O at all
+    // once the file is cached. Batches read each of their files as they go, and deltas are
+    // built for the one client.
+    init_packet_ring(session->ring, session->file, session->window_size, data_size, compressed);
+    bool cached = !batch && !delta && cache_packet_ring(session->ring, target_filename);
+    uint64_t batch_size = batch ? batch_packet_ring(session->ring, manifest) : 0;
+    init_fec(*session, fec_scheme, std::atoi(request_options["fec_block"].c_str()), std::atoi(request_options["fec_parity"].c_str()));
+
+    // Otherwise open the targe file
+    if (!cached && !batch) {
+        session->file.open(target_filename.c_str(), std::ios_base::binary);
+    }
+
+    // Check if the file exists
+    if (!cached && !batch && !session->file) {
+
+        // File does not exist, send a NAK packet to the client
+        LOG_ERROR("[Error] Received request for file " << target_filename << " that does not exist");
+        sendto(sd, NAK_INSTR, 4, 0, (struct sockaddr*)&client, sizeof(client));
+        return NULL;
+    }
+
+    // Which version of the file we are sending, so clients resuming a download can tell
+    // whether what they already have still matches it
+    struct stat file_stat = {};
+    if (cached) {
+        const packetized_file &cached_file = *session->ring.cached_file;
+        file_stat.st_ino = cached_file.inode;
+        file_stat.st_size = cached_file.size;
+        file_stat.st_mtim = cached_file.modified;
+    } else if (!batch) {
+        stat(target_filename.c_str(), &file_stat);
+    }
+    std::string etag = file_etag(file_stat.st_ino, file_stat.st_size, file_stat.st_mtim);
+
+    // Work out the delta from the client's copy to ours, sending all of the file if it
+    // cannot be read for it
+    if (delta && !delta_packet_ring(session->ring, target_filename, delta_block, std::move(signatures))) {
+        delta = false;
+    }
+
+    // Send only the range the client asked for, as whole packets, unless the file changed
+    // since the client got the rest of it. Blocks of forward error correction start on a
+    // multiple of the block size, so a range starts on one too.
+    uint64_t first_byte = 0, end_byte = UINT64_MAX;
+    bool ranged = !batch && !delta && requested_range(request_options, data_size, first_byte, end_byte);
+    if (ranged && !request_options["if_etag"].empty() && request_options["if_etag"] != etag) {
+        LOG_INFO("[Info] " << target_filename << " changed since the client asked for its range, sending all of it");
+        ranged = false;
+        first_byte = 0;
+        end_byte = UINT64_MAX;
+    }
+
+    uint32_t first_packet = std::min<uint64_t>(first_byte / data_size, UINT32_MAX);
+    uint64_t end_packet = std::min<uint64_t>(end_byte / data_size + (end_byte % data_size != 0), UINT32_MAX);
+    if (session->fec_scheme != FEC_NONE) {
+        first_packet -= first_packet % session->fec_block;
+    }
+
+    // Clients only asking about the file, before splitting it up between several transfers,
+    // get the reply and then straight away the terminator
+    bool head_only = request_options["head"] == "1";
+    if (head_only) {
+        end_packet = first_packet;
+    }
+
+    // Send an ACK packet to the client, echoing back the options we agreed to
+    char ack_response[SEGMENT_SIZE];
+    empty_buffer(ack_response, SEGMENT_SIZE);
+    std::memcpy(ack_response, ACK_INSTR, 4);
+    int ack_length = 4;
+    if (session->selective_repeat) {
+        ack_length = append_option(ack_response, ack_length, "mode=sr");
+    }
+    ack_length = append_option(ack_response, ack_length, "win=" + std::to_string(session->window_size));
+    ack_length = append_option(ack_response, ack_length, "seg=" + std::to_string(session->segment_size));
+    if (session->fec_scheme != FEC_NONE) {
+        ack_length = append_option(ack_response, ack_length, std::string("fec=") + fec_scheme_name(session->fec_scheme));
+        ack_length = append_option(ack_response, ack_length, "fec_block=" + std::to_string(session->fec_block));
+        ack_length = append_option(ack_response, ack_length, "fec_parity=" + std::to_string(session->fec_parity));
+    }
+    if (compressed) {
+        ack_length = append_option(ack_response, ack_length, "comp=lz");
+    }
+    if (session->ack_every > 1) {
+        ack_length = append_option(ack_response, ack_length, "ack_every=" + std::to_string(session->ack_every));
+        ack_length = append_option(ack_response, ack_length, "ack_delay=" + std::to_string(ack_delay_us));
+    }
+    if (batch) {
+        ack_length = append_option(ack_response, ack_length, "batch=" + std::to_string(manifest.size()));
+    } else {
+        ack_length = append_option(ack_response, ack_length, "size=" + std::to_string(file_stat.st_size));
+        ack_length = append_option(ack_response, ack_length, "etag=" + etag);
+    }
+    if (delta) {
+        ack_length = append_option(ack_response, ack_length, "delta=" + std::to_string(delta_block));
+    }
+    if (ranged) {
+        ack_length = append_option(ack_response, ack_length, "start=" + std::to_string(first_packet));
+    }
+    if (ranged && end_byte != UINT64_MAX) {
+        ack_length = append_option(ack_response, ack_length, "end=" + std::to_string(end_packet));
+    }
+    sendto(sd, ack_response, ack_length + 1, 0, (struct sockaddr*)&client, sizeof(client));
+
+    LOG_INFO("[Info] Started " << (session->selective_repeat ? "Selective Repeat" : "Go-Back-N")
+             << " transfer of " << target_filename << " to " << inet_ntoa(client.sin_addr)
+             << ":" << ntohs(client.sin_port) << " with " << session->segment_size << " byte segments");
+    if (session->fec_scheme != FEC_NONE) {
+        LOG_INFO("[Info] Following every " << session->fec_block << " packets with " << session->fec_parity << " "
+                 << fec_scheme_name(session->fec_scheme) << " parity packets");
+    }
+    if (compressed) {
+        LOG_INFO("[Info] Compressing packets that get smaller for it");
+    }
+    if (session->ack_every > 1) {
+        LOG_INFO("[Info] Client answers up to " << session->ack_every << " packets with one ACK, holding it back up to "
+                 << ack_delay_us << " us");
+    }
+    if (delta) {
+        LOG_INFO("[Info] Sending " << target_filename << " as a delta against the " << session->ring.encoder->signatures.size()
+                 << " blocks of the client's copy");
+    }
+    if (head_only) {
+        LOG_INFO("[Info] Sending only the size and etag of " << target_filename);
+    } else if (ranged) {
+        LOG_INFO("[Info] Sending " << target_filename << " from packet " << first_packet
+                 << (end_byte != UINT64_MAX ? " up to packet " + std::to_string(end_packet) : std::string()));
+    }
+
+    // File requested exists, stream all of the packets for the file
+    if (cached) {
+        LOG_DEBUG("[Info] Sending " << target_filename << " from the packet cache");
+    } else if (!batch && !delta && ZERO_COPY_SEND && map_packet_ring(session->ring, target_filename)) {
+        LOG_INFO("[Info] Sending " << target_filename << " from a memory mapping");
+    }
+    seek_packet_ring(session->ring, first_packet, end_packet);
+
+    session->start_packet = first_packet;
+    session->window_base = first_packet;
+    session->packet_index = first_packet;
+    session->highest_sent = first_packet;
+    session->last_fast_retransmit = -1;
+    session->packet_acked.assign(session->ring.slots.size(), false);
+    session->packet_retransmitted.assign(session->ring.slots.size(), false);
+    session->packet_sent_time.assign(session->ring.slots.size(), std::chrono::steady_clock::now());
+    session->base_sent_time = session->last_response_time = session->next_deadline = std::chrono::steady_clock::now();
+    init_rtt_estimator(session->rtt);
+    session->rtt.ack_delay_us = session->ack_every > 1 ? ack_delay_us : 0;
+    session->recovery_point = first_packet;
+    session->next_send_time = std::chrono::steady_clock::now();
+
+    // Time to first byte counts from the request, goodput over the whole range
+    session->metrics = std::make_shared<transfer_metrics>();
+    session->metrics->role = "server";
+    session->metrics->filename = target_filename;
+    session->metrics->peer = std::string(inet_ntoa(client.sin_addr)) + ":" + std::to_string(ntohs(client.sin_port));
+    session->metrics->mode = session->selective_repeat ? "sr" : "gbn";
+    session->metrics->segment_size = session->segment_size;
+    if (session->fec_scheme != FEC_NONE) {
+        session->metrics->fec = std::string(fec_scheme_name(session->fec_scheme)) + ":" + std::to_string(session->fec_block)
+                                + "+" + std::to_string(session->fec_parity);
+    }
+    if (compressed) {
+        session->metrics->compression = "lz";
+    }
+    if (ranged) {
+        session->metrics->range = std::to_string((uint64_t)first_packet * data_size) + "-"
+                                  + (end_byte != UINT64_MAX ? std::to_string(end_packet * data_size - 1) : std::string());
+    }
+    session->metrics->start_time = request_time;
+    uint64_t file_size = batch ? batch_size : (delta ? session->ring.delta_length : file_stat.st_size);
+    session->metrics->file_bytes.store(std::min(file_size, end_packet * data_size) - std::min(file_size, (uint64_t)first_packet * data_size),
+                                       std::memory_order_relaxed);
+
+    {
+        std::lock_guard<std::mutex> lock(live_transfers_mutex);
+        live_transfers.insert(session->metrics);
+    }
+
+    return session;
+}
+
+
+// finish_session
+//
+//  Send the terminator marking the end of transmission and release the session's file
+//
+void finish_session(int sd, transfer_session &session) {
+    if (session.ring.encoder != NULL) {
+        LOG_INFO("[Info] Sent " << session.filename << " as a " << session.ring.delta_length << " byte delta, the client copying "
+                 << session.ring.encoder->copied << " of the " << session.ring.encoder->size << " bytes from its own copy");
+    }
+    release_packet_ring(session.ring);
+
+    // Send terminal \0 byte to the client marking end of tranmission
+    sendto(sd, "\0", 1, 0, (struct sockaddr *)&session.client, sizeof(session.client));
+
+    LOG_INFO("[Info] Finished transfer of " << session.filename << ", smoothed RTT "
+             << (int64_t)session.rtt.srtt_us << " us, retransmission timeout " << (int64_t)session.rtt.rto_us << " us, "
+             << session.congestion->name() << " congestion window " << (int64_t)session.congestion->window());
+
+    publish_transfer_metrics(session, "finished");
+}
+
+
+// publish_transfer_metrics
+//
+//  Log the session's metrics as a JSON summary and take them off the stats socket
+//
+void publish_transfer_metrics(transfer_session &session, const std::string &status) {
+    LOG_INFO("[Metrics] " << transfer_metrics_json(*session.metrics, status));
+
+    std::lock_guard<std::mutex> lock(live_transfers_mutex);
+    live_transfers.erase(session.metrics);
+}
+
+
+// session_finished
+//
+//  Check whether every packet of the session's file has been acknowledged
+//
+bool session_finished(transfer_session &session) {
+    return !packet_available(session.ring, session.window_base) && !packet_ring_waiting(session.ring);
+}
+
+
+// service_session
+//
+//  Put new packets on the wire and handle expired timers, recording when the session next
+//  needs attention
+//
+void service_session(int sd, datagram_batch &batch, transfer_session &session) {
+    if (session.selective_repeat) {
+        selective_repeat_service(sd, batch, session);
+    } else {
+        go_back_n_service(sd, batch, session);
+    }
+}
+
+
+// handle_response
+//
+//  Apply an ACK or NAK response from the session's client, counting it in the session's
+//  metrics
+//
+void handle_response(int sd, datagram_batch &batch, transfer_session &session, char response_msg_buffer[]) {
+    session.last_response_time = std::chrono::steady_clock::now();
+    metric_add(session.metrics->segments_received, 1);
+    metric_add(session.metrics->bytes_received, RESPONSE_SIZE);
+
+    if (session.selective_repeat) {
+        selective_repeat_response(sd, batch, session, response_msg_buffer);
+    } else {
+        go_back_n_response(session, response_msg_buffer);
+    }
+}
+
+
+// record_sent_packet
+//
+//  Note when a packet went on the wire and whether it was a retransmission
+//
+void record_sent_packet(transfer_session &session, uint32_t packet_index, bool retransmission) {
+    int slot = packet_index % session.packet_sent_time.size();
+    session.packet_sent_time[slot] = std::chrono::steady_clock::now();
+    session.packet_retransmitted[slot] = retransmission;
+
+    if (retransmission) {
+        session.stats->retransmissions.fetch_add(1, std::memory_order_relaxed);
+        metric_add(session.metrics->retransmissions, 1);
+    } else if (session.ring.compressed) {
+        packet_slot &sent = ring_packet(session.ring, packet_index);
+        if (sent.payload[0] == BLOCK_COMPRESSED) {
+            metric_add(session.metrics->compressed_segments, 1);
+            metric_add(session.metrics->compression_saved_bytes, sent.raw_length + BLOCK_METHOD_SIZE - sent.payload_length);
+        }
+    }
+}
+
+
+// sample_acked_packet
+//
+//  Clear any timeout backoff now that new data got through, and take an RTT sample from the
+//  packet unless it was resent, since then we cannot tell which copy the client answered
+//  (Karn's algorithm)
+//
+void sample_acked_packet(transfer_session &session, uint32_t packet_index) {
+    rtt_reset_backoff(session.rtt);
+
+    int slot = packet_index % session.packet_sent_time.size();
+    if (session.packet_retransmitted[slot]) {
+        return;
+    }
+
+    auto elapsed = std::chrono::steady_clock::now() - session.packet_sent_time[slot];
+    rtt_sample(session.rtt, std::chrono::duration<double, std::micro>(elapsed).count());
+    histogram_record(session.metrics->rtt_us, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+}
+
+
+// record_delivered_bytes
+//
+//  Count every file byte between the first packet sent and the window base as delivered
+//
+void record_delivered_bytes(transfer_session &session) {
+    // A delta's size is only known once it is all written
+    if (session.ring.encoder != NULL) {
+        session.metrics->file_bytes.store(session.ring.delta_length, std::memory_order_relaxed);
+    }
+
+    uint64_t delivered = (uint64_t)(session.window_base - session.start_packet) * session.ring.data_size;
+    session.metrics->bytes_delivered.store(std::min(delivered, session.metrics->file_bytes.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+}
+
+
+// signal_congestion
+//
+//  Tell the session's controller a packet was lost or a timer expired, reacting at most once
+//  per window of packets in flight
+//
+void signal_congestion(transfer_session &session, uint32_t packet_index, bool timeout) {
+    if (timeout) {
+        metric_add(session.metrics->timeouts, 1);
+    }
+
+    if (sequence_before(packet_index, session.recovery_point)) {
+        return;
+    }
+
+    if (timeout) {
+        session.congestion->on_timeout();
+    } else {
+        session.congestion->on_loss();
+    }
+
+    session.recovery_point = session.highest_sent;
+}
+
+
+// send_window
+//
+//  Number of packets the session may have in flight, the smaller of the client's window and
+//  the congestion window
+//
+uint32_t send_window(transfer_session &session) {
+    return std::max(1, std::min(session.window_size, (int)session.congestion->window()));
+}
+
+
+// pacing_ready
+//
+//  Check whether the pacer lets the session put another packet on the wire yet
+//
+bool pacing_ready(transfer_session &session) {
+    return !PACKET_PACING || session.next_send_time <= std::chrono::steady_clock::now();
+}
+
+
+// pace_packet
+//
+//  Move the session's next send time along by one packet at the controller's pacing rate.
+//  Credit saved up while the session had nothing to send only covers a short burst.
+//
+void pace_packet(transfer_session &session) {
+    auto interval = std::chrono::nanoseconds((int64_t)(session.congestion->pacing_interval_us(session.rtt) * 1000));
+    auto earliest = std::chrono::steady_clock::now() - interval * PACING_BURST;
+
+    session.next_send_time = std::max(session.next_send_time, earliest) + interval;
+}
+
+
+// init_fec
+//
+//  Set the session up to follow every block of packets with parity packets, clamping what
+//  the client asked for to what the scheme supports
+//
+void init_fec(transfer_session &session, int scheme, int block, int parity) {
+    session.fec_scheme = scheme;
+    session.fec_count = 0;
+    session.fec_block_start = 0;
+
+    if (scheme == FEC_NONE) {
+        session.fec_block = session.fec_parity = 0;
+        return;
+    }
+
+    // XOR only ever has one parity packet, and Reed-Solomon needs a point in GF(256) for
+    // every packet and parity packet of a block
+    session.fec_block = std::max(1, std::min(FEC_MAX_BLOCK, block));
+    session.fec_parity = scheme == FEC_XOR ? 1 : std::max(1, std::min(std::min(FEC_MAX_PARITY, 256 - session.fec_block), parity));
+
+    int symbol_size = fec_symbol_size(session.ring.payload_size);
+    session.fec_symbols.assign((size_t)session.fec_parity * symbol_size, 0);
+    session.fec_packets.resize(session.fec_parity);
+    for (packet_slot &slot : session.fec_packets) {
+        slot.header_buffer.assign(HEADER_SIZE, '\0');
+        slot.header = &slot.header_buffer[0];
+        slot.data.assign(FEC_HEADER_SIZE + symbol_size, '\0');
+        slot.payload = &slot.data[0];
+        slot.payload_length = slot.data.size();
+    }
+}
+
+
+// add_fec_packet
+//
+//  Code a packet going out for the first time into its block's parity, sending the parity
+//  once the block is complete
+//
+void add_fec_packet(int sd, datagram_batch &batch, transfer_session &session, uint32_t packet_index) {
+    if (session.fec_scheme == FEC_NONE) {
+        return;
+    }
+
+    if (session.fec_count == 0) {
+        session.fec_block_start = packet_index;
+        std::fill(session.fec_symbols.begin(), session.fec_symbols.end(), 0);
+    }
+
+    packet_slot &slot = ring_packet(session.ring, packet_index);
+    fec_encode_symbol(session.fec_scheme, session.fec_parity, session.fec_count, slot.payload, slot.payload_length,
+                      fec_symbol_size(session.ring.payload_size), &session.fec_symbols[0]);
+
+    if (++session.fec_count == session.fec_block) {
+        send_fec_parity(sd, batch, session);
+    }
+}
+
+
+// finish_fec_block
+//
+//  Send the parity of the file's last, short block once every packet has gone out
+//
+void finish_fec_block(int sd, datagram_batch &batch, transfer_session &session) {
+    if (session.fec_count == 0 || session.packet_index != session.highest_sent) {
+        return;
+    }
+
+    // Looking one packet ahead is only safe while its slot is outside the window
+    if (session.packet_index - session.window_base < (uint32_t)session.window_size && !packet_available(session.ring, session.packet_index) &&
+        !packet_ring_waiting(session.ring)) {
+        send_fec_parity(sd, batch, session);
+    }
+}
+
+
+// send_fec_parity
+//
+//  Send the parity packets of the block built up so far and start a new block
+//
+void send_fec_parity(int sd, datagram_batch &batch, transfer_session &session) {
+    int symbol_size = fec_symbol_size(session.ring.payload_size);
+    uint32_t block_number = session.fec_block_start / session.fec_block;
+
+    // The previous block's parity may still be queued straight out of these buffers
+    if (batch.count > 0) {
+        flush_datagram_batch(sd, batch);
+    }
+
+    for (int j = 0; j < session.fec_parity; j++) {
+        packet_slot &slot = session.fec_packets[j];
+        slot.data[0] = (char)j;
+        slot.data[1] = (char)session.fec_count;
+        std::memcpy(&slot.data[FEC_HEADER_SIZE], &session.fec_symbols[(size_t)j * symbol_size], symbol_size);
+
+        build_packet_header(block_number, slot.payload, slot.payload_length, &slot.header_buffer[0]);
+        slot.header_buffer[0] = FEC_PARITY_TERM;
+
+        transmit_slot(sd, batch, session, slot, "parity packet", block_number);
+        metric_add(session.metrics->fec_parity, 1);
+    }
+
+    session.fec_count = 0;
+}
+
+
+// go_back_n_service
+//
+//  Go back to the window base when the oldest packet times out, then fill the window
+//
+void go_back_n_service(int sd, datagram_batch &batch, transfer_session &session) {
+    if (sequence_before(session.window_base, session.highest_sent) && std::chrono::steady_clock::now() - session.base_sent_time >= retransmit_timeout(session.rtt)) {
+        // We timed out, and did not recieve a response from the client.
+        // Back off the timer, go back to the window base and resend everything in flight.
+        rtt_backoff(session.rtt);
+        signal_congestion(session, session.window_base, true);
+        LOG_DEBUG("[Info] Timeout reached, resending from packet " << session.window_base
+                  << " with timeout " << retransmit_timeout(session.rtt).count() << " us");
+        session.packet_index = session.window_base;
+    }
+
+    // Fill the window with as many new packets as it has room for, as fast as the pacer allows
+    while (session.packet_index - session.window_base < send_window(session) && packet_available(session.ring, session.packet_index) && pacing_ready(session)) {
+        bool retransmission = sequence_before(session.packet_index, session.highest_sent);
+        transmit_packet(sd, batch, session, session.packet_index);
+        record_sent_packet(session, session.packet_index, retransmission);
+        pace_packet(session);
+        if (!retransmission) {
+            add_fec_packet(sd, batch, session, session.packet_index);
+        }
+
+        // The timer always tracks the oldest packet in flight
+        if (session.packet_index == session.window_base) {
+            session.base_sent_time = std::chrono::steady_clock::now();
+        }
+
+        session.packet_index++;
+        if (sequence_before(session.highest_sent, session.packet_index)) {
+            session.highest_sent = session.packet_index;
+        }
+    }
+    finish_fec_block(sd, batch, session);
+
+    session.next_deadline = session.base_sent_time + retransmit_timeout(session.rtt);
+
+    // Come back as soon as the pacer lets the next packet out, or straight away to write more
+    // of a delta the next packet waits on
+    if (session.packet_index - session.window_base < send_window(session)) {
+        if (packet_available(session.ring, session.packet_index)) {
+            session.next_deadline = std::min(session.next_deadline, session.next_send_time);
+        } else if (packet_ring_waiting(session.ring)) {
+            session.next_deadline = std::chrono::steady_clock::now();
+        }
+    }
+}
+
+
+// go_back_n_response
+//
+//  Slide the window over a cumulative ACK, or go back to the packet a NAK requests
+//
+void go_back_n_response(transfer_session &session, char response_msg_buffer[]) {
+
+    // Get the response type the received
+    char response_type_buffer[4];
+    std::memcpy(response_type_buffer, response_msg_buffer+PACKET_COUNT_SIZE, 4);
+
+    // Get the packet num requested, this is the next packet the client expects
+    uint32_t packet_num_requested = buffToUint32(response_msg_buffer);
+
+    // Responses outside of the packets currently in flight are stale and ignored
+    uint32_t unack_count = session.highest_sent - session.window_base;
+    uint32_t acked_count = packet_num_requested - session.window_base;
+    if (acked_count > unack_count) {
+        return;
+    }
+
+    if (strcmp(response_type_buffer, ACK_INSTR) == 0) {
+        // Got an ACK response, everything before the requested packet is good
+        LOG_TRACE("[Info] Received an ACK response type");
+        metric_add(session.metrics->acks, 1);
+        LOG_TRACE("\tRequested packet #: " << packet_num_requested);
+    }
+
+    else if (strcmp(response_type_buffer, NAK_INSTR) == 0) {
+        // Got a NAK response, everything before the requested packet is still
+        // good but the requested packet must be resent. Only go back once per
+        // window base since the client NAKs every out of order packet.
+        LOG_DEBUG("[Error] Received a NAK response type");
+        metric_add(session.metrics->naks, 1);
+        LOG_DEBUG("\tRequested packet #: " << packet_num_requested);
+
+        if (packet_num_requested != session.last_fast_retransmit) {
+            session.last_fast_retransmit = packet_num_requested;
+            session.packet_index = packet_num_requested;
+            signal_congestion(session, packet_num_requested, false);
+        }
+    }
+
+    else {
+        // Unsupported response
+        LOG_ERROR("[Error] Received an unknown response type!");
+        return;
+    }
+
+    // Slide the window forward over the cumulatively acknowledged packets, timing the
+    // newest one the response covers. With forward error correction the client holds packets
+    // behind a gap until parity fills it, so a jump over several says nothing about the RTT.
+    // A client coalescing its ACKs answers ack_every packets the moment the last of them
+    // arrives, but fewer only once its delay ran out, so those are not timed either.
+    if (acked_count > 0) {
+        if (acked_count == (uint32_t)session.ack_every || (acked_count > (uint32_t)session.ack_every && session.fec_scheme == FEC_NONE)) {
+            sample_acked_packet(session, packet_num_requested - 1);
+        } else {
+            rtt_reset_backoff(session.rtt);
+        }
+        session.congestion->on_ack(acked_count, session.rtt);
+        session.window_base += acked_count;
+        record_delivered_bytes(session);
+        session.base_sent_time = std::chrono::steady_clock::now();
+    }
+
+    if (sequence_before(session.packet_index, session.window_base)) {
+        session.packet_index = session.window_base;
+    }
+}
+
+
+// selective_repeat_service
+//
+//  Fill the window and resend only the packets whose own timer expired
+//
+void selective_repeat_service(int sd, datagram_batch &batch, transfer_session &session) {
+
+    // Fill the window with as many new packets as it has room for, as fast as the pacer allows
+    while (session.packet_index - session.window_base < send_window(session) && packet_available(session.ring, session.packet_index) && pacing_ready(session)) {
+        transmit_packet(sd, batch, session, session.packet_index);
+        session.packet_acked[session.packet_index % session.packet_acked.size()] = false;
+        record_sent_packet(session, session.packet_index, false);
+        pace_packet(session);
+        add_fec_packet(sd, batch, session, session.packet_index);
+        session.highest_sent = ++session.packet_index;
+    }
+    finish_fec_block(sd, batch, session);
+
+    // Resend only the packets whose own timer ran out, and find the next timer to expire.
+    // However many packets expire together, the timeout only backs off once per pass.
+    auto now = std::chrono::steady_clock::now();
+    auto timeout = retransmit_timeout(session.rtt);
+    bool timed_out = false;
+    session.next_deadline = now + timeout;
+
+    for (uint32_t i = session.window_base; i != session.packet_index; i++) {
+        int slot = i % session.packet_acked.size();
+        if (session.packet_acked[slot]) {
+            continue;
+        }
+
+        if (now - session.packet_sent_time[slot] >= timeout) {
+            LOG_DEBUG("[Info] Timeout reached for packet " << i << ", resending");
+            transmit_packet(sd, batch, session, i);
+            record_sent_packet(session, i, true);
+            timed_out = true;
+        }
+
+        session.next_deadline = std::min(session.next_deadline, session.packet_sent_time[slot] + timeout);
+    }
+
+    if (timed_out) {
+        rtt_backoff(session.rtt);
+        signal_congestion(session, session.window_base, true);
+    }
+
+    // Come back as soon as the pacer lets the next packet out, or straight away to write more
+    // of a delta the next packet waits on
+    if (session.packet_index - session.window_base < send_window(session)) {
+        if (packet_available(session.ring, session.packet_index)) {
+            session.next_deadline = std::min(session.next_deadline, session.next_send_time);
+        } else if (packet_ring_waiting(session.ring)) {
+            session.next_deadline = std::chrono::steady_clock::now();
+        }
+    }
+}
+
+
+// selective_repeat_response
+//
+//  Mark an individually ACKed packet, or every packet before the one a cumulative ACK from a
+//  client coalescing its ACKs names, or resend the single packet a NAK names
+//
+void selective_repeat_response(int sd, datagram_batch &batch, transfer_session &session, char response_msg_buffer[]) {
+    char response_type_buffer[4];
+    std::memcpy(response_type_buffer, response_msg_buffer+PACKET_COUNT_SIZE, 4);
+
+    // In Selective Repeat the packet number names the packet being ACKed or NAKed, and a
+    // cumulative ACK names the packet after the last one it covers
+    uint32_t response_index = buffToUint32(response_msg_buffer);
+    bool cumulative = strcmp(response_type_buffer, CAK_INSTR) == 0;
+
+    if (response_index - session.window_base >= session.packet_index - session.window_base + (cumulative ? 1 : 0)) {
+        return;
+    }
+
+    int slot = response_index % session.packet_acked.size();
+
+    if (cumulative) {
+        LOG_TRACE("[Info] Received a cumulative ACK up to packet " << response_index);
+        metric_add(session.metrics->acks, 1);
+
+        uint32_t newly_acked = 0;
+        for (uint32_t i = session.window_base; i != response_index; i++) {
+            int acked_slot = i % session.packet_acked.size();
+            if (!session.packet_acked[acked_slot]) {
+                session.packet_acked[acked_slot] = true;
+                newly_acked++;
+            }
+        }
+
+        // Only a run of ack_every packets was answered the moment its last packet arrived,
+        // time that one. Fewer were held back until the client's delay ran out.
+        if (newly_acked >= (uint32_t)session.ack_every) {
+            sample_acked_packet(session, response_index - 1);
+        } else if (newly_acked > 0) {
+            rtt_reset_backoff(session.rtt);
+        }
+        if (newly_acked > 0) {
+            session.congestion->on_ack(newly_acked, session.rtt);
+        }
+    }
+
+    else if (strcmp(response_type_buffer, ACK_INSTR) == 0) {
+        LOG_TRACE("[Info] Received an ACK for packet " << response_index);
+        metric_add(session.metrics->acks, 1);
+        if (!session.packet_acked[slot]) {
+            sample_acked_packet(session, response_index);
+            session.congestion->on_ack(1, session.rtt);
+        }
+        session.packet_acked[slot] = true;
+    }
+
+    else if (strcmp(response_type_buffer, NAK_INSTR) == 0) {
+        LOG_DEBUG("[Error] Received a NAK for packet " << response_index);
+        metric_add(session.metrics->naks, 1);
+        if (!session.packet_acked[slot]) {
+            transmit_packet(sd, batch, session, response_index);
+            record_sent_packet(session, response_index, true);
+            signal_congestion(session, response_index, false);
+        }
+    }
+
+    else {
+        LOG_ERROR("[Error] Received an unknown response type!");
+    }
+
+    // Slide the window forward over every packet that has been acknowledged
+    while (session.window_base != session.packet_index && session.packet_acked[session.window_base % session.packet_acked.size()]) {
+        session.window_base++;
+    }
+    record_delivered_bytes(session);
+}